@@ -0,0 +1,515 @@
+/* Copyright (C) 2014 Daniel Dressler and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "logging.h"
+#include "cache.h"
+
+/* Web interface responses of the printer, most recently used first.
+   The printer's pages pull in the same large scripts, style sheets
+   and images on every load, each of which would otherwise occupy a
+   USB interface for as long as it takes to transfer. */
+static struct {
+  pthread_mutex_t lock;
+  struct cache_entry_t *first;
+  struct cache_entry_t *last;
+  size_t size;
+  size_t max_size;
+
+  /* Statistics */
+  size_t hits;
+  size_t revalidations;
+  size_t stores;
+  size_t evictions;
+} cache = {
+  .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static time_t cache_now(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec;
+}
+
+static size_t cache_entry_size(const struct cache_entry_t *entry)
+{
+  return sizeof(*entry) + entry->response_size + entry->not_modified_size +
+    strlen(entry->target);
+}
+
+static void cache_entry_free(struct cache_entry_t *entry)
+{
+  free(entry->target);
+  free(entry->response);
+  free(entry->etag);
+  free(entry->last_modified);
+  free(entry->not_modified);
+  free(entry);
+}
+
+/* Called with the cache locked */
+static void cache_entry_unref(struct cache_entry_t *entry)
+{
+  if (--entry->refs == 0)
+    cache_entry_free(entry);
+}
+
+/* Called with the cache locked */
+static void cache_unlink(struct cache_entry_t *entry)
+{
+  if (entry->prev != NULL)
+    entry->prev->next = entry->next;
+  else
+    cache.first = entry->next;
+  if (entry->next != NULL)
+    entry->next->prev = entry->prev;
+  else
+    cache.last = entry->prev;
+  entry->prev = NULL;
+  entry->next = NULL;
+}
+
+/* Called with the cache locked */
+static void cache_link_first(struct cache_entry_t *entry)
+{
+  entry->prev = NULL;
+  entry->next = cache.first;
+  if (cache.first != NULL)
+    cache.first->prev = entry;
+  else
+    cache.last = entry;
+  cache.first = entry;
+}
+
+/* Called with the cache locked */
+static void cache_remove(struct cache_entry_t *entry)
+{
+  cache_unlink(entry);
+  cache.size -= cache_entry_size(entry);
+  entry->is_stored = 0;
+  cache_entry_unref(entry);
+}
+
+void cache_init(size_t max_size)
+{
+  cache.max_size = max_size;
+  if (max_size > 0)
+    NOTE("Cache: Keeping up to %lu bytes of web interface responses",
+	 max_size);
+}
+
+void cache_shutdown(void)
+{
+  pthread_mutex_lock(&cache.lock);
+  NOTE("Cache: %lu hits, %lu revalidations, %lu stores, %lu evictions",
+       cache.hits, cache.revalidations, cache.stores, cache.evictions);
+  while (cache.first != NULL)
+    cache_remove(cache.first);
+  pthread_mutex_unlock(&cache.lock);
+}
+
+/* Only entries this small are kept, so that a single huge response
+   cannot flush out everything else */
+static size_t cache_max_entry_size(void)
+{
+  return cache.max_size / 4;
+}
+
+static char *header_dup(const struct http_header_index_t *idx,
+			const char *name)
+{
+  size_t size = 0;
+  const char *value = http_header_get(idx, name, &size);
+  if (value == NULL || size == 0)
+    return NULL;
+  return strndup(value, size);
+}
+
+static long cache_max_age(const struct http_header_index_t *idx)
+{
+  if (http_header_has_token(idx, "Cache-Control", "no-cache"))
+    return 0;
+
+  size_t size = 0;
+  const char *value = http_header_get(idx, "Cache-Control", &size);
+  for (size_t i = 0; value != NULL && i + 8 < size; i++) {
+    if ((i > 0 && value[i - 1] != ',' && value[i - 1] != ' ') ||
+	strncasecmp(value + i, "max-age=", 8) != 0)
+      continue;
+    long age = 0;
+    for (i += 8; i < size && isdigit((unsigned char)value[i]); i++)
+      if (age < 60L * 60 * 24 * 365)
+	age = age * 10 + (value[i] - '0');
+    return age;
+  }
+  return 0;
+}
+
+/* Whether the client's conditional request names the entry */
+static int cache_client_has(const struct cache_entry_t *entry,
+			    const struct http_header_index_t *request)
+{
+  if (entry->etag != NULL)
+    return http_header_has_token(request, "If-None-Match", entry->etag);
+
+  size_t size = 0;
+  const char *since = http_header_get(request, "If-Modified-Since", &size);
+  return entry->last_modified != NULL && since != NULL &&
+    size == strlen(entry->last_modified) &&
+    memcmp(since, entry->last_modified, size) == 0;
+}
+
+struct cache_entry_t *cache_request(struct cache_exchange_t *xc,
+				    const struct http_header_index_t *request)
+{
+  memset(xc, 0, sizeof(*xc));
+  if (cache.max_size == 0)
+    return NULL;
+
+  size_t target_size = 0;
+  const char *target = http_header_start_token(request, 1, &target_size);
+  if (!http_header_method_is(request, "GET") || target == NULL ||
+      http_header_get(request, "Authorization", NULL) != NULL ||
+      http_header_get(request, "Range", NULL) != NULL ||
+      http_header_has_token(request, "Cache-Control", "no-store"))
+    return NULL;
+
+  xc->target = strndup(target, target_size);
+  if (xc->target == NULL)
+    return NULL;
+
+  /* A forced reload of the client always goes to the printer */
+  int is_reload =
+    http_header_has_token(request, "Cache-Control", "no-cache") ||
+    http_header_has_token(request, "Pragma", "no-cache");
+  int is_fresh = 0;
+  struct cache_entry_t *entry = NULL;
+  pthread_mutex_lock(&cache.lock);
+  {
+    for (entry = cache.first; entry != NULL; entry = entry->next)
+      if (strcmp(entry->target, xc->target) == 0)
+	break;
+    if (entry != NULL) {
+      entry->refs++;
+      cache_unlink(entry);
+      cache_link_first(entry);
+      /* Revalidations move expires on */
+      is_fresh = !is_reload && cache_now() < entry->expires;
+      if (is_fresh)
+	cache.hits++;
+    }
+  }
+  pthread_mutex_unlock(&cache.lock);
+  if (entry == NULL)
+    return NULL;
+
+  xc->client_has_entry = cache_client_has(entry, request);
+
+  if (is_fresh) {
+    NOTE("Cache: Hit for %s", xc->target);
+    return entry;
+  }
+
+  /* Ask the printer whether the stale copy may still be used */
+  if (entry->etag != NULL || entry->last_modified != NULL) {
+    NOTE("Cache: Revalidating %s", xc->target);
+    xc->entry = entry;
+    return NULL;
+  }
+
+  cache_entry_release(entry);
+  return NULL;
+}
+
+int cache_has(const struct http_header_index_t *request)
+{
+  size_t target_size = 0;
+  const char *target = http_header_start_token(request, 1, &target_size);
+  if (cache.max_size == 0 || target == NULL ||
+      !http_header_method_is(request, "GET"))
+    return 0;
+
+  int found = 0;
+  pthread_mutex_lock(&cache.lock);
+  for (struct cache_entry_t *entry = cache.first;
+       entry != NULL && !found; entry = entry->next)
+    found = strlen(entry->target) == target_size &&
+      memcmp(entry->target, target, target_size) == 0;
+  pthread_mutex_unlock(&cache.lock);
+  return found;
+}
+
+int cache_is_revalidating(const struct cache_exchange_t *xc)
+{
+  return xc->entry != NULL;
+}
+
+uint8_t *cache_revalidation_request(const struct cache_exchange_t *xc,
+				    const struct http_header_index_t *request,
+				    size_t *size)
+{
+  static const char *const conditionals[] = {
+    "If-None-Match", "If-Modified-Since", NULL
+  };
+  const struct cache_entry_t *entry = xc->entry;
+
+  char extra[512];
+  int extra_size = snprintf(extra, sizeof(extra), "%s%s%s%s%s%s",
+			    entry->etag ? "If-None-Match: " : "",
+			    entry->etag ? entry->etag : "",
+			    entry->etag ? "\r\n" : "",
+			    entry->last_modified ? "If-Modified-Since: " : "",
+			    entry->last_modified ? entry->last_modified : "",
+			    entry->last_modified ? "\r\n" : "");
+  if (extra_size < 0 || (size_t)extra_size >= sizeof(extra))
+    return NULL;
+
+  /* Fields are rewritten as "name: value", the start line as is */
+  size_t capacity = request->raw_size + (size_t)extra_size +
+    2 * request->num_fields + 8;
+  uint8_t *rewritten = malloc(capacity);
+  if (rewritten == NULL)
+    return NULL;
+  *size = http_header_rewrite(request, conditionals, extra, rewritten,
+			      capacity);
+  if (*size == 0) {
+    free(rewritten);
+    return NULL;
+  }
+  return rewritten;
+}
+
+static int cache_response_is_storable(const struct http_message_t *msg)
+{
+  const struct http_header_index_t *response = &msg->header;
+  if (http_header_status(response) != 200 ||
+      msg->type != HTTP_CONTENT_LENGTH ||
+      msg->claimed_size > cache_max_entry_size() ||
+      http_header_get(response, "Vary", NULL) != NULL ||
+      http_header_get(response, "Set-Cookie", NULL) != NULL ||
+      http_header_has_token(response, "Cache-Control", "no-store") ||
+      http_header_has_token(response, "Cache-Control", "private"))
+    return 0;
+
+  /* Without validators a response is only of use while fresh */
+  return cache_max_age(response) > 0 ||
+    http_header_get(response, "ETag", NULL) != NULL ||
+    http_header_get(response, "Last-Modified", NULL) != NULL;
+}
+
+static int cache_collect(struct cache_exchange_t *xc,
+			 const struct http_packet_t *pkt)
+{
+  if (xc->size + pkt->filled_size > xc->capacity) {
+    size_t capacity = xc->capacity > 0 ? xc->capacity : pkt->filled_size;
+    while (capacity < xc->size + pkt->filled_size)
+      capacity *= 2;
+    uint8_t *data = realloc(xc->data, capacity);
+    if (data == NULL)
+      return -1;
+    xc->data = data;
+    xc->capacity = capacity;
+  }
+  xc->size += packet_copy(pkt, 0, xc->data + xc->size, pkt->filled_size);
+  return 0;
+}
+
+static void cache_collect_stop(struct cache_exchange_t *xc)
+{
+  free(xc->data);
+  xc->data = NULL;
+  xc->size = 0;
+  xc->capacity = 0;
+  xc->held_size = 0;
+  xc->is_collecting = 0;
+}
+
+enum cache_action_t cache_response(struct cache_exchange_t *xc,
+				   const struct http_message_t *msg,
+				   const struct http_packet_t *pkt)
+{
+  if (xc->target == NULL)
+    return CACHE_FORWARD;
+
+  /* Everything passed on before is no longer needed */
+  if (xc->is_decided && !xc->is_collecting && xc->data != NULL)
+    cache_collect_stop(xc);
+
+  if (!xc->is_decided) {
+    if (cache_collect(xc, pkt) != 0) {
+      ERR("Cache: Failed to alloc space for response of %s", xc->target);
+      cache_collect_stop(xc);
+      xc->is_decided = 1;
+      return xc->held_size > 0 ? CACHE_FLUSH : CACHE_FORWARD;
+    }
+
+    /* Nothing goes out before it is known whether the response is a
+       revalidation's 304, which the cache answers instead */
+    if (msg->header.raw == NULL) {
+      if (xc->entry == NULL)
+	return CACHE_FORWARD;
+      xc->held_size = xc->size;
+      return CACHE_HOLD;
+    }
+
+    xc->is_decided = 1;
+    if (xc->entry != NULL &&
+	http_header_status(&msg->header) == 304) {
+      xc->is_not_modified = 1;
+      cache_collect_stop(xc);
+      return CACHE_DROP;
+    }
+    if (xc->entry != NULL) {
+      cache_entry_release(xc->entry);
+      xc->entry = NULL;
+    }
+    xc->is_collecting = cache_response_is_storable(msg);
+    return xc->held_size > 0 ? CACHE_FLUSH : CACHE_FORWARD;
+  }
+
+  if (xc->is_not_modified)
+    return CACHE_DROP;
+  if (xc->is_collecting &&
+      (xc->size + pkt->filled_size > cache_max_entry_size() ||
+       cache_collect(xc, pkt) != 0))
+    cache_collect_stop(xc);
+  return CACHE_FORWARD;
+}
+
+const uint8_t *cache_held_data(const struct cache_exchange_t *xc,
+			       size_t *size)
+{
+  *size = xc->size;
+  return xc->data;
+}
+
+static struct cache_entry_t *cache_entry_new(struct cache_exchange_t *xc,
+					     const struct http_header_index_t *response)
+{
+  struct cache_entry_t *entry = calloc(1, sizeof(*entry));
+  if (entry == NULL)
+    return NULL;
+
+  entry->refs = 1;
+  entry->target = xc->target;
+  entry->response = xc->data;
+  entry->response_size = xc->size;
+  entry->etag = header_dup(response, "ETag");
+  entry->last_modified = header_dup(response, "Last-Modified");
+  entry->expires = cache_now() + cache_max_age(response);
+  xc->target = NULL;
+  xc->data = NULL;
+  cache_collect_stop(xc);
+
+  char not_modified[512];
+  int size = snprintf(not_modified, sizeof(not_modified),
+		      "HTTP/1.1 304 Not Modified\r\n%s%s%s%s%s%s\r\n",
+		      entry->etag ? "ETag: " : "",
+		      entry->etag ? entry->etag : "",
+		      entry->etag ? "\r\n" : "",
+		      entry->last_modified ? "Last-Modified: " : "",
+		      entry->last_modified ? entry->last_modified : "",
+		      entry->last_modified ? "\r\n" : "");
+  if (size > 0 && (size_t)size < sizeof(not_modified))
+    entry->not_modified = strdup(not_modified);
+  if (entry->not_modified != NULL)
+    entry->not_modified_size = strlen(entry->not_modified);
+  return entry;
+}
+
+struct cache_entry_t *cache_response_done(struct cache_exchange_t *xc,
+					  const struct http_message_t *msg)
+{
+  if (xc->target == NULL || !msg->is_completed)
+    return NULL;
+
+  if (xc->is_not_modified) {
+    struct cache_entry_t *entry = xc->entry;
+    xc->entry = NULL;
+    NOTE("Cache: %s not modified", entry->target);
+    pthread_mutex_lock(&cache.lock);
+    {
+      entry->expires = cache_now() + cache_max_age(&msg->header);
+      cache.revalidations++;
+    }
+    pthread_mutex_unlock(&cache.lock);
+    return entry;
+  }
+
+  if (!xc->is_collecting)
+    return NULL;
+
+  struct cache_entry_t *entry = cache_entry_new(xc, &msg->header);
+  if (entry == NULL)
+    return NULL;
+  size_t size = cache_entry_size(entry);
+
+  pthread_mutex_lock(&cache.lock);
+  {
+    struct cache_entry_t *old;
+    for (old = cache.first; old != NULL; old = old->next)
+      if (strcmp(old->target, entry->target) == 0) {
+	cache_remove(old);
+	break;
+      }
+    while (cache.last != NULL && cache.size + size > cache.max_size) {
+      NOTE("Cache: Evicting %s", cache.last->target);
+      cache_remove(cache.last);
+      cache.evictions++;
+    }
+    NOTE("Cache: Storing %s (%lu bytes)", entry->target,
+	 entry->response_size);
+    entry->is_stored = 1;
+    cache_link_first(entry);
+    cache.size += size;
+    cache.stores++;
+  }
+  pthread_mutex_unlock(&cache.lock);
+  return NULL;
+}
+
+void cache_exchange_end(struct cache_exchange_t *xc)
+{
+  if (xc->entry != NULL)
+    cache_entry_release(xc->entry);
+  free(xc->target);
+  cache_collect_stop(xc);
+  memset(xc, 0, sizeof(*xc));
+}
+
+const uint8_t *cache_entry_data(const struct cache_entry_t *entry,
+				int not_modified, size_t *size)
+{
+  if (not_modified && entry->not_modified != NULL) {
+    *size = entry->not_modified_size;
+    return (const uint8_t *)entry->not_modified;
+  }
+  *size = entry->response_size;
+  return entry->response;
+}
+
+void cache_entry_release(struct cache_entry_t *entry)
+{
+  pthread_mutex_lock(&cache.lock);
+  cache_entry_unref(entry);
+  pthread_mutex_unlock(&cache.lock);
+}
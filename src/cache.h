@@ -0,0 +1,93 @@
+/* Copyright (C) 2014 Daniel Dressler and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. */
+
+#pragma once
+#include <stdint.h>
+#include <time.h>
+
+#include "http.h"
+
+/* Default size of the web asset cache in KiB */
+#define CACHE_DEFAULT_SIZE 4096
+
+/* A stored GET response of the printer's web interface. Entries are
+   shared between connections, the cache holds one reference and every
+   connection serving the entry another. */
+struct cache_entry_t {
+  struct cache_entry_t *prev;
+  struct cache_entry_t *next;
+  unsigned int refs;
+  int is_stored;
+
+  char *target;
+  uint8_t *response;
+  size_t response_size;
+  char *etag;
+  char *last_modified;
+  /* Response to a client's conditional request the entry satisfies */
+  char *not_modified;
+  size_t not_modified_size;
+
+  /* Monotonic time up to which the entry is fresh */
+  time_t expires;
+};
+
+enum cache_action_t {
+  CACHE_FORWARD, /* Pass the packet on to the client */
+  CACHE_HOLD,    /* Keep it back, the status is not known yet */
+  CACHE_FLUSH,   /* Pass on everything held back, up to this packet */
+  CACHE_DROP     /* Never pass it on, the cache answers instead */
+};
+
+/* Cache state of one request and its response */
+struct cache_exchange_t {
+  char *target;
+  /* Stale entry which the request was turned into a revalidation of */
+  struct cache_entry_t *entry;
+  /* The client already has the entry and asked conditionally */
+  int client_has_entry;
+
+  /* Response status known, whether it is a 304 to the revalidation */
+  int is_decided;
+  int is_not_modified;
+
+  /* Response collected for storing */
+  int is_collecting;
+  uint8_t *data;
+  size_t size;
+  size_t capacity;
+  size_t held_size;
+};
+
+void cache_init(size_t);
+void cache_shutdown(void);
+
+struct cache_entry_t *cache_request(struct cache_exchange_t *,
+				    const struct http_header_index_t *);
+int cache_has(const struct http_header_index_t *);
+int cache_is_revalidating(const struct cache_exchange_t *);
+uint8_t *cache_revalidation_request(const struct cache_exchange_t *,
+				    const struct http_header_index_t *,
+				    size_t *);
+enum cache_action_t cache_response(struct cache_exchange_t *,
+				   const struct http_message_t *,
+				   const struct http_packet_t *);
+const uint8_t *cache_held_data(const struct cache_exchange_t *, size_t *);
+struct cache_entry_t *cache_response_done(struct cache_exchange_t *,
+					  const struct http_message_t *);
+void cache_exchange_end(struct cache_exchange_t *);
+
+const uint8_t *cache_entry_data(const struct cache_entry_t *, int,
+				size_t *);
+void cache_entry_release(struct cache_entry_t *);
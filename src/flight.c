@@ -0,0 +1,296 @@
+/* Copyright (C) 2014 Daniel Dressler and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "logging.h"
+#include "ipp.h"
+#include "flight.h"
+
+/* Requests in flight to the printer which others may wait for. Right
+   after the printer gets announced via DNS-SD every client asks it the
+   same questions at once. */
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t landed;
+  struct flight_t *first;
+
+  /* Statistics */
+  size_t coalesced;
+} flights = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .landed = PTHREAD_COND_INITIALIZER
+};
+
+static size_t key_put(uint8_t *key, size_t pos, const void *data,
+		      size_t size)
+{
+  if (data != NULL)
+    memcpy(key + pos, data, size);
+  key[pos + size] = '\0';
+  return pos + size + 1;
+}
+
+/* What makes requests identical: for GETs the target and the fields
+   the response depends on, for IPP queries the whole IPP message but
+   its request-id. Requests of a session or for part of a resource get
+   answers of their own. */
+static uint8_t *flight_key(const struct http_message_t *msg,
+			   const struct http_packet_t *pkt,
+			   size_t *key_size, uint32_t *request_id)
+{
+  const struct http_header_index_t *header = &msg->header;
+  if (!msg->is_completed ||
+      http_header_get(header, "Authorization", NULL) != NULL ||
+      http_header_get(header, "Cookie", NULL) != NULL ||
+      http_header_get(header, "Range", NULL) != NULL)
+    return NULL;
+
+  static const char *const fields[] = {
+    "Host", "If-None-Match", "If-Modified-Since", "Accept-Encoding", NULL
+  };
+  size_t target_size = 0;
+  const char *target = http_header_start_token(header, 1, &target_size);
+  size_t body_size = 0;
+  int is_ipp = 0;
+  if (http_header_method_is(header, "GET") &&
+      msg->type == HTTP_HEADER_ONLY) {
+    is_ipp = 0;
+  } else if (http_header_method_is(header, "POST") &&
+	     msg->type == HTTP_CONTENT_LENGTH &&
+	     http_header_has_token(header, "Content-Type",
+				   "application/ipp")) {
+    ssize_t content_length = http_header_content_length(header);
+    if (content_length < IPP_HEADER_SIZE ||
+	(size_t)content_length > pkt->filled_size ||
+	(size_t)content_length > FLIGHT_MAX_REQUEST)
+      return NULL;
+    body_size = (size_t)content_length;
+    struct ipp_reader_t reader;
+    if (ipp_reader_init(&reader, pkt, pkt->filled_size - body_size) != 0 ||
+	!ipp_op_is_read_only(reader.op_status))
+      return NULL;
+    *request_id = reader.request_id;
+    is_ipp = 1;
+  } else
+    return NULL;
+
+  size_t capacity = 4 + target_size + 1 + body_size + 1;
+  for (size_t i = 0; fields[i] != NULL; i++) {
+    size_t size = 0;
+    http_header_get(header, fields[i], &size);
+    capacity += size + 1;
+  }
+  uint8_t *key = malloc(capacity);
+  if (key == NULL)
+    return NULL;
+
+  size_t pos = key_put(key, 0, is_ipp ? "IPP" : "GET", 3);
+  pos = key_put(key, pos, target, target_size);
+  for (size_t i = 0; fields[i] != NULL; i++) {
+    size_t size = 0;
+    const char *value = http_header_get(header, fields[i], &size);
+    pos = key_put(key, pos, value, value != NULL ? size : 0);
+  }
+
+  if (is_ipp) {
+    uint8_t *ipp = key + pos;
+    packet_copy(pkt, pkt->filled_size - body_size, ipp, body_size);
+    memset(ipp + 4, 0, 4);
+    pos = key_put(key, pos, NULL, body_size);
+  }
+  *key_size = pos;
+  return key;
+}
+
+/* Called with flights locked */
+static void flight_unlist(struct flight_t *flight)
+{
+  for (struct flight_t **link = &flights.first; *link != NULL;
+       link = &(*link)->next)
+    if (*link == flight) {
+      *link = flight->next;
+      flight->next = NULL;
+      return;
+    }
+}
+
+struct flight_t *flight_join(const struct http_message_t *msg,
+			     const struct http_packet_t *pkt,
+			     int *is_leader, uint32_t *request_id)
+{
+  size_t key_size = 0;
+  *request_id = 0;
+  uint8_t *key = flight_key(msg, pkt, &key_size, request_id);
+  if (key == NULL)
+    return NULL;
+
+  struct flight_t *flight = NULL;
+  pthread_mutex_lock(&flights.lock);
+  {
+    for (flight = flights.first; flight != NULL; flight = flight->next)
+      if (flight->key_size == key_size &&
+	  memcmp(flight->key, key, key_size) == 0)
+	break;
+    if (flight != NULL) {
+      flight->refs++;
+      flight->num_waiting++;
+      flights.coalesced++;
+      *is_leader = 0;
+    } else {
+      flight = calloc(1, sizeof(*flight));
+      if (flight != NULL) {
+	flight->refs = 1;
+	flight->key = key;
+	flight->key_size = key_size;
+	flight->next = flights.first;
+	flights.first = flight;
+	key = NULL;
+	*is_leader = 1;
+      }
+    }
+  }
+  pthread_mutex_unlock(&flights.lock);
+  free(key);
+  return flight;
+}
+
+/* Returns 0 once the response is there, -1 if the request has to go to
+   the printer after all */
+int flight_wait(struct flight_t *flight)
+{
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += FLIGHT_WAIT_TIMEOUT;
+
+  int status = 0;
+  pthread_mutex_lock(&flights.lock);
+  {
+    while (!flight->is_done && !g_options.terminate && status == 0)
+      status = pthread_cond_timedwait(&flights.landed, &flights.lock,
+				      &deadline);
+    status = flight->is_done && !flight->is_failed ? 0 : -1;
+  }
+  pthread_mutex_unlock(&flights.lock);
+  return status;
+}
+
+uint8_t *flight_response(const struct flight_t *flight, uint32_t request_id,
+			 size_t *size)
+{
+  uint8_t *response = malloc(flight->response_size);
+  if (response == NULL)
+    return NULL;
+  memcpy(response, flight->response, flight->response_size);
+  if (flight->ipp_offset > 0) {
+    uint8_t *ipp = response + flight->ipp_offset;
+    ipp[4] = (uint8_t)(request_id >> 24);
+    ipp[5] = (uint8_t)(request_id >> 16);
+    ipp[6] = (uint8_t)(request_id >> 8);
+    ipp[7] = (uint8_t)request_id;
+  }
+  *size = flight->response_size;
+  return response;
+}
+
+static void flight_collect_stop(struct flight_t *flight)
+{
+  free(flight->response);
+  flight->response = NULL;
+  flight->response_size = 0;
+  flight->capacity = 0;
+  flight->is_failed = 1;
+}
+
+void flight_collect(struct flight_t *flight, const struct http_message_t *msg,
+		    const struct http_packet_t *pkt)
+{
+  if (flight->is_failed)
+    return;
+
+  /* Only self-delimiting responses can be handed on */
+  if (msg->header.raw != NULL &&
+      ((msg->type != HTTP_CONTENT_LENGTH && msg->type != HTTP_HEADER_ONLY) ||
+       msg->claimed_size > FLIGHT_MAX_RESPONSE)) {
+    flight_collect_stop(flight);
+    return;
+  }
+
+  size_t size = flight->response_size + pkt->filled_size;
+  if (size > flight->capacity) {
+    size_t capacity = flight->capacity > 0 ? flight->capacity : 4096;
+    while (capacity < size)
+      capacity *= 2;
+    uint8_t *response = realloc(flight->response, capacity);
+    if (response == NULL) {
+      flight_collect_stop(flight);
+      return;
+    }
+    flight->response = response;
+    flight->capacity = capacity;
+  }
+  flight->response_size += packet_copy(pkt, 0, flight->response +
+				       flight->response_size,
+				       pkt->filled_size);
+}
+
+/* The leader passes the complete response on to everyone waiting, or,
+   without one, lets them go to the printer themselves */
+void flight_land(struct flight_t *flight, const struct http_message_t *msg)
+{
+  pthread_mutex_lock(&flights.lock);
+  {
+    if (flight->is_done)
+      goto unlock;
+    if (msg == NULL || !msg->is_completed)
+      flight_collect_stop(flight);
+
+    if (!flight->is_failed &&
+	http_header_has_token(&msg->header, "Content-Type",
+			      "application/ipp")) {
+      ssize_t ipp_size = http_header_content_length(&msg->header);
+      if (ipp_size >= IPP_HEADER_SIZE &&
+	  (size_t)ipp_size <= flight->response_size)
+	flight->ipp_offset = flight->response_size - (size_t)ipp_size;
+    }
+
+    if (flight->num_waiting > 0)
+      NOTE("Flight: Handing response on to %lu waiting requests",
+	   flight->num_waiting);
+    flight->is_done = 1;
+    flight_unlist(flight);
+    pthread_cond_broadcast(&flights.landed);
+  }
+ unlock:
+  pthread_mutex_unlock(&flights.lock);
+}
+
+void flight_release(struct flight_t *flight)
+{
+  pthread_mutex_lock(&flights.lock);
+  {
+    if (--flight->refs == 0) {
+      flight_unlist(flight);
+      free(flight->key);
+      free(flight->response);
+      free(flight);
+    }
+  }
+  pthread_mutex_unlock(&flights.lock);
+}
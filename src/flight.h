@@ -0,0 +1,54 @@
+/* Copyright (C) 2014 Daniel Dressler and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. */
+
+#pragma once
+#include <stdint.h>
+
+#include "http.h"
+
+/* In seconds */
+#define FLIGHT_WAIT_TIMEOUT 30
+#define FLIGHT_MAX_REQUEST (1 << 16)
+#define FLIGHT_MAX_RESPONSE (1 << 20)
+
+/* An idempotent request on its way to the printer. Identical requests
+   arriving meanwhile wait for its response instead of sending their
+   own. */
+struct flight_t {
+  struct flight_t *next;
+  unsigned int refs;
+
+  uint8_t *key;
+  size_t key_size;
+
+  int is_done;
+  int is_failed;
+  size_t num_waiting;
+
+  /* Response as received, and where its IPP message starts for
+     patching in each waiter's request-id, 0 if it is no IPP */
+  uint8_t *response;
+  size_t response_size;
+  size_t capacity;
+  size_t ipp_offset;
+};
+
+struct flight_t *flight_join(const struct http_message_t *,
+			     const struct http_packet_t *, int *, uint32_t *);
+int flight_wait(struct flight_t *);
+uint8_t *flight_response(const struct flight_t *, uint32_t, size_t *);
+void flight_collect(struct flight_t *, const struct http_message_t *,
+		    const struct http_packet_t *);
+void flight_land(struct flight_t *, const struct http_message_t *);
+void flight_release(struct flight_t *);
@@ -21,31 +21,265 @@
 #include <assert.h>
 
 #include <limits.h>
+#include <pthread.h>
 
 #include "http.h"
 #include "logging.h"
 
-#define BUFFER_STEP (1 << 12)
+#define MAX_PACKET_SIZE (1 << 26) /* 64MiB */
 
-struct http_message_t *http_message_new()
+/* What the buffers of all pools add up to, for the statistics */
+static struct {
+  pthread_mutex_t lock;
+  size_t held;
+  size_t peak_held;
+  size_t num_pools;
+  size_t peak_pool_held;
+} buffers = {
+  .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+void http_pool_init(struct http_pool_t *pool)
 {
-  struct http_message_t *msg = calloc(1, sizeof(*msg));
-  if (msg == NULL) {
-    ERR("failed to alloc space for http message");
-    return NULL;
+  memset(pool, 0, sizeof(*pool));
+  pthread_mutex_lock(&buffers.lock);
+  buffers.num_pools++;
+  pthread_mutex_unlock(&buffers.lock);
+}
+
+/* Takes up to size bytes of the pool's budget for a buffer, segments
+   kept for reuse are given up for it first. Returns how many bytes
+   were taken, 0 when not even least are left. */
+size_t http_pool_take(struct http_pool_t *pool, size_t size, size_t least)
+{
+  if (pool == NULL)
+    return size;
+
+  if (pool->budget > 0) {
+    while (pool->held + size > pool->budget &&
+	   pool->free_segments != NULL) {
+      struct http_segment_t *seg = pool->free_segments;
+      pool->free_segments = seg->next;
+      pool->num_free_segments--;
+      free(seg);
+      http_pool_give(pool, HTTP_SEGMENT_SIZE);
+    }
+    size_t room = pool->budget > pool->held ? pool->budget - pool->held : 0;
+    if (room < least)
+      return 0;
+    if (size > room)
+      size = room;
+  }
+
+  pool->held += size;
+  if (pool->held > pool->peak_held)
+    pool->peak_held = pool->held;
+  pthread_mutex_lock(&buffers.lock);
+  buffers.held += size;
+  if (buffers.held > buffers.peak_held)
+    buffers.peak_held = buffers.held;
+  if (pool->peak_held > buffers.peak_pool_held)
+    buffers.peak_pool_held = pool->peak_held;
+  pthread_mutex_unlock(&buffers.lock);
+  return size;
+}
+
+void http_pool_give(struct http_pool_t *pool, size_t size)
+{
+  if (pool == NULL)
+    return;
+  pool->held -= size;
+  pthread_mutex_lock(&buffers.lock);
+  buffers.held -= size;
+  pthread_mutex_unlock(&buffers.lock);
+}
+
+void http_report(void)
+{
+  pthread_mutex_lock(&buffers.lock);
+  NOTE("HTTP: %lu KiB of buffers held by %lu connections (peak %lu KiB), "
+       "at most %lu KiB by one", buffers.held / 1024, buffers.num_pools,
+       buffers.peak_held / 1024, buffers.peak_pool_held / 1024);
+  pthread_mutex_unlock(&buffers.lock);
+}
+
+void http_pool_destroy(struct http_pool_t *pool)
+{
+  while (pool->free_messages != NULL) {
+    struct http_message_t *msg = pool->free_messages;
+    pool->free_messages = msg->pool_next;
+    free(msg);
+  }
+  while (pool->free_packets != NULL) {
+    struct http_packet_t *pkt = pool->free_packets;
+    pool->free_packets = pkt->pool_next;
+    free(pkt);
+  }
+  while (pool->free_segments != NULL) {
+    struct http_segment_t *seg = pool->free_segments;
+    pool->free_segments = seg->next;
+    free(seg);
+    http_pool_give(pool, HTTP_SEGMENT_SIZE);
+  }
+  free(pool->free_header);
+  if (pool->segments_in_use > 0)
+    WARN("HTTP: Pool destroyed with %lu segments in use",
+	 pool->segments_in_use);
+  pthread_mutex_lock(&buffers.lock);
+  buffers.held -= pool->held;
+  buffers.num_pools--;
+  pthread_mutex_unlock(&buffers.lock);
+  memset(pool, 0, sizeof(*pool));
+}
+
+static struct http_segment_t *segment_new(struct http_pool_t *pool)
+{
+  struct http_segment_t *seg = NULL;
+  if (pool != NULL && pool->free_segments != NULL) {
+    seg = pool->free_segments;
+    pool->free_segments = seg->next;
+    pool->num_free_segments--;
+    pool->reuses++;
+  } else {
+    if (http_pool_take(pool, HTTP_SEGMENT_SIZE, HTTP_SEGMENT_SIZE) == 0)
+      return NULL;
+    /* Not zeroed, only bytes up to end are ever read */
+    seg = malloc(sizeof(*seg) + HTTP_SEGMENT_SIZE);
+    if (seg == NULL) {
+      ERR("failed to alloc packet segment");
+      http_pool_give(pool, HTTP_SEGMENT_SIZE);
+      return NULL;
+    }
+    seg->data = (uint8_t *)(seg + 1);
+    if (pool != NULL)
+      pool->allocations++;
+  }
+  seg->next = NULL;
+  seg->pool = pool;
+  seg->refs = 1;
+  seg->end = 0;
+
+  if (pool != NULL) {
+    pool->segments_in_use++;
+    if (pool->segments_in_use > pool->peak_segments_in_use)
+      pool->peak_segments_in_use = pool->segments_in_use;
+  }
+  return seg;
+}
+
+static void segment_release(struct http_segment_t *seg)
+{
+  struct http_pool_t *pool = seg->pool;
+  if (pool == NULL) {
+    free(seg);
+    return;
+  }
+
+  pool->segments_in_use--;
+  if (pool->num_free_segments >= HTTP_POOL_MAX_SEGMENTS) {
+    free(seg);
+    http_pool_give(pool, HTTP_SEGMENT_SIZE);
+    return;
+  }
+  seg->next = pool->free_segments;
+  pool->free_segments = seg;
+  pool->num_free_segments++;
+}
+
+/* Drops one reference on every segment from head up to and including
+   last, or up to the end of the chain if last is NULL */
+static void segment_chain_unref(struct http_segment_t *head,
+				struct http_segment_t *last)
+{
+  while (head != NULL) {
+    struct http_segment_t *next = head->next;
+    int is_last = head == last;
+    if (--head->refs == 0)
+      segment_release(head);
+    if (is_last)
+      break;
+    head = next;
+  }
+}
+
+static uint8_t *pool_header_alloc(struct http_pool_t *pool, size_t size,
+				  size_t *capacity)
+{
+  if (pool != NULL && pool->free_header != NULL &&
+      pool->free_header_capacity >= size) {
+    uint8_t *raw = pool->free_header;
+    *capacity = pool->free_header_capacity;
+    pool->free_header = NULL;
+    pool->free_header_capacity = 0;
+    pool->reuses++;
+    return raw;
   }
 
-  msg->spare_capacity = 0;
+  uint8_t *raw = malloc(size);
+  if (raw != NULL) {
+    *capacity = size;
+    if (pool != NULL)
+      pool->allocations++;
+  }
+  return raw;
+}
+
+static void pool_header_free(struct http_pool_t *pool, uint8_t *raw,
+			     size_t capacity)
+{
+  if (raw == NULL)
+    return;
+
+  /* Keep the largest header copy seen for the next message */
+  if (pool != NULL && capacity > pool->free_header_capacity) {
+    free(pool->free_header);
+    pool->free_header = raw;
+    pool->free_header_capacity = capacity;
+    return;
+  }
+  free(raw);
+}
+
+struct http_message_t *http_message_new(struct http_pool_t *pool)
+{
+  struct http_message_t *msg = NULL;
+  if (pool != NULL && pool->free_messages != NULL) {
+    msg = pool->free_messages;
+    pool->free_messages = msg->pool_next;
+    pool->num_free_messages--;
+    pool->reuses++;
+    memset(msg, 0, sizeof(*msg));
+  } else {
+    msg = calloc(1, sizeof(*msg));
+    if (msg == NULL) {
+      ERR("failed to alloc space for http message");
+      return NULL;
+    }
+    if (pool != NULL)
+      pool->allocations++;
+  }
+  msg->pool = pool;
+
   msg->spare_filled = 0;
-  msg->spare_buffer = NULL;
+  msg->spare_offset = 0;
+  msg->spare_head = NULL;
 
   return msg;
 }
 
 void message_free(struct http_message_t *msg)
 {
-  free(msg->spare_buffer);
-  free(msg);
+  struct http_pool_t *pool = msg->pool;
+  pool_header_free(pool, msg->header.raw, msg->header.raw_capacity);
+  segment_chain_unref(msg->spare_head, NULL);
+
+  if (pool == NULL || pool->num_free_messages >= HTTP_POOL_MAX_STRUCTS) {
+    free(msg);
+    return;
+  }
+  msg->pool_next = pool->free_messages;
+  pool->free_messages = msg;
+  pool->num_free_messages++;
 }
 
 static void packet_check_completion(struct http_packet_t *pkt)
@@ -55,10 +289,6 @@ static void packet_check_completion(struct http_packet_t *pkt)
   if (msg->claimed_size && msg->received_size >= msg->claimed_size) {
     msg->is_completed = 1;
     NOTE("http: Message completed: Received size >= claimed size");
-
-    /* Sanity check */
-    if (msg->spare_filled > 0)
-      ERR_AND_EXIT("Msg spare not empty upon completion");
   }
 
   /* Pkt full */
@@ -74,52 +304,24 @@ static void packet_check_completion(struct http_packet_t *pkt)
   }
 }
 
-static int doesMatch(const char *matcher, size_t matcher_len,
-                     const uint8_t *key, size_t key_len)
-{
-  for (size_t i = 0; i < matcher_len; i++)
-    if (i >= key_len || matcher[i] != key[i])
-      return 0;
-  return 1;
-}
-
-static int inspect_header_field(struct http_packet_t *pkt, size_t header_size,
-                                char *key, size_t key_size)
+/* Writable bytes left in the packet: the rest of the write segment
+   plus every segment appended after it */
+static void packet_update_capacity(struct http_packet_t *pkt)
 {
-  /* Find key */
-  uint8_t *pos = memmem(pkt->buffer, header_size, key, key_size);
-  if (pos == NULL)
-    return -1;
-
-  /* Find first digit */
-  size_t number_pos = (size_t) (pos - pkt->buffer) + key_size;
-  while (number_pos < pkt->filled_size && !isdigit(pkt->buffer[number_pos]))
-    ++number_pos;
-
-  /* Find next non-digit */
-  size_t number_end = number_pos;
-  while (number_end < pkt->filled_size && isdigit(pkt->buffer[number_end]))
-    ++number_end;
-
-  /* Failed to find next non-digit
-     header field might be broken */
-  if (number_end >= pkt->filled_size)
-    return -1;
-
-  /* Temporary stringification of buffer for atoi() */
-  uint8_t original_char = pkt->buffer[number_end];
-  pkt->buffer[number_end] = '\0';
-  int val = atoi((const char *)(pkt->buffer + number_pos));
-
-  /* Restore buffer */
-  pkt->buffer[number_end] = original_char;
-  return val;
+  size_t capacity = pkt->filled_size;
+  struct http_segment_t *seg = pkt->write_seg;
+  if (seg != NULL) {
+    capacity += HTTP_SEGMENT_SIZE - seg->end;
+    for (seg = seg->next; seg != NULL; seg = seg->next)
+      capacity += HTTP_SEGMENT_SIZE;
+  }
+  pkt->buffer_capacity = capacity;
 }
 
 static void packet_store_excess(struct http_packet_t *pkt)
 {
   struct http_message_t *msg = pkt->parent_message;
-  if (msg->spare_buffer != NULL)
+  if (msg->spare_head != NULL)
     ERR_AND_EXIT("Do not store excess to non-empty packet");
 
   if (pkt->expected_size >= pkt->filled_size)
@@ -129,170 +331,470 @@ static void packet_store_excess(struct http_packet_t *pkt)
   size_t non_spare = pkt->expected_size;
   NOTE("HTTP: Storing %d bytes of excess", spare_size);
 
-  /* Align to BUFFER_STEP */
-  size_t needed_size = 0;
-  needed_size += spare_size / BUFFER_STEP;
-  needed_size += (spare_size % BUFFER_STEP) > 0 ? BUFFER_STEP : 0;
-
-  if (msg->spare_buffer == NULL) {
-    uint8_t *buffer = calloc(1, needed_size);
-    if (buffer == NULL)
-      ERR_AND_EXIT("Failed to alloc msg spare buffer");
-    msg->spare_buffer = buffer;
+  /* Find the segment in which the excess starts */
+  struct http_segment_t *seg = pkt->head;
+  size_t offset = pkt->head_offset;
+  size_t remaining = non_spare;
+  while (remaining > seg->end - offset) {
+    remaining -= seg->end - offset;
+    seg = seg->next;
+    offset = 0;
+  }
+  offset += remaining;
+
+  /* Hand the excess on by reference. If it starts within a segment
+     that segment is shared by the packet and the message's spare. */
+  struct http_segment_t *spare = seg;
+  if (offset == seg->end) {
+    spare = seg->next;
+    offset = 0;
+  } else {
+    seg->refs++;
   }
+  msg->spare_head = spare;
+  msg->spare_offset = offset;
+  msg->spare_filled = spare_size;
 
-  memcpy(msg->spare_buffer, pkt->buffer + non_spare, spare_size);
-  pkt->filled_size = non_spare;
+  /* The excess belongs to whatever message follows */
+  msg->received_size -= spare_size;
 
-  msg->spare_capacity = needed_size;
-  msg->spare_filled = spare_size;
+  pkt->tail = seg;
+  pkt->write_seg = NULL;
+  pkt->filled_size = non_spare;
+  packet_update_capacity(pkt);
 }
 
 static void packet_take_spare(struct http_packet_t *pkt)
 {
   struct http_message_t *msg = pkt->parent_message;
-  if (msg->spare_filled == 0)
-    return;
-
-  if (msg->spare_buffer == NULL)
+  if (msg->spare_filled == 0 || msg->spare_head == NULL)
     return;
 
   if (pkt->filled_size > 0)
     ERR_AND_EXIT("pkt should be empty when loading msg spare");
 
-  /* Take message's buffer */
-  size_t msg_size = msg->spare_capacity;
-  size_t msg_filled = msg->spare_filled;
-  uint8_t *msg_buffer = msg->spare_buffer;
+  /* Take message's segments. Writing continues after the last one
+     holding data, empty ones may follow from earlier expansion. */
+  pkt->head = msg->spare_head;
+  pkt->head_offset = msg->spare_offset;
+  pkt->filled_size = msg->spare_filled;
+  pkt->write_seg = pkt->head;
+  for (struct http_segment_t *seg = pkt->head->next;
+       seg != NULL && seg->end > 0; seg = seg->next)
+    pkt->write_seg = seg;
+  pkt->tail = pkt->write_seg;
+  while (pkt->tail->next != NULL)
+    pkt->tail = pkt->tail->next;
+  packet_update_capacity(pkt);
+
+  msg->received_size += msg->spare_filled;
+  msg->spare_filled = 0;
+  msg->spare_offset = 0;
+  msg->spare_head = NULL;
+}
 
-  pkt->buffer_capacity = msg_size;
-  pkt->filled_size = msg_filled;
-  pkt->buffer = msg_buffer;
+void message_pass_spare(struct http_message_t *from,
+			struct http_message_t *to)
+{
+  if (to->spare_head != NULL)
+    ERR_AND_EXIT("Do not pass spare to message with spare");
 
-  msg->spare_capacity = 0;
-  msg->spare_filled = 0;
-  msg->spare_buffer = NULL;
+  to->spare_head = from->spare_head;
+  to->spare_offset = from->spare_offset;
+  to->spare_filled = from->spare_filled;
+
+  from->spare_filled = 0;
+  from->spare_offset = 0;
+  from->spare_head = NULL;
+}
+
+size_t message_spare_copy(const struct http_message_t *msg, void *buf,
+			  size_t size)
+{
+  size_t copied = 0;
+  size_t start = msg->spare_offset;
+  size_t remaining = msg->spare_filled;
+  for (struct http_segment_t *seg = msg->spare_head;
+       seg != NULL && remaining > 0 && copied < size;
+       seg = seg->next, start = 0) {
+    size_t part = seg->end - start;
+    if (part > remaining)
+      part = remaining;
+    if (part > size - copied)
+      part = size - copied;
+    memcpy((uint8_t *)buf + copied, seg->data + start, part);
+    copied += part;
+    remaining -= part;
+  }
+  return copied;
+}
+
+void message_spare_skip(struct http_message_t *msg, size_t size)
+{
+  if (size > msg->spare_filled)
+    size = msg->spare_filled;
+  msg->spare_filled -= size;
+  if (msg->spare_filled == 0) {
+    segment_chain_unref(msg->spare_head, NULL);
+    msg->spare_head = NULL;
+    msg->spare_offset = 0;
+    return;
+  }
+
+  /* Drop the segments skipped completely */
+  size_t offset = msg->spare_offset + size;
+  while (offset >= msg->spare_head->end) {
+    struct http_segment_t *seg = msg->spare_head;
+    offset -= seg->end;
+    msg->spare_head = seg->next;
+    segment_chain_unref(seg, seg);
+  }
+  msg->spare_offset = offset;
+}
+
+/* Keeps bytes read beyond the end of a message for the next one */
+int message_spare_put(struct http_message_t *msg, const void *data,
+		      size_t size)
+{
+  if (msg->spare_head != NULL)
+    ERR_AND_EXIT("Do not put spare to message with spare");
+
+  struct http_segment_t **link = &msg->spare_head;
+  for (size_t put = 0; put < size; link = &(*link)->next) {
+    struct http_segment_t *seg = segment_new(msg->pool);
+    if (seg == NULL)
+      return -1;
+    seg->end = size - put < HTTP_SEGMENT_SIZE ? size - put :
+      HTTP_SEGMENT_SIZE;
+    memcpy(seg->data, (const uint8_t *)data + put, seg->end);
+    put += seg->end;
+    *link = seg;
+    msg->spare_filled = put;
+  }
+  return 0;
+}
+
+/* Accounts body bytes passed on without a packet. Returns how many of
+   them belong to the message, the rest follows its end. */
+size_t message_body_received(struct http_message_t *msg,
+			     const uint8_t *data, size_t size)
+{
+  if (msg->type == HTTP_CHUNKED) {
+    int boundary = 0;
+    size_t used = http_chunk_decode(&msg->chunk, data, size, &boundary);
+    if (msg->chunk.state == CHUNK_ERROR) {
+      ERR("Malformed chunk-transport http message received");
+      used = size;
+    }
+    if (msg->chunk.state == CHUNK_ERROR || msg->chunk.state == CHUNK_DONE) {
+      NOTE("Found end chunked packet");
+      msg->is_completed = 1;
+    }
+    msg->received_size += used;
+    return used;
+  }
+
+  if (msg->claimed_size > msg->received_size &&
+      size > msg->claimed_size - msg->received_size)
+    size = msg->claimed_size - msg->received_size;
+  msg->received_size += size;
+  if (msg->received_size >= msg->claimed_size) {
+    msg->is_completed = 1;
+    NOTE("http: Message completed: Received size >= claimed size");
+  }
+  return size;
+}
+
+void packet_unget(struct http_packet_t *pkt)
+{
+  struct http_message_t *msg = pkt->parent_message;
+
+  /* The packet's segments run on into the message's spare, possibly
+     sharing the segment where the excess starts. Merge both into one
+     spare chain holding a single reference per segment. */
+  if (pkt->head != NULL && pkt->filled_size > 0) {
+    if (msg->spare_head != NULL && msg->spare_head == pkt->tail)
+      pkt->tail->refs--;
+    else if (msg->spare_head == NULL && pkt->tail->next != NULL)
+      ERR_AND_EXIT("Packet to unget is not the end of its chain");
+    msg->spare_filled += pkt->filled_size;
+    msg->spare_offset = pkt->head_offset;
+    msg->spare_head = pkt->head;
+    pkt->head = NULL;
+    pkt->tail = NULL;
+  }
+  packet_free(pkt);
+
+  /* Forget everything learned from the header */
+  pool_header_free(msg->pool, msg->header.raw, msg->header.raw_capacity);
+  memset(&msg->header, 0, sizeof(msg->header));
+  memset(&msg->chunk, 0, sizeof(msg->chunk));
+  msg->type = HTTP_UNSET;
+  msg->is_bulk = 0;
+  msg->unreceived_size = 0;
+  msg->is_completed = 0;
+  msg->claimed_size = 0;
+  msg->received_size = 0;
+}
+
+size_t packet_iovec(const struct http_packet_t *pkt, size_t offset,
+		    struct iovec *iov, size_t max_iov)
+{
+  size_t count = 0;
+  size_t remaining = pkt->filled_size;
+  size_t start = pkt->head_offset;
+  for (struct http_segment_t *seg = pkt->head;
+       seg != NULL && remaining > 0 && count < max_iov;
+       seg = seg->next, start = 0) {
+    size_t size = seg->end - start;
+    if (size > remaining)
+      size = remaining;
+    remaining -= size;
+
+    if (offset >= size) {
+      offset -= size;
+      continue;
+    }
+    iov[count].iov_base = seg->data + start + offset;
+    iov[count].iov_len = size - offset;
+    offset = 0;
+    count++;
+
+    if (seg == pkt->tail)
+      break;
+  }
+  return count;
+}
+
+size_t packet_copy(const struct http_packet_t *pkt, size_t offset,
+		   void *dst, size_t size)
+{
+  struct iovec iov[8];
+  size_t copied = 0;
+  while (copied < size) {
+    size_t count = packet_iovec(pkt, offset + copied, iov, 8);
+    if (count == 0)
+      break;
+    for (size_t i = 0; i < count && copied < size; i++) {
+      size_t part = iov[i].iov_len;
+      if (part > size - copied)
+	part = size - copied;
+      memcpy((uint8_t *)dst + copied, iov[i].iov_base, part);
+      copied += part;
+    }
+  }
+  return copied;
 }
 
-static ssize_t packet_find_chunked_size(struct http_packet_t *pkt)
+uint8_t *packet_write_ptr(struct http_packet_t *pkt, size_t align,
+			  size_t *space)
+{
+  /* Readers which need room in multiples of align, like USB bulk
+     reads, leave a too small rest of a segment unused */
+  struct http_segment_t *seg = pkt->write_seg;
+  while (seg == NULL || HTTP_SEGMENT_SIZE - seg->end < align) {
+    if (seg == NULL)
+      return NULL;
+    if (seg->next == NULL && packet_expand(pkt) <= 0)
+      return NULL;
+    seg = seg->next;
+    pkt->write_seg = seg;
+    packet_update_capacity(pkt);
+  }
+
+  size_t room = HTTP_SEGMENT_SIZE - seg->end;
+  *space = room - room % align;
+  return seg->data + seg->end;
+}
+
+int packet_append(struct http_packet_t *pkt, const void *data, size_t size)
+{
+  size_t appended = 0;
+  while (appended < size) {
+    size_t space = 0;
+    uint8_t *dst = packet_write_ptr(pkt, 1, &space);
+    if (dst == NULL)
+      return -1;
+    if (space > size - appended)
+      space = size - appended;
+    memcpy(dst, (const uint8_t *)data + appended, space);
+    packet_mark_received(pkt, space);
+    appended += space;
+  }
+  return 0;
+}
+
+char *packet_hexdump(const struct http_packet_t *pkt)
+{
+  if (!g_options.verbose_mode)
+    return "";
+
+  uint8_t *flat = malloc(pkt->filled_size + 1);
+  if (flat == NULL)
+    return "*** Failed to allocate memory for hex dump! ***";
+  packet_copy(pkt, 0, flat, pkt->filled_size);
+  char *dump = hexdump(flat, (int)pkt->filled_size);
+  free(flat);
+  return dump;
+}
+
+static int chunk_hex_value(uint8_t c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+size_t http_chunk_decode(struct http_chunk_decoder_t *chunk,
+			 const uint8_t *buf, size_t size, int *boundary)
 {
   /* NOTE:
      chunks can have trailers which are
      tacked on http header fields.
      NOTE:
      chunks may also have extensions.
-     No one uses or supports them. */
-
-  /* Find end of size string */
-  if (pkt->filled_size >= SSIZE_MAX)
-    ERR_AND_EXIT("Buffer beyond sane size");
-
-  ssize_t max = (ssize_t) pkt->filled_size;
-  ssize_t size_end = -1;
-  ssize_t miniheader_end = -1;
-  ssize_t delimiter_start = -1;
-  for (ssize_t i = 0; i < max; i++) {
-
-    uint8_t *buf = pkt->buffer;
-    if (size_end < 0) {
-      /* No extension */
-      if (i + 1 < max &&
-	  (buf[i] == '\r' &&      /* CR */
-	   buf[i + 1] == '\n')) { /* LF */
-	size_end = i + 1;
-	miniheader_end = size_end;
-	delimiter_start = i;
+     No one uses or supports them, they are skipped. */
+  size_t pos = 0;
+  while (pos < size &&
+	 chunk->state != CHUNK_DONE && chunk->state != CHUNK_ERROR) {
+    uint8_t c = buf[pos];
+    switch (chunk->state) {
+    case CHUNK_SIZE:
+      if (chunk_hex_value(c) >= 0) {
+	if (chunk->remaining > (SSIZE_MAX >> 4)) {
+	  ERR("HTTP: Chunk size is insane");
+	  chunk->state = CHUNK_ERROR;
+	  break;
+	}
+	chunk->remaining = (chunk->remaining << 4) +
+	  (size_t) chunk_hex_value(c);
+	chunk->has_digits = 1;
+	pos++;
 	break;
       }
-
-      /* No extension */
-      if (buf[i] == '\n') { /* LF */
-	size_end = i;
-	miniheader_end = size_end;
-	delimiter_start = i;
+      if (!chunk->has_digits) {
+	ERR("HTTP: Missing chunk size");
+	chunk->state = CHUNK_ERROR;
 	break;
       }
-
-      /* Has extensions */
-      if (buf[i] == ';') {
-	size_end = i;
-	continue;
-      }
-    }
-    if (miniheader_end < 0) {
-      if (i + 1 < max &&
-	  (buf[i] == '\r' &&      /* CR */
-	   buf[i + 1] == '\n')) { /* LF */
-	miniheader_end = i + 1;
-	delimiter_start = i;
+      /* Extensions and line end are consumed by the next state */
+      chunk->state = CHUNK_EXTENSION;
+      break;
+    case CHUNK_EXTENSION:
+      pos++;
+      if (c != '\n')
 	break;
+      if (chunk->remaining > 0) {
+	NOTE("HTTP: Chunk size: %lu", chunk->remaining);
+	chunk->state = CHUNK_DATA;
+      } else {
+	/* Terminator chunk, may have trailers */
+	chunk->line_size = 0;
+	chunk->state = CHUNK_TRAILER;
       }
-
-      if (buf[i] == '\n') { /* LF */
-	miniheader_end = i;
-	delimiter_start = i;
+      break;
+    case CHUNK_DATA:
+      {
+	size_t data = size - pos;
+	if (data > chunk->remaining)
+	  data = chunk->remaining;
+	pos += data;
+	chunk->remaining -= data;
+	if (chunk->remaining == 0)
+	  chunk->state = CHUNK_DATA_END;
 	break;
       }
+    case CHUNK_DATA_END:
+      pos++;
+      if (c == '\n') {
+	chunk->has_digits = 0;
+	chunk->state = CHUNK_SIZE;
+	if (boundary != NULL)
+	  *boundary = 1;
+      } else if (c != '\r') {
+	ERR("HTTP: Chunk data not followed by line end");
+	chunk->state = CHUNK_ERROR;
+      }
+      break;
+    case CHUNK_TRAILER:
+      pos++;
+      if (c == '\n') {
+	if (chunk->line_size == 0) {
+	  chunk->state = CHUNK_DONE;
+	  if (boundary != NULL)
+	    *boundary = 1;
+	}
+	chunk->line_size = 0;
+      } else if (c != '\r') {
+	chunk->line_size++;
+      }
+      break;
+    case CHUNK_DONE:
+    case CHUNK_ERROR:
+      break;
     }
   }
+  return pos;
+}
 
-  if (miniheader_end < 0) {
-    /* NOTE: knowing just the size field
-       is not enough since the extensions
-       are not included in the size */
-    NOTE("failed to find chunk mini-header so far");
-    return -1;
-  }
-
-  /* Temporary stringification for strtol() */
-  uint8_t original_char = *(pkt->buffer + size_end);
-  *(pkt->buffer + size_end) = '\0';
-  size_t size = strtoul((char *)pkt->buffer, NULL, 16);
-  NOTE("Chunk size raw: %s", pkt->buffer);
-  *(pkt->buffer + size_end) = original_char;
-  if (size > SSIZE_MAX)
-    ERR_AND_EXIT("chunk size is insane");
-
-  if (size > 0) {
-    /* Regular chunk */
-    ssize_t chunk_size = (ssize_t) size; /* Chunk body */
-    chunk_size += miniheader_end + 1; /* Mini-header */
-    chunk_size += 2; /* Trailing CRLF */
-    NOTE("HTTP: Chunk size: %lu", chunk_size);
-    return (ssize_t) chunk_size;
-  }
-
-  /* Terminator chunk
-     May have trailers in body */
-  ssize_t full_size = -1;
-  for (ssize_t i = delimiter_start; i < max; i++) {
-    uint8_t *buf = pkt->buffer;
-    if (i + 3 < max &&
-	(buf[i] == '\r' &&      /* CR */
-	 buf[i + 1] == '\n' &&  /* LF */
-	 buf[i + 2] == '\r' &&  /* CR */
-	 buf[i + 3] == '\n')) { /* LF */
-      full_size = i + 4;
-      break;
+static void packet_decode_chunks(struct http_packet_t *pkt)
+{
+  struct http_message_t *msg = pkt->parent_message;
+  struct http_chunk_decoder_t *chunk = &msg->chunk;
+
+  int boundary = 0;
+  struct iovec iov[8];
+  size_t count;
+  while (chunk->state != CHUNK_DONE && chunk->state != CHUNK_ERROR &&
+	 (count = packet_iovec(pkt, pkt->decoded_size, iov, 8)) > 0) {
+    for (size_t i = 0; i < count; i++) {
+      size_t used = http_chunk_decode(chunk, iov[i].iov_base,
+				      iov[i].iov_len, &boundary);
+      pkt->decoded_size += used;
+      if (used < iov[i].iov_len)
+	break;
     }
+  }
 
-    if (i + 1 < max &&
-	buf[i] == '\n' &&     /* LF */
-	buf[i + 1] == '\n') { /* LF */
-      full_size = i + 2;
-      break;
-    }
+  if (chunk->state == CHUNK_ERROR) {
+    ERR("Malformed chunk-transport http message received");
+    msg->is_completed = 1;
+    pkt->expected_size = pkt->filled_size;
+    return;
   }
 
-  if (full_size < 0) {
-    NOTE("Chunk miniheader present but body incomplete");
-    return -1;
+  if (chunk->state == CHUNK_DONE) {
+    NOTE("Found end chunked packet");
+    msg->is_completed = 1;
+    pkt->expected_size = pkt->decoded_size;
+    return;
   }
 
-  NOTE("Found end chunked packet");
-  pkt->parent_message->is_completed = 1;
-  pkt->is_completed = 1;
-  return full_size;
+  /* Hand the packet on at every chunk boundary and whenever a slice
+     is full so a large chunk never has to be buffered as a whole */
+  if (boundary ||
+      pkt->decoded_size >= HTTP_CHUNK_SLICE)
+    pkt->expected_size = pkt->decoded_size;
+}
+
+static size_t packet_chunk_target(struct http_packet_t *pkt)
+{
+  struct http_chunk_decoder_t *chunk = &pkt->parent_message->chunk;
+
+  /* Chunk payload plus its line end or, while on a size or trailer
+     line, whatever is available */
+  size_t want = HTTP_SEGMENT_SIZE;
+  if (chunk->state == CHUNK_DATA && chunk->remaining + 2 > want)
+    want = chunk->remaining + 2;
+
+  size_t target = pkt->decoded_size + want;
+  if (target > HTTP_CHUNK_SLICE)
+    target = HTTP_CHUNK_SLICE;
+  return target;
 }
 
 static ssize_t packet_get_header_size(struct http_packet_t *pkt)
@@ -306,26 +808,30 @@ static ssize_t packet_get_header_size(struct http_packet_t *pkt)
   * http://www.w3.org/Protocols/rfc2616/rfc2616-sec19.html#sec19.3
   */
 
-  /* Find header */
-  for (size_t i = 0; i < pkt->filled_size && i < SSIZE_MAX; i++) {
-    /* two \r\n pairs */
-    if ((i + 3) < pkt->filled_size &&
-	'\r' == pkt->buffer[i] &&
-	'\n' == pkt->buffer[i + 1] &&
-	'\r' == pkt->buffer[i + 2] &&
-	'\n' == pkt->buffer[i + 3]) {
-      pkt->header_size = i + 4;
-      goto found;
-    }
-
-    /* two \n pairs */
-    if ((i + 1) < pkt->filled_size &&
-	'\n' == pkt->buffer[i] &&
-	'\n' == pkt->buffer[i + 1]) {
-      pkt->header_size = i + 2;
-      goto found;
+  /* Find header, resuming where the previous call left off. The last
+     three bytes are scanned again to restore the look-behind. */
+  size_t pos = pkt->header_scanned > 3 ? pkt->header_scanned - 3 : 0;
+  uint8_t prev[3] = {0, 0, 0};
+  struct iovec iov[8];
+  size_t count;
+  while ((count = packet_iovec(pkt, pos, iov, 8)) > 0) {
+    for (size_t i = 0; i < count; i++) {
+      const uint8_t *buf = iov[i].iov_base;
+      for (size_t j = 0; j < iov[i].iov_len; j++, pos++) {
+	/* two \r\n pairs or two \n */
+	if (buf[j] == '\n' &&
+	    ((prev[2] == '\r' && prev[1] == '\n' && prev[0] == '\r') ||
+	     prev[2] == '\n')) {
+	  pkt->header_size = pos + 1;
+	  goto found;
+	}
+	prev[0] = prev[1];
+	prev[1] = prev[2];
+	prev[2] = buf[j];
+      }
     }
   }
+  pkt->header_scanned = pkt->filled_size;
 
   return -1;
 
@@ -333,6 +839,341 @@ static ssize_t packet_get_header_size(struct http_packet_t *pkt)
   return (ssize_t) pkt->header_size;
 }
 
+static int header_is_blank(uint8_t c)
+{
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static size_t header_line_end(const uint8_t *raw, size_t pos, size_t size)
+{
+  while (pos < size && raw[pos] != '\n')
+    pos++;
+  return pos;
+}
+
+static void header_index_field(struct http_header_index_t *idx,
+			       size_t start, size_t end)
+{
+  const uint8_t *raw = idx->raw;
+
+  /* Obsolete line folding continues the previous field's value */
+  if (raw[start] == ' ' || raw[start] == '\t') {
+    if (idx->num_fields == 0) {
+      CONF("HTTP: Header continuation line without field");
+      return;
+    }
+    struct http_header_field_t *prev = &idx->fields[idx->num_fields - 1];
+    while (end > prev->value_offset && header_is_blank(raw[end - 1]))
+      end--;
+    if (end > prev->value_offset)
+      prev->value_size = end - prev->value_offset;
+    return;
+  }
+
+  const uint8_t *colon = memchr(raw + start, ':', end - start);
+  if (colon == NULL) {
+    CONF("HTTP: Header line without colon");
+    return;
+  }
+  if (idx->num_fields >= HTTP_MAX_HEADER_FIELDS) {
+    WARN("HTTP: More than %d header fields, ignoring the rest",
+	 HTTP_MAX_HEADER_FIELDS);
+    return;
+  }
+
+  size_t name_end = (size_t)(colon - raw);
+  size_t value_start = name_end + 1;
+  while (name_end > start && header_is_blank(raw[name_end - 1]))
+    name_end--;
+  while (value_start < end && header_is_blank(raw[value_start]))
+    value_start++;
+  while (end > value_start && header_is_blank(raw[end - 1]))
+    end--;
+
+  struct http_header_field_t *field = &idx->fields[idx->num_fields++];
+  field->name_offset = start;
+  field->name_size = name_end - start;
+  field->value_offset = value_start;
+  field->value_size = end - value_start;
+}
+
+static int header_index_build(struct http_header_index_t *idx,
+			      struct http_pool_t *pool,
+			      const struct http_packet_t *pkt, size_t size)
+{
+  uint8_t *raw = pool_header_alloc(pool, size, &idx->raw_capacity);
+  if (raw == NULL) {
+    ERR("HTTP: Failed to alloc space for header index");
+    return -1;
+  }
+  packet_copy(pkt, 0, raw, size);
+  idx->raw = raw;
+  idx->raw_size = size;
+  idx->num_fields = 0;
+
+  /* Start line, the last token (reason phrase) may contain spaces */
+  size_t line_end = header_line_end(raw, 0, size);
+  size_t pos = 0;
+  for (int i = 0; i < 3; i++) {
+    while (pos < line_end && (raw[pos] == ' ' || raw[pos] == '\t'))
+      pos++;
+    size_t token_start = pos;
+    while (pos < line_end && raw[pos] != '\r' &&
+	   (i == 2 || (raw[pos] != ' ' && raw[pos] != '\t')))
+      pos++;
+    idx->start_offset[i] = token_start;
+    idx->start_size[i] = pos - token_start;
+  }
+
+  /* One field per line up to the empty line ending the header */
+  for (pos = line_end + 1; pos < size; pos = line_end + 1) {
+    line_end = header_line_end(raw, pos, size);
+    size_t content_end = line_end;
+    if (content_end > pos && raw[content_end - 1] == '\r')
+      content_end--;
+    if (content_end == pos)
+      break;
+    header_index_field(idx, pos, content_end);
+  }
+
+  return 0;
+}
+
+static const struct http_header_field_t *
+header_find(const struct http_header_index_t *idx, const char *name,
+	    size_t from)
+{
+  size_t name_size = strlen(name);
+  for (size_t i = from; i < idx->num_fields; i++) {
+    const struct http_header_field_t *field = &idx->fields[i];
+    if (field->name_size == name_size &&
+	strncasecmp((const char *)idx->raw + field->name_offset,
+		    name, name_size) == 0)
+      return field;
+  }
+  return NULL;
+}
+
+const char *http_header_get(const struct http_header_index_t *idx,
+			    const char *name, size_t *value_size)
+{
+  if (idx->raw == NULL)
+    return NULL;
+
+  const struct http_header_field_t *field = header_find(idx, name, 0);
+  if (field == NULL)
+    return NULL;
+
+  if (value_size != NULL)
+    *value_size = field->value_size;
+  return (const char *)idx->raw + field->value_offset;
+}
+
+int http_header_has_token(const struct http_header_index_t *idx,
+			  const char *name, const char *token)
+{
+  if (idx->raw == NULL)
+    return 0;
+
+  /* Fields may be repeated and carry comma-separated lists of tokens,
+     each optionally followed by parameters */
+  size_t token_size = strlen(token);
+  const struct http_header_field_t *field = header_find(idx, name, 0);
+  while (field != NULL) {
+    const char *value = (const char *)idx->raw + field->value_offset;
+    size_t pos = 0;
+    while (pos < field->value_size) {
+      while (pos < field->value_size &&
+	     (header_is_blank((uint8_t)value[pos]) || value[pos] == ','))
+	pos++;
+      size_t start = pos;
+      while (pos < field->value_size && value[pos] != ',' &&
+	     value[pos] != ';' && !header_is_blank((uint8_t)value[pos]))
+	pos++;
+      if (pos - start == token_size &&
+	  strncasecmp(value + start, token, token_size) == 0)
+	return 1;
+      while (pos < field->value_size && value[pos] != ',')
+	pos++;
+    }
+    field = header_find(idx, name,
+			(size_t)(field - idx->fields) + 1);
+  }
+  return 0;
+}
+
+ssize_t http_header_content_length(const struct http_header_index_t *idx)
+{
+  size_t size = 0;
+  const char *value = http_header_get(idx, "Content-Length", &size);
+  if (value == NULL || size == 0)
+    return -1;
+
+  size_t length = 0;
+  for (size_t i = 0; i < size; i++) {
+    if (!isdigit((unsigned char)value[i])) {
+      CONF("HTTP: Malformed Content-Length");
+      return -1;
+    }
+    if (length > (SSIZE_MAX - 9) / 10) {
+      ERR("HTTP: Content-Length beyond sane size");
+      return -1;
+    }
+    length = length * 10 + (size_t)(value[i] - '0');
+  }
+  return (ssize_t) length;
+}
+
+const char *http_header_start_token(const struct http_header_index_t *idx,
+				    int n, size_t *size)
+{
+  if (idx->raw == NULL || n < 0 || n > 2)
+    return NULL;
+  if (size != NULL)
+    *size = idx->start_size[n];
+  return (const char *)idx->raw + idx->start_offset[n];
+}
+
+int http_header_method_is(const struct http_header_index_t *idx,
+			  const char *method)
+{
+  size_t size = 0;
+  const char *token = http_header_start_token(idx, 0, &size);
+  return token != NULL && size == strlen(method) &&
+    memcmp(token, method, size) == 0;
+}
+
+static size_t header_put(uint8_t *out, size_t out_size, size_t pos,
+			 const char *data, size_t size)
+{
+  if (pos + size <= out_size)
+    memcpy(out + pos, data, size);
+  return pos + size;
+}
+
+size_t http_header_rewrite(const struct http_header_index_t *idx,
+			   const char *const *drop, const char *extra,
+			   uint8_t *out, size_t out_size)
+{
+  if (idx->raw == NULL)
+    return 0;
+
+  size_t pos = 0;
+  for (int n = 0; n < 3; n++) {
+    size_t size = 0;
+    const char *token = http_header_start_token(idx, n, &size);
+    pos = header_put(out, out_size, pos, token, size);
+    pos = header_put(out, out_size, pos, n < 2 ? " " : "\r\n",
+		     n < 2 ? 1 : 2);
+  }
+
+  for (size_t i = 0; i < idx->num_fields; i++) {
+    const struct http_header_field_t *field = &idx->fields[i];
+    const char *name = (const char *)idx->raw + field->name_offset;
+    int is_dropped = 0;
+    for (size_t d = 0; drop != NULL && drop[d] != NULL; d++)
+      if (field->name_size == strlen(drop[d]) &&
+	  strncasecmp(name, drop[d], field->name_size) == 0)
+	is_dropped = 1;
+    if (is_dropped)
+      continue;
+    pos = header_put(out, out_size, pos, name, field->name_size);
+    pos = header_put(out, out_size, pos, ": ", 2);
+    pos = header_put(out, out_size, pos,
+		     (const char *)idx->raw + field->value_offset,
+		     field->value_size);
+    pos = header_put(out, out_size, pos, "\r\n", 2);
+  }
+
+  if (extra != NULL)
+    pos = header_put(out, out_size, pos, extra, strlen(extra));
+  pos = header_put(out, out_size, pos, "\r\n", 2);
+
+  return pos <= out_size ? pos : 0;
+}
+
+int http_header_is_response(const struct http_header_index_t *idx)
+{
+  size_t size = 0;
+  const char *token = http_header_start_token(idx, 0, &size);
+  return token != NULL && size >= 5 && memcmp(token, "HTTP/", 5) == 0;
+}
+
+int http_header_status(const struct http_header_index_t *idx)
+{
+  size_t size = 0;
+  const char *token = http_header_start_token(idx, 1, &size);
+  if (!http_header_is_response(idx) || token == NULL || size != 3)
+    return -1;
+
+  int status = 0;
+  for (size_t i = 0; i < size; i++) {
+    if (!isdigit((unsigned char)token[i]))
+      return -1;
+    status = status * 10 + (token[i] - '0');
+  }
+  return status;
+}
+
+/* Removes all occurrences of a field from the header at the start of
+   pkt. The header bytes in front of a field move up over it and the
+   packet then starts later in its first segment, so the body is not
+   touched. The message's header index keeps describing the header as
+   it was received. */
+int packet_drop_header_field(struct http_packet_t *pkt, const char *name)
+{
+  const struct http_header_index_t *idx = &pkt->parent_message->header;
+  if (idx->raw == NULL || pkt->head == NULL ||
+      pkt->filled_size < idx->raw_size)
+    return -1;
+
+  /* Last one first, bytes in front of a removed line keep their
+     offsets relative to the start of the packet */
+  for (size_t i = idx->num_fields; i > 0; i--) {
+    const struct http_header_field_t *field = &idx->fields[i - 1];
+    if (field->name_size != strlen(name) ||
+	strncasecmp((const char *)idx->raw + field->name_offset, name,
+		    field->name_size) != 0)
+      continue;
+
+    /* The field's line and its continuation lines */
+    size_t start = field->name_offset;
+    size_t end = header_line_end(idx->raw, start, idx->raw_size) + 1;
+    while (end < idx->raw_size &&
+	   (idx->raw[end] == ' ' || idx->raw[end] == '\t'))
+      end = header_line_end(idx->raw, end, idx->raw_size) + 1;
+    if (end > idx->raw_size ||
+	pkt->head_offset + end > pkt->head->end)
+      return -1;
+
+    size_t line_size = end - start;
+    uint8_t *data = pkt->head->data + pkt->head_offset;
+    memmove(data + line_size, data, start);
+    pkt->head_offset += line_size;
+    pkt->filled_size -= line_size;
+    if (pkt->expected_size > line_size)
+      pkt->expected_size -= line_size;
+    if (pkt->header_size > line_size)
+      pkt->header_size -= line_size;
+    if (pkt->header_scanned > line_size)
+      pkt->header_scanned -= line_size;
+  }
+  return 0;
+}
+
+static int request_ends_with_close(const struct http_header_index_t *header)
+{
+  if (!http_header_method_is(header, "POST") &&
+      !http_header_method_is(header, "PUT"))
+    return 0;
+  size_t version_size = 0;
+  const char *version = http_header_start_token(header, 2, &version_size);
+  if (version != NULL && version_size == 8 &&
+      memcmp(version, "HTTP/1.0", 8) == 0)
+    return !http_header_has_token(header, "Connection", "keep-alive");
+  return http_header_has_token(header, "Connection", "close");
+}
+
 enum http_request_t packet_find_type(struct http_packet_t *pkt)
 {
   enum http_request_t type = HTTP_UNSET;
@@ -350,11 +1191,12 @@ enum http_request_t packet_find_type(struct http_packet_t *pkt)
   *    request type. We must be called on a packet which
   *    has the full header.
   * 2. if the request uses method 2 we need the full header
-  *    but a simple network-byte-order-aware string search
-  *    works. This function does not work if called with
-  *    a chunked transport's sub-packet.
-  * 3. if the request uses method 3 we again perform the
-  *    string search.
+  *    which is tokenised into the message's header index,
+  *    field names are matched case-insensitively. This
+  *    function does not work if called with a chunked
+  *    transport's sub-packet.
+  * 3. if the request uses method 3 we again look up the
+  *    header index.
   *
   * All cases require the packat to contain the full header.
   */
@@ -366,41 +1208,55 @@ enum http_request_t packet_find_type(struct http_packet_t *pkt)
   }
   size_t header_size = (size_t) header_size_raw;
 
+  /* Tokenise the header once, all further lookups use the index */
+  struct http_header_index_t *header = &pkt->parent_message->header;
+  if (header->raw == NULL &&
+      header_index_build(header, pkt->parent_message->pool,
+			 pkt, header_size) != 0)
+    goto do_ret;
+
+  /* Interim, No Content and Not Modified responses never have a
+     body, whatever their header says */
+  int status = http_header_status(header);
+  if ((status >= 100 && status < 200) || status == 204 || status == 304) {
+    size = header_size;
+    type = HTTP_HEADER_ONLY;
+    goto do_ret;
+  }
+
   /* Try Transfer-Encoding Chunked */
-  char xfer_encode_str[] = "Transfer-Encoding: chunked";
-  size_t xfer_encode_str_size = sizeof(xfer_encode_str) - 1;
-  uint8_t *xfer_encode_pos = memmem(pkt->buffer, header_size,
-				    xfer_encode_str,
-				    xfer_encode_str_size);
-  if (xfer_encode_pos != NULL) {
+  if (http_header_has_token(header, "Transfer-Encoding", "chunked")) {
     size = 0;
     type = HTTP_CHUNKED;
     goto do_ret;
   }
 
   /* Try Content-Length */
-  char content_length_str[] = "Content-Length: ";
-  ssize_t contlen_size =
-    inspect_header_field(pkt, header_size,
-			 content_length_str, sizeof(content_length_str) - 1);
+  ssize_t contlen_size = http_header_content_length(header);
   if (contlen_size >= 0) {
     size = (size_t) contlen_size + header_size;
     type = HTTP_CONTENT_LENGTH;
     goto do_ret;
   }
 
-  /* GET requests (start with GET) or answers from the server (start
-     with HTTP) */
-  if (doesMatch("GET", 3, pkt->buffer, pkt->filled_size) ||
-      doesMatch("HTTP", 4, pkt->buffer, pkt->filled_size)) {
-    size = header_size;
-    type = HTTP_HEADER_ONLY;
+  /* Without a length a response ends when the printer stops sending,
+     there is no closing a USB interface to end it */
+  if (http_header_is_response(header)) {
+    type = HTTP_IDLE_DELIMITED;
+    size = 0;
     goto do_ret;
   }
 
-  /* No size was detectable yet header was found */
-  type = HTTP_UNKNOWN;
-  size = 0;
+  /* A request without a length has no body (RFC 7230, 3.3.3), unless
+     it is an upload from a client which closes the connection after
+     it, as HTTP/1.0 clients do */
+  if (request_ends_with_close(header)) {
+    type = HTTP_CLOSE_DELIMITED;
+    size = 0;
+    goto do_ret;
+  }
+  size = header_size;
+  type = HTTP_HEADER_ONLY;
 
  do_ret:
   pkt->parent_message->claimed_size = size;
@@ -408,6 +1264,18 @@ enum http_request_t packet_find_type(struct http_packet_t *pkt)
   return type;
 }
 
+/* Large uploads like print jobs are not buffered as a whole */
+static int message_is_bulk(const struct http_message_t *msg)
+{
+  const struct http_header_index_t *header = &msg->header;
+  if (http_header_is_response(header))
+    return 0;
+  if (msg->type == HTTP_CHUNKED)
+    return 1;
+  return msg->type == HTTP_CONTENT_LENGTH &&
+    http_header_content_length(header) > HTTP_BULK_THRESHOLD;
+}
+
 size_t packet_pending_bytes(struct http_packet_t *pkt)
 {
   struct http_message_t *msg = pkt->parent_message;
@@ -418,6 +1286,7 @@ size_t packet_pending_bytes(struct http_packet_t *pkt)
 
   if (HTTP_UNSET == msg->type) {
     msg->type = packet_find_type(pkt);
+    msg->is_bulk = message_is_bulk(msg);
 
     if (HTTP_CHUNKED == msg->type) {
       /* Note: this was the packet with the
@@ -440,29 +1309,7 @@ size_t packet_pending_bytes(struct http_packet_t *pkt)
   }
 
   if (HTTP_CHUNKED == msg->type) {
-    if (pkt->filled_size == 0) {
-      /* Grab chunk's mini-header */
-      goto pending_known;
-    }
-
-    if (pkt->expected_size == 0) {
-      /* Check chunk's mini-header */
-      ssize_t size = packet_find_chunked_size(pkt);
-      if (size <= 0) {
-	ERR("=============================================");
-	ERR("Malformed chunk-transport http header receivd");
-	ERR("Missing chunk's mini-headers in first data");
-	ERR("Have %d bytes", pkt->filled_size);
-	printf("%.*s\n", (int)pkt->filled_size, pkt->buffer);
-	ERR("Malformed chunk-transport http header receivd");
-	ERR("=============================================");
-	goto pending_known;
-      }
-
-      pkt->expected_size = (size_t) size;
-      msg->claimed_size = 0;
-    }
-
+    packet_decode_chunks(pkt);
     goto pending_known;
   }
   if (HTTP_HEADER_ONLY == msg->type) {
@@ -475,9 +1322,20 @@ size_t packet_pending_bytes(struct http_packet_t *pkt)
   }
   if (HTTP_CONTENT_LENGTH == msg->type) {
     /* Note: find_header() has
-       filled msg's claimed_size */
-    msg->claimed_size = msg->claimed_size;
-    pkt->expected_size = msg->claimed_size;
+       filled msg's claimed_size. A packet only takes what is left of
+       the message after the packets before it. */
+    size_t before = msg->received_size - pkt->filled_size;
+    pkt->expected_size = msg->claimed_size > before ?
+      msg->claimed_size - before : pkt->filled_size;
+    goto pending_known;
+  }
+  if (HTTP_CLOSE_DELIMITED == msg->type ||
+      HTTP_IDLE_DELIMITED == msg->type) {
+    /* The reader completes the message when the data ends, until
+       then every slice is passed on as soon as it is full */
+    pkt->expected_size = HTTP_CHUNK_SLICE;
+    if (pkt->expected_size < pkt->filled_size)
+      pkt->expected_size = pkt->filled_size;
     goto pending_known;
   }
 
@@ -490,6 +1348,8 @@ size_t packet_pending_bytes(struct http_packet_t *pkt)
   size_t expected = pkt->expected_size;
   if (expected == 0)
     expected = msg->claimed_size;
+  if (expected == 0 && HTTP_CHUNKED == msg->type)
+    expected = packet_chunk_target(pkt);
   if (expected == 0)
     expected = pkt->buffer_capacity;
 
@@ -499,12 +1359,20 @@ size_t packet_pending_bytes(struct http_packet_t *pkt)
 
   size_t pending = expected - pkt->filled_size;
 
+  /* The rest of a bulk message never goes into this packet, a
+     streamed one gets room as data comes in */
+  if (msg->is_bulk || msg->is_streamed) {
+    packet_check_completion(pkt);
+    return pending;
+  }
+
   /* Expand buffer as needed */
   while (pending + pkt->filled_size > pkt->buffer_capacity) {
     ssize_t size_added = packet_expand(pkt);
     if (size_added < 0) {
-      WARN("packet at max allowed size");
-      return 0;
+      /* Whatever still fits, then it goes on as it is */
+      packet_check_completion(pkt);
+      return pkt->buffer_capacity - pkt->filled_size;
     }
     if (size_added == 0) {
       ERR("Failed to expand packet");
@@ -522,6 +1390,14 @@ void packet_mark_received(struct http_packet_t *pkt, size_t received)
   struct http_message_t *msg = pkt->parent_message;
   msg->received_size += received;
 
+  /* Data was written at the end of the write segment */
+  if (received) {
+    if (pkt->write_seg == NULL ||
+	pkt->write_seg->end + received > HTTP_SEGMENT_SIZE)
+      ERR_AND_EXIT("Overflowed packet's segment");
+    pkt->write_seg->end += received;
+  }
+
   pkt->filled_size += received;
   if (received) {
     NOTE("HTTP: got %lu bytes so: pkt has %lu bytes, "
@@ -543,32 +1419,45 @@ void packet_mark_received(struct http_packet_t *pkt, size_t received)
 struct http_packet_t *packet_new(struct http_message_t *parent_msg)
 {
   struct http_packet_t *pkt = NULL;
-  uint8_t              *buf = NULL;
-  size_t const capacity = BUFFER_STEP;
 
   assert(parent_msg != NULL);
-  pkt = calloc(1, sizeof(*pkt));
-  if (pkt == NULL) {
-    ERR("failed to alloc packet");
-    return NULL;
+  struct http_pool_t *pool = parent_msg->pool;
+  if (pool != NULL && pool->free_packets != NULL) {
+    pkt = pool->free_packets;
+    pool->free_packets = pkt->pool_next;
+    pool->num_free_packets--;
+    pool->reuses++;
+    memset(pkt, 0, sizeof(*pkt));
+  } else {
+    pkt = calloc(1, sizeof(*pkt));
+    if (pkt == NULL) {
+      ERR("failed to alloc packet");
+      return NULL;
+    }
+    if (pool != NULL)
+      pool->allocations++;
   }
+  pkt->pool = pool;
   pkt->parent_message = parent_msg;
   pkt->expected_size = 0;
 
   /* Claim any spare data from prior packets */
   packet_take_spare(pkt);
 
-  if (pkt->buffer == NULL) {
-    buf = calloc(capacity, sizeof(*buf));
-    if (buf == NULL) {
+  if (pkt->head == NULL) {
+    struct http_segment_t *seg = segment_new(pool);
+    if (seg == NULL) {
       ERR("failed to alloc space for packet's buffer or space for packet");
-      free(pkt);
+      packet_free(pkt);
       return NULL;
     }
 
     /* Assemble packet */
-    pkt->buffer = buf;
-    pkt->buffer_capacity = capacity;
+    pkt->head = seg;
+    pkt->tail = seg;
+    pkt->write_seg = seg;
+    pkt->head_offset = 0;
+    pkt->buffer_capacity = HTTP_SEGMENT_SIZE;
     pkt->filled_size = 0;
   }
 
@@ -577,32 +1466,47 @@ struct http_packet_t *packet_new(struct http_message_t *parent_msg)
 
 void packet_free(struct http_packet_t *pkt)
 {
-  free(pkt->buffer);
-  free(pkt);
+  struct http_pool_t *pool = pkt->pool;
+  segment_chain_unref(pkt->head, pkt->tail);
+
+  if (pool == NULL || pool->num_free_packets >= HTTP_POOL_MAX_STRUCTS) {
+    free(pkt);
+    return;
+  }
+  pkt->pool_next = pool->free_packets;
+  pool->free_packets = pkt;
+  pool->num_free_packets++;
 }
 
-#define MAX_PACKET_SIZE (1 << 26) /* 64MiB */
 ssize_t packet_expand(struct http_packet_t *pkt)
 {
-  size_t cur_size = pkt->buffer_capacity;
-  size_t new_size = cur_size * 2;
+  size_t new_size = pkt->buffer_capacity + HTTP_SEGMENT_SIZE;
   if (new_size > MAX_PACKET_SIZE) {
     WARN("HTTP: cannot expand packet beyond limit");
     return -1;
   }
-  NOTE("HTTP: doubling packet buffer to %lu", new_size);
+  /* The packet goes on as it is, reading resumes once it was taken */
+  struct http_pool_t *pool = pkt->pool;
+  if (pool != NULL && pool->budget > 0 && pool->free_segments == NULL &&
+      pool->held + HTTP_SEGMENT_SIZE > pool->budget) {
+    NOTE("HTTP: Connection's buffers are full, packet stays at %lu bytes",
+	 pkt->buffer_capacity);
+    return -1;
+  }
+  if (pkt->tail == NULL || pkt->write_seg == NULL) {
+    ERR("HTTP: cannot expand a packet which handed on its excess");
+    return 0;
+  }
+  NOTE("HTTP: adding segment, packet capacity %lu", new_size);
 
-  uint8_t *new_buf = realloc(pkt->buffer, new_size);
-  if (new_buf == NULL) {
-    /* If realloc fails the original buffer is still valid */
+  struct http_segment_t *seg = segment_new(pkt->pool);
+  if (seg == NULL) {
     WARN("Failed to expand packet");
     return 0;
   }
-  pkt->buffer = new_buf;
+  pkt->tail->next = seg;
+  pkt->tail = seg;
   pkt->buffer_capacity = new_size;
 
-  size_t diff = new_size - cur_size;
-  if (diff > SSIZE_MAX)
-    ERR_AND_EXIT("Buffer expanded beyond sane limit");
-  return (ssize_t) diff;
+  return HTTP_SEGMENT_SIZE;
 }
@@ -15,47 +15,218 @@
 #pragma once
 #include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
+#define HTTP_MAX_HEADER_FIELDS 48
+#define HTTP_CHUNK_SLICE (1 << 16)
+#define HTTP_SEGMENT_SIZE (1 << 14)
+#define HTTP_POOL_MAX_SEGMENTS 16
+#define HTTP_POOL_MAX_STRUCTS 4
+
+/* In KiB, buffers one connection may hold at once, see
+   http_pool_take() */
+#define HTTP_CONN_DEFAULT_BUFFER 1024
+#define HTTP_CONN_MIN_BUFFER 256
+
+/* Request bodies above this size, and chunked ones, bypass packets once
+   the header went out, see tcp_body_get() */
+#define HTTP_BULK_THRESHOLD (1 << 16)
+#define HTTP_BULK_BLOCK (1 << 18)
+
+/* How the end of a message is found. Close- and idle-delimited
+   bodies carry no length, they are passed on in slices as they come
+   until the client closes its side of the connection or the printer
+   stops sending. */
 enum http_request_t {
   HTTP_UNSET,
-  HTTP_UNKNOWN,
   HTTP_CHUNKED,
   HTTP_CONTENT_LENGTH,
-  HTTP_HEADER_ONLY
+  HTTP_HEADER_ONLY,
+  HTTP_CLOSE_DELIMITED,
+  HTTP_IDLE_DELIMITED
+};
+
+/* Fixed-size piece of packet storage. Packets are chains of segments
+   which grow by appending a segment instead of reallocating. Segments
+   are reference counted so the bytes a packet received beyond its end
+   can be handed on to the next packet without copying them. Valid data
+   of a segment ends at end, data after the write position is never
+   touched again once a writer moved on to the next segment. */
+struct http_segment_t {
+  struct http_segment_t *next;
+  struct http_pool_t *pool;
+  unsigned int refs;
+  size_t end;
+  uint8_t *data;
+};
+
+/* Per-connection recycling of messages, packets, header copies and
+   segments. Everything a message used goes back to the pool when the
+   message is done, so servicing a connection stops hitting the shared
+   allocator after its first exchange. Pools are not thread-safe, a
+   pool belongs to the thread servicing its connection.
+
+   The buffers of a connection, its segments and the block it relays
+   bulk bodies in, are taken from the pool's budget. Once that is used
+   up no more is read from the side which is ahead until the other one
+   took what was read, so a connection holds no more than the budget
+   however fast one side and however slow the other is. */
+struct http_pool_t {
+  struct http_message_t *free_messages;
+  struct http_packet_t *free_packets;
+  struct http_segment_t *free_segments;
+  uint8_t *free_header;
+  size_t free_header_capacity;
+  size_t num_free_messages;
+  size_t num_free_packets;
+  size_t num_free_segments;
+
+  /* In bytes, no limit when 0 */
+  size_t budget;
+  size_t held;
+
+  /* Statistics */
+  size_t allocations;
+  size_t reuses;
+  size_t segments_in_use;
+  size_t peak_segments_in_use;
+  size_t peak_held;
+};
+
+enum http_chunk_state_t {
+  CHUNK_SIZE,
+  CHUNK_EXTENSION,
+  CHUNK_DATA,
+  CHUNK_DATA_END,
+  CHUNK_TRAILER,
+  CHUNK_DONE,
+  CHUNK_ERROR
+};
+
+/* Tracks the framing of a chunked body as it passes through, the
+   payload itself is forwarded untouched */
+struct http_chunk_decoder_t {
+  enum http_chunk_state_t state;
+  size_t remaining;
+  size_t line_size;
+  int has_digits;
+};
+
+struct http_header_field_t {
+  size_t name_offset;
+  size_t name_size;
+  size_t value_offset;
+  size_t value_size;
+};
+
+/* Index over the header block of a message. It is built once, when
+   the header has been completely received, from a private copy of the
+   header bytes so lookups stay valid after the packet which carried
+   the header has been sent and freed. All offsets refer to raw. */
+struct http_header_index_t {
+  uint8_t *raw;
+  size_t raw_size;
+  size_t raw_capacity;
+
+  /* Request: method, target, version
+     Response: version, status code, reason phrase */
+  size_t start_offset[3];
+  size_t start_size[3];
+
+  size_t num_fields;
+  struct http_header_field_t fields[HTTP_MAX_HEADER_FIELDS];
 };
 
 struct http_message_t {
+  struct http_pool_t *pool;
+  struct http_message_t *pool_next;
+
   enum http_request_t type;
+  struct http_header_index_t header;
+  struct http_chunk_decoder_t chunk;
 
+  /* Excess data, starts at spare_offset in spare_head */
   size_t spare_filled;
-  size_t spare_capacity;
-  uint8_t *spare_buffer;
+  size_t spare_offset;
+  struct http_segment_t *spare_head;
 
   size_t unreceived_size;
   uint8_t is_completed;
 
+  /* The client was told to go on with the body of its request, or the
+     printer was asked whether it may */
+  uint8_t is_continued;
+
+  /* Only the header goes into a packet, the body is passed on in
+     blocks */
+  uint8_t is_bulk;
+
+  /* Every read is handed on as its own packet as soon as it is in,
+     packets are never grown to hold the whole body */
+  uint8_t is_streamed;
+
   /* Detected from child packets */
   size_t claimed_size;
   size_t received_size;
 };
 
 struct http_packet_t {
+  struct http_pool_t *pool;
+  struct http_packet_t *pool_next;
+
   /* Cache */
   size_t header_size;
+  size_t header_scanned;
 
   size_t filled_size;
   size_t expected_size;
+  size_t decoded_size;
 
   size_t buffer_capacity;
-  uint8_t *buffer;
+
+  /* Data starts at head_offset in head and is appended at the end of
+     write_seg. Segments after tail are not owned by this packet. */
+  struct http_segment_t *head;
+  struct http_segment_t *tail;
+  struct http_segment_t *write_seg;
+  size_t head_offset;
 
   struct http_message_t *parent_message;
 
   uint8_t is_completed;
 };
 
-struct http_message_t *http_message_new(void);
+void http_pool_init(struct http_pool_t *);
+void http_pool_destroy(struct http_pool_t *);
+size_t http_pool_take(struct http_pool_t *, size_t, size_t);
+void http_pool_give(struct http_pool_t *, size_t);
+void http_report(void);
+
+struct http_message_t *http_message_new(struct http_pool_t *);
 void message_free(struct http_message_t *);
+void message_pass_spare(struct http_message_t *, struct http_message_t *);
+size_t message_spare_copy(const struct http_message_t *, void *, size_t);
+void message_spare_skip(struct http_message_t *, size_t);
+int message_spare_put(struct http_message_t *, const void *, size_t);
+size_t message_body_received(struct http_message_t *, const uint8_t *,
+			     size_t);
+
+const char *http_header_get(const struct http_header_index_t *,
+			    const char *, size_t *);
+int http_header_has_token(const struct http_header_index_t *,
+			  const char *, const char *);
+ssize_t http_header_content_length(const struct http_header_index_t *);
+const char *http_header_start_token(const struct http_header_index_t *,
+				    int, size_t *);
+int http_header_method_is(const struct http_header_index_t *, const char *);
+int http_header_is_response(const struct http_header_index_t *);
+int http_header_status(const struct http_header_index_t *);
+size_t http_header_rewrite(const struct http_header_index_t *,
+			   const char *const *, const char *,
+			   uint8_t *, size_t);
+
+size_t http_chunk_decode(struct http_chunk_decoder_t *,
+			 const uint8_t *, size_t, int *);
 
 enum http_request_t packet_find_type(struct http_packet_t *pkt);
 size_t packet_pending_bytes(struct http_packet_t *);
@@ -63,4 +234,13 @@ void packet_mark_received(struct http_packet_t *, size_t);
 
 struct http_packet_t *packet_new(struct http_message_t *);
 void packet_free(struct http_packet_t *);
+void packet_unget(struct http_packet_t *);
+int packet_drop_header_field(struct http_packet_t *, const char *);
 ssize_t packet_expand(struct http_packet_t *);
+
+uint8_t *packet_write_ptr(struct http_packet_t *, size_t, size_t *);
+int packet_append(struct http_packet_t *, const void *, size_t);
+size_t packet_iovec(const struct http_packet_t *, size_t,
+		    struct iovec *, size_t);
+size_t packet_copy(const struct http_packet_t *, size_t, void *, size_t);
+char *packet_hexdump(const struct http_packet_t *);
@@ -0,0 +1,364 @@
+/* Copyright (C) 2014 Daniel Dressler and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "http.h"
+#include "ipp.h"
+
+/* Operations which only query the printer */
+int ipp_op_is_read_only(uint16_t op)
+{
+  switch (op) {
+  case IPP_OP_VALIDATE_JOB:
+  case IPP_OP_GET_JOB_ATTRIBUTES:
+  case IPP_OP_GET_JOBS:
+  case IPP_OP_GET_PRINTER_ATTRIBUTES:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/* The next piece of a view which lies in one segment, moving *seg and
+   *offset on past it */
+static const uint8_t *ipp_view_part(const struct http_segment_t **seg,
+				    size_t *offset, size_t *size)
+{
+  while (*seg != NULL && *offset >= (*seg)->end) {
+    *offset -= (*seg)->end;
+    *seg = (*seg)->next;
+  }
+  if (*seg == NULL)
+    return NULL;
+  const uint8_t *part = (*seg)->data + *offset;
+  if (*size > (*seg)->end - *offset)
+    *size = (*seg)->end - *offset;
+  *offset += *size;
+  return part;
+}
+
+/* Copies the start of a view, returns how much of it there was */
+size_t ipp_view_copy(const struct ipp_view_t *view, void *dst, size_t size)
+{
+  const struct http_segment_t *seg = view->seg;
+  size_t offset = view->offset;
+  size_t copied = 0;
+  if (size > view->size)
+    size = view->size;
+  while (copied < size) {
+    size_t part_size = size - copied;
+    const uint8_t *part = ipp_view_part(&seg, &offset, &part_size);
+    if (part == NULL)
+      break;
+    memcpy((uint8_t *)dst + copied, part, part_size);
+    copied += part_size;
+  }
+  return copied;
+}
+
+int ipp_view_is(const struct ipp_view_t *view, const char *value)
+{
+  size_t size = strlen(value);
+  if (view->size != size)
+    return 0;
+  const struct http_segment_t *seg = view->seg;
+  size_t offset = view->offset;
+  size_t compared = 0;
+  while (compared < size) {
+    size_t part_size = size - compared;
+    const uint8_t *part = ipp_view_part(&seg, &offset, &part_size);
+    if (part == NULL || memcmp(part, value + compared, part_size) != 0)
+      return 0;
+    compared += part_size;
+  }
+  return 1;
+}
+
+/* integer and enum values */
+int ipp_view_integer(const struct ipp_view_t *view, int32_t *value)
+{
+  uint8_t data[4];
+  if (view->size != sizeof(data) ||
+      ipp_view_copy(view, data, sizeof(data)) != sizeof(data))
+    return -1;
+  *value = (int32_t)(((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) |
+		     ((uint32_t)data[2] << 8) | data[3]);
+  return 0;
+}
+
+/* Splits the first size bytes off a view into *part, -1 if it is
+   shorter than that */
+static int ipp_view_take(struct ipp_view_t *view, size_t size,
+			 struct ipp_view_t *part)
+{
+  if (size > view->size)
+    return -1;
+  if (part != NULL) {
+    *part = *view;
+    part->size = size;
+  }
+  view->size -= size;
+  view->offset += size;
+  while (view->seg != NULL && view->size > 0 &&
+	 view->offset >= view->seg->end) {
+    view->offset -= view->seg->end;
+    view->seg = view->seg->next;
+  }
+  return 0;
+}
+
+/* Takes the two byte length of a name or value and what it measures */
+static int ipp_view_take_field(struct ipp_view_t *view,
+			       struct ipp_view_t *field)
+{
+  uint8_t size[2];
+  if (ipp_view_copy(view, size, 2) != 2 || ipp_view_take(view, 2, NULL) != 0)
+    return -1;
+  return ipp_view_take(view, (size_t)((size[0] << 8) | size[1]), field);
+}
+
+/* Takes a record of a tag, a name and a value */
+static int ipp_view_take_record(struct ipp_view_t *view,
+				struct ipp_view_t *name,
+				struct ipp_view_t *value)
+{
+  if (ipp_view_take(view, 1, NULL) != 0 ||
+      ipp_view_take_field(view, name) != 0 ||
+      ipp_view_take_field(view, value) != 0)
+    return -1;
+  return 0;
+}
+
+static int ipp_reader_start(struct ipp_reader_t *reader)
+{
+  uint8_t header[IPP_HEADER_SIZE];
+  if (ipp_view_copy(&reader->message, header, sizeof(header)) !=
+      sizeof(header))
+    return -1;
+  reader->version_major = header[0];
+  reader->version_minor = header[1];
+  reader->op_status = (uint16_t)((header[2] << 8) | header[3]);
+  reader->request_id = ((uint32_t)header[4] << 24) |
+    ((uint32_t)header[5] << 16) | ((uint32_t)header[6] << 8) | header[7];
+  reader->attrs = reader->message;
+  ipp_view_take(&reader->attrs, IPP_HEADER_SIZE, NULL);
+  ipp_reader_rewind(reader);
+  return 0;
+}
+
+/* Reads the IPP message starting at offset in pkt, returns -1 if there
+   is not even its header */
+int ipp_reader_init(struct ipp_reader_t *reader,
+		    const struct http_packet_t *pkt, size_t offset)
+{
+  reader->message.seg = pkt->head;
+  reader->message.offset = pkt->head_offset;
+  reader->message.size = pkt->filled_size;
+  if (ipp_view_take(&reader->message, offset, NULL) != 0)
+    return -1;
+  return ipp_reader_start(reader);
+}
+
+/* Reads an IPP message held in one buffer */
+int ipp_reader_init_buffer(struct ipp_reader_t *reader, const uint8_t *ipp,
+			   size_t size)
+{
+  memset(&reader->buffer, 0, sizeof(reader->buffer));
+  reader->buffer.data = (uint8_t *)ipp;
+  reader->buffer.end = size;
+  reader->message.seg = &reader->buffer;
+  reader->message.offset = 0;
+  reader->message.size = size;
+  return ipp_reader_start(reader);
+}
+
+/* Goes back to the first attribute */
+void ipp_reader_rewind(struct ipp_reader_t *reader)
+{
+  reader->pos = reader->attrs;
+  reader->group = 0;
+}
+
+/* Whether the attributes are complete and well-formed, up to the
+   end-of-attributes tag. The reader is rewound. */
+int ipp_reader_check(struct ipp_reader_t *reader)
+{
+  struct ipp_attr_t attr;
+  int result;
+  ipp_reader_rewind(reader);
+  while ((result = ipp_attr_next(reader, &attr)) == 1)
+    ;
+  ipp_reader_rewind(reader);
+  return result == 0 ? 0 : -1;
+}
+
+/* Steps to the next attribute. Returns 1 for an attribute, 0 at the
+   end-of-attributes tag and -1 if the message is malformed or cut
+   off. */
+int ipp_attr_next(struct ipp_reader_t *reader, struct ipp_attr_t *attr)
+{
+  struct ipp_view_t *pos = &reader->pos;
+  uint8_t tag = 0;
+  for (;;) {
+    if (ipp_view_copy(pos, &tag, 1) != 1)
+      return -1;
+    if (tag == IPP_TAG_END)
+      return 0;
+    if (tag >= 0x10)
+      break;
+    reader->group = tag;
+    ipp_view_take(pos, 1, NULL);
+  }
+
+  struct ipp_view_t start = *pos;
+  struct ipp_view_t name, value;
+  if (reader->group == 0 || ipp_view_take_record(pos, &name, &value) != 0 ||
+      name.size == 0)
+    return -1;
+  attr->group = reader->group;
+  attr->tag = tag;
+  attr->name = name;
+  attr->value = value;
+  attr->offset = reader->message.size - start.size;
+
+  /* Additional values and collection members have no name */
+  for (;;) {
+    struct ipp_view_t next = *pos;
+    if (ipp_view_copy(&next, &tag, 1) != 1)
+      return -1;
+    if (tag < 0x10)
+      break;
+    if (ipp_view_take_record(&next, &name, &value) != 0)
+      return -1;
+    if (name.size > 0)
+      break;
+    *pos = next;
+  }
+  attr->all = start;
+  attr->all.size = start.size - pos->size;
+  return 1;
+}
+
+/* Looks for an attribute from the first one on, in the given group or
+   in any if it is 0. Returns 1 if it is found. */
+int ipp_attr_find(struct ipp_reader_t *reader, uint8_t group,
+		  const char *name, struct ipp_attr_t *attr)
+{
+  ipp_reader_rewind(reader);
+  while (ipp_attr_next(reader, attr) == 1)
+    if ((group == 0 || attr->group == group) && ipp_attr_is(attr, name))
+      return 1;
+  return 0;
+}
+
+int ipp_attr_is(const struct ipp_attr_t *attr, const char *name)
+{
+  return ipp_view_is(&attr->name, name);
+}
+
+/* Iterates the values of a (non-collection) attribute. *values starts
+   as all of the attribute and is used up value by value. */
+int ipp_attr_value_next(struct ipp_view_t *values, struct ipp_view_t *value)
+{
+  struct ipp_view_t name;
+  return values->size > 0 &&
+    ipp_view_take_record(values, &name, value) == 0;
+}
+
+static void ipp_put_bytes(struct ipp_writer_t *writer, const void *data,
+			  size_t size)
+{
+  if (writer->is_failed || size == 0)
+    return;
+  if (writer->size + size > writer->capacity) {
+    size_t capacity = writer->capacity > 0 ? writer->capacity : 256;
+    while (capacity < writer->size + size)
+      capacity *= 2;
+    uint8_t *grown = realloc(writer->data, capacity);
+    if (grown == NULL) {
+      writer->is_failed = 1;
+      return;
+    }
+    writer->data = grown;
+    writer->capacity = capacity;
+  }
+  memcpy(writer->data + writer->size, data, size);
+  writer->size += size;
+}
+
+void ipp_writer_init(struct ipp_writer_t *writer, uint8_t version_major,
+		     uint8_t version_minor, uint16_t op_status,
+		     uint32_t request_id)
+{
+  writer->data = NULL;
+  writer->size = 0;
+  writer->capacity = 0;
+  writer->is_failed = 0;
+
+  const uint8_t header[IPP_HEADER_SIZE] = {
+    version_major, version_minor,
+    (uint8_t)(op_status >> 8), (uint8_t)op_status,
+    (uint8_t)(request_id >> 24), (uint8_t)(request_id >> 16),
+    (uint8_t)(request_id >> 8), (uint8_t)request_id
+  };
+  ipp_put_bytes(writer, header, sizeof(header));
+}
+
+/* A delimiter tag: the start of a group, or IPP_TAG_END */
+void ipp_put_group(struct ipp_writer_t *writer, uint8_t tag)
+{
+  ipp_put_bytes(writer, &tag, 1);
+}
+
+/* An attribute with its first value, or with a NULL name one more
+   value of the attribute before */
+void ipp_put_attr(struct ipp_writer_t *writer, uint8_t tag, const char *name,
+		  const void *value, size_t size)
+{
+  size_t name_size = name != NULL ? strlen(name) : 0;
+  if (name_size > 0xffff || size > 0xffff) {
+    writer->is_failed = 1;
+    return;
+  }
+  uint8_t field[2];
+  ipp_put_bytes(writer, &tag, 1);
+  field[0] = (uint8_t)(name_size >> 8);
+  field[1] = (uint8_t)name_size;
+  ipp_put_bytes(writer, field, 2);
+  ipp_put_bytes(writer, name, name_size);
+  field[0] = (uint8_t)(size >> 8);
+  field[1] = (uint8_t)size;
+  ipp_put_bytes(writer, field, 2);
+  ipp_put_bytes(writer, value, size);
+}
+
+void ipp_put_string(struct ipp_writer_t *writer, uint8_t tag,
+		    const char *name, const char *value)
+{
+  ipp_put_attr(writer, tag, name, value, strlen(value));
+}
+
+/* integer and enum values */
+void ipp_put_integer(struct ipp_writer_t *writer, uint8_t tag,
+		     const char *name, int32_t value)
+{
+  uint32_t bits = (uint32_t)value;
+  const uint8_t data[4] = {
+    (uint8_t)(bits >> 24), (uint8_t)(bits >> 16), (uint8_t)(bits >> 8),
+    (uint8_t)bits
+  };
+  ipp_put_attr(writer, tag, name, data, sizeof(data));
+}
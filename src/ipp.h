@@ -0,0 +1,142 @@
+/* Copyright (C) 2014 Daniel Dressler and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. */
+
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+#include "http.h"
+
+/* RFC 8010: version-number, operation-id or status-code, request-id */
+#define IPP_HEADER_SIZE 8
+
+/* Operations */
+#define IPP_OP_PRINT_JOB 0x0002
+#define IPP_OP_VALIDATE_JOB 0x0004
+#define IPP_OP_GET_JOB_ATTRIBUTES 0x0009
+#define IPP_OP_GET_JOBS 0x000a
+#define IPP_OP_GET_PRINTER_ATTRIBUTES 0x000b
+#define IPP_OP_CREATE_PRINTER_SUBSCRIPTIONS 0x0016
+#define IPP_OP_CREATE_JOB_SUBSCRIPTIONS 0x0017
+#define IPP_OP_GET_SUBSCRIPTION_ATTRIBUTES 0x0018
+#define IPP_OP_GET_SUBSCRIPTIONS 0x0019
+#define IPP_OP_RENEW_SUBSCRIPTION 0x001a
+#define IPP_OP_CANCEL_SUBSCRIPTION 0x001b
+#define IPP_OP_GET_NOTIFICATIONS 0x001c
+
+/* Status codes */
+#define IPP_STATUS_OK 0x0000
+#define IPP_STATUS_BAD_REQUEST 0x0400
+#define IPP_STATUS_NOT_POSSIBLE 0x0404
+#define IPP_STATUS_NOT_FOUND 0x0406
+#define IPP_STATUS_ATTRIBUTES_NOT_SUPPORTED 0x040b
+#define IPP_STATUS_IGNORED_ALL_SUBSCRIPTIONS 0x0414
+#define IPP_STATUS_TOO_MANY_SUBSCRIPTIONS 0x0415
+
+/* Delimiter tags */
+#define IPP_TAG_OPERATION 0x01
+#define IPP_TAG_JOB 0x02
+#define IPP_TAG_END 0x03
+#define IPP_TAG_PRINTER 0x04
+#define IPP_TAG_UNSUPPORTED 0x05
+#define IPP_TAG_SUBSCRIPTION 0x06
+#define IPP_TAG_EVENT_NOTIFICATION 0x07
+
+/* Value tags */
+#define IPP_TAG_INTEGER 0x21
+#define IPP_TAG_BOOLEAN 0x22
+#define IPP_TAG_ENUM 0x23
+#define IPP_TAG_OCTETSTRING 0x30
+#define IPP_TAG_TEXT 0x41
+#define IPP_TAG_NAME 0x42
+#define IPP_TAG_KEYWORD 0x44
+#define IPP_TAG_URI 0x45
+#define IPP_TAG_CHARSET 0x47
+#define IPP_TAG_LANGUAGE 0x48
+#define IPP_TAG_MIMETYPE 0x49
+
+/* Bytes of an IPP message where they lie, in the segments of a packet
+   or in a buffer read as a single segment. A view may run on from one
+   segment into the next, offset is into the data of seg. */
+struct ipp_view_t {
+  const struct http_segment_t *seg;
+  size_t offset;
+  size_t size;
+};
+
+/* One attribute of an IPP message: its name, its first value and all
+   of it, including additional values and collection members, with
+   where it starts in the message */
+struct ipp_attr_t {
+  uint8_t group;
+  uint8_t tag;
+  struct ipp_view_t name;
+  struct ipp_view_t value;
+  struct ipp_view_t all;
+  size_t offset;
+};
+
+/* Walks an IPP message right where it was received, nothing of it is
+   copied. The views it hands out stay valid as long as the packet or
+   buffer does, those into a buffer also need the reader not to move.
+   Attributes end at the end-of-attributes tag, document data follows
+   it. */
+struct ipp_reader_t {
+  struct http_segment_t buffer;
+
+  uint8_t version_major;
+  uint8_t version_minor;
+  uint16_t op_status;
+  uint32_t request_id;
+
+  /* All of the message, the attributes and what is left of them */
+  struct ipp_view_t message;
+  struct ipp_view_t attrs;
+  struct ipp_view_t pos;
+  uint8_t group;
+};
+
+/* Builds an IPP message in a growing buffer. A failure to grow it is
+   remembered and only needs to be checked once at the end. */
+struct ipp_writer_t {
+  uint8_t *data;
+  size_t size;
+  size_t capacity;
+  int is_failed;
+};
+
+int ipp_op_is_read_only(uint16_t);
+int ipp_reader_init(struct ipp_reader_t *, const struct http_packet_t *,
+		    size_t);
+int ipp_reader_init_buffer(struct ipp_reader_t *, const uint8_t *, size_t);
+void ipp_reader_rewind(struct ipp_reader_t *);
+int ipp_reader_check(struct ipp_reader_t *);
+int ipp_attr_next(struct ipp_reader_t *, struct ipp_attr_t *);
+int ipp_attr_find(struct ipp_reader_t *, uint8_t, const char *,
+		  struct ipp_attr_t *);
+int ipp_attr_is(const struct ipp_attr_t *, const char *);
+int ipp_attr_value_next(struct ipp_view_t *, struct ipp_view_t *);
+
+size_t ipp_view_copy(const struct ipp_view_t *, void *, size_t);
+int ipp_view_is(const struct ipp_view_t *, const char *);
+int ipp_view_integer(const struct ipp_view_t *, int32_t *);
+
+void ipp_writer_init(struct ipp_writer_t *, uint8_t, uint8_t, uint16_t,
+		     uint32_t);
+void ipp_put_group(struct ipp_writer_t *, uint8_t);
+void ipp_put_attr(struct ipp_writer_t *, uint8_t, const char *,
+		  const void *, size_t);
+void ipp_put_string(struct ipp_writer_t *, uint8_t, const char *,
+		    const char *);
+void ipp_put_integer(struct ipp_writer_t *, uint8_t, const char *, int32_t);
@@ -0,0 +1,594 @@
+/* Copyright (C) 2014 Daniel Dressler and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "logging.h"
+#include "ipp.h"
+#include "ippcache.h"
+
+/* Recent Get-Printer-Attributes responses. cups-browsed, ippfind, the
+   driverless backend and print dialogs all poll the printer with the
+   same few queries, which would each take a USB interface. */
+static struct {
+  pthread_mutex_t lock;
+  int ttl;
+  struct ipp_cache_entry_t *entries[IPP_CACHE_MAX_ENTRIES];
+
+  /* printer-state and printer-state-reasons as last seen */
+  uint8_t *state;
+  size_t state_size;
+
+  /* Statistics */
+  size_t hits;
+  size_t stores;
+  size_t invalidations;
+} ipp_cache = {
+  .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static const char *const ipp_cache_groups[] = {
+  "all", "printer-description", "job-template", NULL
+};
+
+static time_t ipp_cache_now(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec;
+}
+
+static void ipp_cache_key_free(struct ipp_cache_key_t *key)
+{
+  free(key->target);
+  free(key->host);
+  free(key->document_format);
+  for (size_t i = 0; i < key->num_names; i++)
+    free(key->names[i]);
+  free(key->names);
+  memset(key, 0, sizeof(*key));
+}
+
+static void ipp_cache_entry_free(struct ipp_cache_entry_t *entry)
+{
+  ipp_cache_key_free(&entry->key);
+  free(entry->ipp);
+  free(entry);
+}
+
+/* Called with the cache locked */
+static void ipp_cache_flush(void)
+{
+  for (size_t i = 0; i < IPP_CACHE_MAX_ENTRIES; i++)
+    if (ipp_cache.entries[i] != NULL) {
+      ipp_cache_entry_free(ipp_cache.entries[i]);
+      ipp_cache.entries[i] = NULL;
+    }
+}
+
+void ipp_cache_init(int ttl)
+{
+  ipp_cache.ttl = ttl;
+  if (ttl > 0)
+    NOTE("IPP cache: Reusing Get-Printer-Attributes responses for %d s",
+	 ttl);
+}
+
+void ipp_cache_shutdown(void)
+{
+  pthread_mutex_lock(&ipp_cache.lock);
+  NOTE("IPP cache: %lu hits, %lu stores, %lu invalidations",
+       ipp_cache.hits, ipp_cache.stores, ipp_cache.invalidations);
+  ipp_cache_flush();
+  free(ipp_cache.state);
+  ipp_cache.state = NULL;
+  ipp_cache.state_size = 0;
+  pthread_mutex_unlock(&ipp_cache.lock);
+}
+
+void ipp_cache_invalidate(const char *reason)
+{
+  if (ipp_cache.ttl <= 0)
+    return;
+
+  pthread_mutex_lock(&ipp_cache.lock);
+  {
+    NOTE("IPP cache: Invalidated, %s", reason);
+    ipp_cache_flush();
+    ipp_cache.invalidations++;
+  }
+  pthread_mutex_unlock(&ipp_cache.lock);
+}
+
+static char *header_dup(const struct http_header_index_t *idx,
+			const char *name)
+{
+  size_t size = 0;
+  const char *value = http_header_get(idx, name, &size);
+  if (value == NULL)
+    return NULL;
+  return strndup(value, size);
+}
+
+static char *view_dup(const struct ipp_view_t *view)
+{
+  char *copy = malloc(view->size + 1);
+  if (copy == NULL)
+    return NULL;
+  ipp_view_copy(view, copy, view->size);
+  copy[view->size] = '\0';
+  return copy;
+}
+
+static int ipp_cache_name_cmp(const void *a, const void *b)
+{
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* The key takes the name over, it is freed if it cannot be added */
+static int ipp_cache_key_add(struct ipp_cache_key_t *key, char *name)
+{
+  if (name == NULL)
+    return -1;
+  if (key->num_names >= IPP_CACHE_MAX_REQUESTED)
+    goto error;
+  if (key->names == NULL) {
+    key->names = calloc(IPP_CACHE_MAX_REQUESTED, sizeof(*key->names));
+    if (key->names == NULL)
+      goto error;
+  }
+  for (size_t i = 0; ipp_cache_groups[i] != NULL; i++)
+    if (strcmp(name, ipp_cache_groups[i]) == 0)
+      key->has_groups = 1;
+  key->names[key->num_names++] = name;
+  return 0;
+
+ error:
+  free(name);
+  return -1;
+}
+
+static int ipp_cache_key_parse(struct ipp_cache_key_t *key,
+			       const struct http_header_index_t *header,
+			       struct ipp_reader_t *reader)
+{
+  memset(key, 0, sizeof(*key));
+  size_t target_size = 0;
+  const char *target = http_header_start_token(header, 1, &target_size);
+  if (target == NULL)
+    return -1;
+  key->target = strndup(target, target_size);
+  key->host = header_dup(header, "Host");
+  if (key->target == NULL)
+    goto error;
+
+  struct ipp_attr_t attr;
+  if (ipp_attr_find(reader, IPP_TAG_OPERATION, "document-format", &attr)) {
+    key->document_format = view_dup(&attr.value);
+    if (key->document_format == NULL)
+      goto error;
+  }
+  if (ipp_attr_find(reader, IPP_TAG_OPERATION, "requested-attributes",
+		    &attr)) {
+    struct ipp_view_t values = attr.all, value;
+    while (ipp_attr_value_next(&values, &value))
+      if (ipp_cache_key_add(key, view_dup(&value)) != 0)
+	goto error;
+  }
+
+  if (key->num_names == 0 && ipp_cache_key_add(key, strdup("all")) != 0)
+    goto error;
+  qsort(key->names, key->num_names, sizeof(*key->names),
+	ipp_cache_name_cmp);
+  return 0;
+
+ error:
+  ipp_cache_key_free(key);
+  return -1;
+}
+
+static int ipp_cache_str_eq(const char *a, const char *b)
+{
+  if (a == NULL || b == NULL)
+    return a == b;
+  return strcmp(a, b) == 0;
+}
+
+static int ipp_cache_key_has(const struct ipp_cache_key_t *key,
+			     const char *name)
+{
+  return bsearch(&name, key->names, key->num_names, sizeof(*key->names),
+		 ipp_cache_name_cmp) != NULL;
+}
+
+static int ipp_cache_response_has(const struct ipp_cache_entry_t *entry,
+				  const char *name)
+{
+  struct ipp_reader_t reader;
+  struct ipp_attr_t attr;
+  return ipp_reader_init_buffer(&reader, entry->ipp, entry->ipp_size) == 0 &&
+    ipp_attr_find(&reader, IPP_TAG_PRINTER, name, &attr);
+}
+
+/* 1 if the entry answers the query as is, 2 if its response has to be
+   cut down to the requested attributes, 0 if it cannot answer it */
+static int ipp_cache_entry_answers(const struct ipp_cache_entry_t *entry,
+				   const struct ipp_cache_key_t *key)
+{
+  const struct ipp_cache_key_t *stored = &entry->key;
+  if (!ipp_cache_str_eq(stored->target, key->target) ||
+      !ipp_cache_str_eq(stored->host, key->host) ||
+      !ipp_cache_str_eq(stored->document_format, key->document_format))
+    return 0;
+
+  if (stored->num_names == key->num_names) {
+    size_t i;
+    for (i = 0; i < key->num_names; i++)
+      if (strcmp(stored->names[i], key->names[i]) != 0)
+	break;
+    if (i == key->num_names)
+      return 1;
+  }
+
+  /* A superset answers a query for single attributes. Which attributes
+     groups like "all" stand for is up to the printer, so only what the
+     response actually contains counts for them. */
+  if (key->has_groups)
+    return 0;
+  for (size_t i = 0; i < key->num_names; i++)
+    if (!ipp_cache_key_has(stored, key->names[i]) &&
+	!(stored->has_groups &&
+	  ipp_cache_response_has(entry, key->names[i])))
+      return 0;
+  return 2;
+}
+
+/* Called with the cache locked */
+static struct ipp_cache_entry_t *ipp_cache_find(const struct ipp_cache_key_t *key,
+						int *match)
+{
+  time_t now = ipp_cache_now();
+  struct ipp_cache_entry_t *found = NULL;
+  for (size_t i = 0; i < IPP_CACHE_MAX_ENTRIES; i++) {
+    struct ipp_cache_entry_t *entry = ipp_cache.entries[i];
+    if (entry == NULL || entry->expires <= now)
+      continue;
+    int answers = ipp_cache_entry_answers(entry, key);
+    if (answers == 1) {
+      *match = 1;
+      return entry;
+    }
+    if (answers == 2 && found == NULL) {
+      *match = 2;
+      found = entry;
+    }
+  }
+  return found;
+}
+
+/* Called with the cache locked */
+static uint8_t *ipp_cache_answer(const struct ipp_cache_entry_t *entry,
+				 const struct ipp_cache_key_t *key, int match,
+				 uint32_t request_id, size_t *size)
+{
+  /* The HTTP header is added in front once the IPP size is known */
+  char header[128];
+  uint8_t *response = malloc(sizeof(header) + entry->ipp_size + 2);
+  if (response == NULL)
+    return NULL;
+  uint8_t *ipp = response + sizeof(header);
+  size_t ipp_size = 0;
+
+  if (match == 1) {
+    memcpy(ipp, entry->ipp, entry->ipp_size);
+    ipp_size = entry->ipp_size;
+  } else {
+    memcpy(ipp, entry->ipp, IPP_HEADER_SIZE);
+    ipp_size = IPP_HEADER_SIZE;
+
+    struct ipp_reader_t reader;
+    struct ipp_attr_t attr;
+    uint8_t group = 0;
+    ipp_reader_init_buffer(&reader, entry->ipp, entry->ipp_size);
+    while (ipp_attr_next(&reader, &attr) == 1) {
+      if (attr.group == IPP_TAG_PRINTER) {
+	char name[256];
+	if (attr.name.size >= sizeof(name))
+	  continue;
+	ipp_view_copy(&attr.name, name, attr.name.size);
+	name[attr.name.size] = '\0';
+	if (!ipp_cache_key_has(key, name))
+	  continue;
+      } else if (attr.group != IPP_TAG_OPERATION)
+	continue;
+      if (attr.group != group) {
+	group = attr.group;
+	ipp[ipp_size++] = group;
+      }
+      ipp_size += ipp_view_copy(&attr.all, ipp + ipp_size, attr.all.size);
+    }
+    if (group != IPP_TAG_PRINTER)
+      ipp[ipp_size++] = IPP_TAG_PRINTER;
+    ipp[ipp_size++] = IPP_TAG_END;
+  }
+
+  ipp[4] = (uint8_t)(request_id >> 24);
+  ipp[5] = (uint8_t)(request_id >> 16);
+  ipp[6] = (uint8_t)(request_id >> 8);
+  ipp[7] = (uint8_t)request_id;
+
+  int header_size = snprintf(header, sizeof(header),
+			     "HTTP/1.1 200 OK\r\n"
+			     "Content-Type: application/ipp\r\n"
+			     "Content-Length: %lu\r\n\r\n", ipp_size);
+  if (header_size < 0 || (size_t)header_size >= sizeof(header)) {
+    free(response);
+    return NULL;
+  }
+  memcpy(ipp - header_size, header, (size_t)header_size);
+  memmove(response, ipp - header_size, (size_t)header_size + ipp_size);
+  *size = (size_t)header_size + ipp_size;
+  return response;
+}
+
+/* Parses a Get-Printer-Attributes request. Returns 0 with its key, 1
+   with the operation of any other request and -1 if the request is not
+   all in or has no operation-id. */
+static int ipp_cache_parse_request(const struct http_message_t *msg,
+				   const struct http_packet_t *pkt,
+				   struct ipp_cache_key_t *key,
+				   uint16_t *op, uint32_t *request_id)
+{
+  ssize_t body_size = http_header_content_length(&msg->header);
+  if (!msg->is_completed || msg->type != HTTP_CONTENT_LENGTH ||
+      body_size < IPP_HEADER_SIZE || (size_t)body_size > pkt->filled_size)
+    return -1;
+
+  /* Parsed right in the packet, all of the request is in it */
+  struct ipp_reader_t reader;
+  if (ipp_reader_init(&reader, pkt,
+		      pkt->filled_size - (size_t)body_size) != 0)
+    return -1;
+  *op = reader.op_status;
+  *request_id = reader.request_id;
+  if (ipp_reader_check(&reader) != 0 ||
+      *op != IPP_OP_GET_PRINTER_ATTRIBUTES)
+    return 1;
+  return ipp_cache_key_parse(key, &msg->header, &reader);
+}
+
+static int ipp_request_is_ipp(const struct http_message_t *msg)
+{
+  return http_header_method_is(&msg->header, "POST") &&
+    http_header_has_token(&msg->header, "Content-Type", "application/ipp");
+}
+
+uint8_t *ipp_cache_request(struct ipp_cache_exchange_t *xc,
+			   const struct http_message_t *msg,
+			   const struct http_packet_t *pkt, size_t *size)
+{
+  memset(xc, 0, sizeof(*xc));
+  if (ipp_cache.ttl <= 0 || !ipp_request_is_ipp(msg))
+    return NULL;
+
+  struct ipp_cache_key_t key;
+  uint16_t op = 0;
+  uint32_t request_id = 0;
+  int parsed = ipp_cache_parse_request(msg, pkt, &key, &op, &request_id);
+  if (parsed != 0) {
+    /* Jobs and settings change what the printer reports. A body still
+       on its way is a document, queries come at once. One which is in
+       without an operation-id changes nothing. */
+    if ((parsed > 0 && !ipp_op_is_read_only(op)) ||
+	(parsed < 0 && !msg->is_completed))
+      ipp_cache_invalidate("printer is being changed");
+    return NULL;
+  }
+
+  uint8_t *response = NULL;
+  pthread_mutex_lock(&ipp_cache.lock);
+  {
+    int match = 0;
+    struct ipp_cache_entry_t *entry = ipp_cache_find(&key, &match);
+    if (entry != NULL) {
+      response = ipp_cache_answer(entry, &key, match, request_id, size);
+      if (response != NULL)
+	ipp_cache.hits++;
+    }
+  }
+  pthread_mutex_unlock(&ipp_cache.lock);
+
+  if (response != NULL) {
+    NOTE("IPP cache: Answering Get-Printer-Attributes for %s",
+	 key.target);
+    ipp_cache_key_free(&key);
+    return response;
+  }
+
+  xc->is_collecting = 1;
+  xc->key = key;
+  return NULL;
+}
+
+int ipp_cache_has(const struct http_message_t *msg,
+		  const struct http_packet_t *pkt)
+{
+  if (ipp_cache.ttl <= 0 || !ipp_request_is_ipp(msg))
+    return 0;
+
+  struct ipp_cache_key_t key;
+  uint16_t op = 0;
+  uint32_t request_id = 0;
+  if (ipp_cache_parse_request(msg, pkt, &key, &op, &request_id) != 0)
+    return 0;
+
+  int match = 0;
+  pthread_mutex_lock(&ipp_cache.lock);
+  int found = ipp_cache_find(&key, &match) != NULL;
+  pthread_mutex_unlock(&ipp_cache.lock);
+  ipp_cache_key_free(&key);
+  return found;
+}
+
+static void ipp_cache_collect_stop(struct ipp_cache_exchange_t *xc)
+{
+  free(xc->data);
+  xc->data = NULL;
+  xc->size = 0;
+  xc->capacity = 0;
+  xc->is_collecting = 0;
+}
+
+void ipp_cache_response(struct ipp_cache_exchange_t *xc,
+			const struct http_message_t *msg,
+			const struct http_packet_t *pkt)
+{
+  if (!xc->is_collecting)
+    return;
+
+  if (msg->header.raw != NULL &&
+      (http_header_status(&msg->header) != 200 ||
+       msg->type != HTTP_CONTENT_LENGTH ||
+       msg->claimed_size > IPP_CACHE_MAX_RESPONSE)) {
+    ipp_cache_collect_stop(xc);
+    return;
+  }
+
+  if (xc->size + pkt->filled_size > xc->capacity) {
+    size_t capacity = xc->capacity > 0 ? xc->capacity : 4096;
+    while (capacity < xc->size + pkt->filled_size)
+      capacity *= 2;
+    uint8_t *data = realloc(xc->data, capacity);
+    if (data == NULL) {
+      ipp_cache_collect_stop(xc);
+      return;
+    }
+    xc->data = data;
+    xc->capacity = capacity;
+  }
+  xc->size += packet_copy(pkt, 0, xc->data + xc->size, pkt->filled_size);
+}
+
+/* printer-state and printer-state-reasons of a response, so that any
+   change of them drops everything cached before */
+static size_t ipp_cache_state(const uint8_t *ipp, size_t size,
+			      uint8_t *state, size_t state_size)
+{
+  static const char *const wanted[] = {
+    "printer-state", "printer-state-reasons", NULL
+  };
+  struct ipp_reader_t reader;
+  if (ipp_reader_init_buffer(&reader, ipp, size) != 0 ||
+      ipp_reader_check(&reader) != 0)
+    return 0;
+
+  size_t filled = 0;
+  for (size_t i = 0; wanted[i] != NULL; i++) {
+    struct ipp_attr_t attr;
+    if (!ipp_attr_find(&reader, IPP_TAG_PRINTER, wanted[i], &attr))
+      continue;
+    if (filled + attr.all.size > state_size)
+      return 0;
+    filled += ipp_view_copy(&attr.all, state + filled, attr.all.size);
+  }
+  return filled;
+}
+
+void ipp_cache_response_done(struct ipp_cache_exchange_t *xc,
+			     const struct http_message_t *msg)
+{
+  if (!xc->is_collecting || !msg->is_completed)
+    return;
+
+  ssize_t ipp_size = http_header_content_length(&msg->header);
+  struct ipp_reader_t reader;
+  if (ipp_size < IPP_HEADER_SIZE || (size_t)ipp_size > xc->size ||
+      ipp_reader_init_buffer(&reader, xc->data + xc->size - (size_t)ipp_size,
+			     (size_t)ipp_size) != 0 ||
+      reader.op_status != IPP_STATUS_OK)
+    return;
+
+  struct ipp_cache_entry_t *entry = calloc(1, sizeof(*entry));
+  if (entry == NULL)
+    return;
+  entry->ipp = malloc((size_t)ipp_size);
+  if (entry->ipp == NULL) {
+    free(entry);
+    return;
+  }
+  memcpy(entry->ipp, xc->data + xc->size - (size_t)ipp_size,
+	 (size_t)ipp_size);
+  entry->ipp_size = (size_t)ipp_size;
+  entry->key = xc->key;
+  memset(&xc->key, 0, sizeof(xc->key));
+  ipp_cache_collect_stop(xc);
+
+  uint8_t state[1024];
+  size_t state_size = ipp_cache_state(entry->ipp, entry->ipp_size, state,
+				      sizeof(state));
+
+  pthread_mutex_lock(&ipp_cache.lock);
+  {
+    if (state_size > 0) {
+      if (ipp_cache.state != NULL &&
+	  (ipp_cache.state_size != state_size ||
+	   memcmp(ipp_cache.state, state, state_size) != 0)) {
+	NOTE("IPP cache: Invalidated, printer state changed");
+	ipp_cache_flush();
+	ipp_cache.invalidations++;
+      }
+      uint8_t *copy = malloc(state_size);
+      if (copy != NULL) {
+	memcpy(copy, state, state_size);
+	free(ipp_cache.state);
+	ipp_cache.state = copy;
+	ipp_cache.state_size = state_size;
+      }
+    }
+
+    /* Take the slot of an identical query, a free or expired slot,
+       or else the one expiring first */
+    time_t now = ipp_cache_now();
+    size_t slot = 0;
+    for (size_t i = 0; i < IPP_CACHE_MAX_ENTRIES; i++) {
+      struct ipp_cache_entry_t *other = ipp_cache.entries[i];
+      if (other == NULL || other->expires <= now ||
+	  ipp_cache_entry_answers(other, &entry->key) == 1) {
+	slot = i;
+	break;
+      }
+      if (other->expires < ipp_cache.entries[slot]->expires)
+	slot = i;
+    }
+    if (ipp_cache.entries[slot] != NULL)
+      ipp_cache_entry_free(ipp_cache.entries[slot]);
+    entry->expires = now + ipp_cache.ttl;
+    ipp_cache.entries[slot] = entry;
+    ipp_cache.stores++;
+    NOTE("IPP cache: Storing Get-Printer-Attributes response (%lu bytes)",
+	 entry->ipp_size);
+  }
+  pthread_mutex_unlock(&ipp_cache.lock);
+}
+
+void ipp_cache_exchange_end(struct ipp_cache_exchange_t *xc)
+{
+  ipp_cache_key_free(&xc->key);
+  ipp_cache_collect_stop(xc);
+}
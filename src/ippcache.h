@@ -0,0 +1,69 @@
+/* Copyright (C) 2014 Daniel Dressler and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. */
+
+#pragma once
+#include <stdint.h>
+#include <time.h>
+
+#include "http.h"
+
+/* Default time in seconds a Get-Printer-Attributes response is reused */
+#define IPP_CACHE_DEFAULT_TTL 5
+#define IPP_CACHE_MAX_ENTRIES 16
+#define IPP_CACHE_MAX_REQUESTED 64
+#define IPP_CACHE_MAX_RESPONSE (1 << 20)
+
+/* What a Get-Printer-Attributes response depends on */
+struct ipp_cache_key_t {
+  char *target;
+  char *host;
+  char *document_format;
+  /* requested-attributes, sorted, "all" if none were given */
+  char **names;
+  size_t num_names;
+  /* Some names are groups like "all" rather than attributes */
+  int has_groups;
+};
+
+struct ipp_cache_entry_t {
+  struct ipp_cache_key_t key;
+  uint8_t *ipp;
+  size_t ipp_size;
+  time_t expires;
+};
+
+/* Cache state of one request and its response */
+struct ipp_cache_exchange_t {
+  int is_collecting;
+  struct ipp_cache_key_t key;
+  uint8_t *data;
+  size_t size;
+  size_t capacity;
+};
+
+void ipp_cache_init(int);
+void ipp_cache_shutdown(void);
+
+uint8_t *ipp_cache_request(struct ipp_cache_exchange_t *,
+			   const struct http_message_t *,
+			   const struct http_packet_t *, size_t *);
+int ipp_cache_has(const struct http_message_t *,
+		  const struct http_packet_t *);
+void ipp_cache_response(struct ipp_cache_exchange_t *,
+			const struct http_message_t *,
+			const struct http_packet_t *);
+void ipp_cache_response_done(struct ipp_cache_exchange_t *,
+			     const struct http_message_t *);
+void ipp_cache_exchange_end(struct ipp_cache_exchange_t *);
+void ipp_cache_invalidate(const char *);
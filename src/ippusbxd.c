@@ -26,6 +26,15 @@
 #include "options.h"
 #include "logging.h"
 #include "http.h"
+#include "cache.h"
+#include "ipp.h"
+#include "ippcache.h"
+#include "flight.h"
+#include "monitor.h"
+#include "spool.h"
+#include "reactor.h"
+#include "workers.h"
+#include "timeouts.h"
 #include "tcp.h"
 #include "usb.h"
 #include "dnssd.h"
@@ -33,14 +42,9 @@
 struct service_thread_param {
   struct tcp_conn_t *tcp;
   struct usb_sock_t *usb_sock;
-  pthread_t thread_handle;
   int thread_num;
 };
 
-static pthread_mutex_t thread_register_mutex;
-static struct service_thread_param **service_threads = NULL;
-static int num_service_threads = 0;
-
 static void sigterm_handler(int sig)
 {
   /* Flag that we should stop and return... */
@@ -48,115 +52,572 @@ static void sigterm_handler(int sig)
   NOTE("Caught signal %d, shutting down ...", sig);
 }
 
-static void list_service_threads(int num_service_threads,
-				 struct service_thread_param **service_threads)
+static void sigusr1_handler(int sig)
 {
-  int i;
-  char *p;
-  char buf[10240];
-
-  snprintf(buf, sizeof(buf), "Threads currently running: ");
-  p = buf + strlen(buf);
-  if (num_service_threads == 0) {
-    snprintf(p, sizeof(buf) - strlen(buf), "None");
-  } else {
-    for (i = 0; i < num_service_threads; i ++) {
-      snprintf(p, sizeof(buf) - strlen(buf), "#%d, ",
-	       service_threads[i]->thread_num);
-      p = buf + strlen(buf);
+  (void)sig;
+  /* The main loop reports when it gets to it */
+  g_options.report_stats = 1;
+}
+
+/* Number of requests of one client which may be in flight at the
+   printer at the same time when the client pipelines */
+#define PIPELINE_DEPTH 4
+
+/* In milliseconds a printer gets with --printer-continue to answer a
+   request header expecting 100-continue, after it the body goes on as
+   clients do it after waiting */
+#define PRINTER_CONTINUE_WAIT 1000
+
+/* Interfaces of the requests forwarded to the printer whose responses
+   were not passed back to the client yet, oldest first */
+struct pipeline_t {
+  struct usb_conn_t *in_flight[PIPELINE_DEPTH];
+  unsigned int first;
+  unsigned int count;
+  /* Every request in flight only queries the printer */
+  int read_only;
+};
+
+static void pipeline_push(struct pipeline_t *pl, struct usb_conn_t *usb)
+{
+  pl->in_flight[(pl->first + pl->count) % PIPELINE_DEPTH] = usb;
+  pl->count++;
+}
+
+static struct usb_conn_t *pipeline_pop(struct pipeline_t *pl)
+{
+  struct usb_conn_t *usb = pl->in_flight[pl->first];
+  pl->first = (pl->first + 1) % PIPELINE_DEPTH;
+  pl->count--;
+  return usb;
+}
+
+static int pipeline_uses(const struct pipeline_t *pl,
+			 const struct usb_conn_t *usb)
+{
+  for (unsigned int i = 0; i < pl->count; i++)
+    if (pl->in_flight[(pl->first + i) % PIPELINE_DEPTH] == usb)
+      return 1;
+  return 0;
+}
+
+/* Requests which may be overtaken by later ones: GETs and IPP
+   operations which only query the printer, and only if they arrived
+   completely in a single packet */
+static int request_is_read_only(const struct http_message_t *msg,
+				const struct http_packet_t *pkt)
+{
+  if (!msg->is_completed)
+    return 0;
+  if (http_header_method_is(&msg->header, "GET"))
+    return msg->type == HTTP_HEADER_ONLY;
+  if (!http_header_method_is(&msg->header, "POST") ||
+      msg->type != HTTP_CONTENT_LENGTH ||
+      !http_header_has_token(&msg->header, "Content-Type",
+			     "application/ipp"))
+    return 0;
+
+  ssize_t body_size = http_header_content_length(&msg->header);
+  if (body_size < IPP_HEADER_SIZE || (size_t)body_size > pkt->filled_size)
+    return 0;
+  struct ipp_reader_t reader;
+  return ipp_reader_init(&reader, pkt,
+			 pkt->filled_size - (size_t)body_size) == 0 &&
+    ipp_reader_check(&reader) == 0 && ipp_op_is_read_only(reader.op_status);
+}
+
+/* Forwards requests the client pipelined behind the ones in flight
+   right away, as long as they are already buffered completely, are
+   read-only and an interface is free for them. Their responses are
+   collected in order later on. */
+static int pipeline_forward_ahead(int thread_num,
+				  struct service_thread_param *arg,
+				  struct pipeline_t *pl,
+				  struct usb_conn_t *home,
+				  struct http_message_t **next_msg)
+{
+  while (pl->read_only && pl->count < PIPELINE_DEPTH &&
+	 *next_msg != NULL && !g_options.terminate) {
+    struct http_message_t *msg = *next_msg;
+    struct http_packet_t *pkt = packet_new(msg);
+    if (pkt == NULL)
+      return 0;
+    if (packet_pending_bytes(pkt) != 0 ||
+	!request_is_read_only(msg, pkt) || cache_has(&msg->header) ||
+	monitor_has(msg, pkt) || ipp_cache_has(msg, pkt)) {
+      /* Leave it to be read the regular way */
+      packet_unget(pkt);
+      return 0;
+    }
+
+    struct usb_conn_t *usb = home;
+    if (usb == NULL || pipeline_uses(pl, usb))
+      usb = usb_conn_try_acquire(arg->usb_sock);
+    if (usb == NULL) {
+      packet_unget(pkt);
+      return 0;
+    }
+
+    NOTE("Thread #%d: M %p P %p: Interface #%d: Forwarding pipelined request (%lu in flight)",
+	 thread_num, msg, pkt, usb->interface_index, pl->count);
+    if (usb_conn_packet_send(usb, pkt) != 0) {
+      ERR("Thread #%d: M %p P %p: Interface #%d: Unable to send pipelined request via USB",
+	  thread_num, msg, pkt, usb->interface_index);
+      packet_free(pkt);
+      if (usb != home)
+	usb_conn_release(usb);
+      return -1;
+    }
+    packet_free(pkt);
+    pipeline_push(pl, usb);
+
+    *next_msg = NULL;
+    if (msg->spare_filled > 0) {
+      *next_msg = http_message_new(msg->pool);
+      if (*next_msg == NULL) {
+	message_free(msg);
+	return -1;
+      }
+      message_pass_spare(msg, *next_msg);
     }
-    p -= 2;
-    *p = '\0';
+    message_free(msg);
   }
-  buf[sizeof(buf) - 1] = '\0';
-  NOTE("%s", buf);
+  return 0;
 }
 
-static int register_service_thread(int *num_service_threads,
-				   struct service_thread_param ***service_threads,
-				   struct service_thread_param *new_thread)
+/* Reads and drops the responses to requests still in flight, so that
+   no stale response is left on an interface for its next user */
+static void pipeline_drain(int thread_num, struct pipeline_t *pl,
+			   struct usb_conn_t *home, struct http_pool_t *pool,
+			   int usb_failed)
 {
-  NOTE("Registering thread #%d", new_thread->thread_num);
-  (*num_service_threads) ++;
-  *service_threads = realloc(*service_threads,
-			     *num_service_threads * sizeof(void*));
-  if (*service_threads == NULL) {
-    ERR("Registering thread #%d: Failed to alloc space for thread registration list",
-	new_thread->thread_num);
-    return -1;
+  while (pl->count > 0) {
+    struct usb_conn_t *usb = pipeline_pop(pl);
+    if (usb == NULL)
+      continue;
+
+    if (!usb_failed && !g_options.terminate) {
+      NOTE("Thread #%d: Interface #%d: Dropping response to pipelined request",
+	   thread_num, usb->interface_index);
+      struct http_message_t *msg = http_message_new(pool);
+      while (msg != NULL && !msg->is_completed && !g_options.terminate) {
+	struct http_packet_t *pkt = usb_conn_packet_get(usb, msg);
+	if (pkt == NULL) {
+	  usb_failed = 1;
+	  break;
+	}
+	packet_free(pkt);
+      }
+      if (msg != NULL)
+	message_free(msg);
+    }
+    if (usb != home)
+      usb_conn_release(usb);
   }
-  (*service_threads)[*num_service_threads - 1] = new_thread;
-  return 0;
 }
 
-static int unregister_service_thread(int *num_service_threads,
-				     struct service_thread_param ***service_threads,
-				     int thread_num)
+static int send_cache_entry(int thread_num, struct tcp_conn_t *tcp,
+			    struct cache_entry_t *entry, int not_modified)
 {
-  int i;
+  size_t size = 0;
+  const uint8_t *data = cache_entry_data(entry, not_modified, &size);
+  NOTE("Thread #%d: Answering %s from cache (%lu bytes)",
+       thread_num, entry->target, size);
+  int status = tcp_send(tcp, data, size);
+  cache_entry_release(entry);
+  return status;
+}
+
+/* A copy of the client's request asking the printer whether the
+   cached response is still valid */
+static struct http_packet_t *revalidation_packet(struct cache_exchange_t *xc,
+						 struct http_message_t *client_msg)
+{
+  size_t size = 0;
+  uint8_t *request = cache_revalidation_request(xc, &client_msg->header,
+						&size);
+  if (request == NULL)
+    return NULL;
+
+  struct http_message_t *msg = http_message_new(client_msg->pool);
+  struct http_packet_t *pkt = msg != NULL ? packet_new(msg) : NULL;
+  if (pkt == NULL || packet_append(pkt, request, size) != 0) {
+    if (pkt != NULL)
+      packet_free(pkt);
+    if (msg != NULL)
+      message_free(msg);
+    pkt = NULL;
+  }
+  free(request);
+  return pkt;
+}
 
-  NOTE("Unregistering thread #%d", thread_num);
-  for (i = 0; i < *num_service_threads; i ++)
-    if ((*service_threads)[i]->thread_num == thread_num)
+/* A job's document passes through a ring buffer: the connection
+   thread fills it from the client while a writer thread empties it
+   towards the printer. Both positions only grow, the offset in the
+   buffer is taken modulo its size. */
+struct bulk_relay_t {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct usb_conn_t *usb;
+  uint8_t *data;
+  size_t capacity;
+  size_t received;
+  size_t sent;
+  int is_ended;
+  int is_failed;
+};
+
+static void *bulk_relay_write(void *arg_void)
+{
+  struct bulk_relay_t *relay = arg_void;
+
+  pthread_mutex_lock(&relay->lock);
+  for (;;) {
+    while (relay->sent == relay->received && !relay->is_ended)
+      pthread_cond_wait(&relay->cond, &relay->lock);
+    if (relay->sent == relay->received)
+      break;
+
+    /* Up to a block at a time, without wrapping around */
+    size_t offset = relay->sent % relay->capacity;
+    size_t size = relay->received - relay->sent;
+    if (size > relay->capacity - offset)
+      size = relay->capacity - offset;
+    if (size > HTTP_BULK_BLOCK)
+      size = HTTP_BULK_BLOCK;
+    pthread_mutex_unlock(&relay->lock);
+
+    /* In no-printer mode the body is dropped */
+    int status = 0;
+    if (relay->usb != NULL && !g_options.terminate)
+      status = usb_conn_send(relay->usb, relay->data + offset, size);
+
+    pthread_mutex_lock(&relay->lock);
+    if (status != 0) {
+      relay->is_failed = 1;
+      pthread_cond_broadcast(&relay->cond);
+      break;
+    }
+    relay->sent += size;
+    pthread_cond_broadcast(&relay->cond);
+  }
+  pthread_mutex_unlock(&relay->lock);
+  return NULL;
+}
+
+/* The document of a job goes from the client to the printer in large
+   blocks: read straight into the relay's buffer and written with one
+   bulk transfer each, only the end of the message is tracked on the
+   way. The transfer to the printer runs in a thread of its own, so the
+   client does not have to wait for it. With a spool the buffer holds
+   the whole document and the client is done at the speed of the
+   network, otherwise two blocks take turns. These two are in memory
+   the USB driver transfers from directly, so that each byte of a job
+   is copied once, from the socket. They come out of the connection's
+   buffer budget, with less left the client is held back sooner. */
+static int forward_body_bulk(int thread_num, struct tcp_conn_t *tcp,
+			     struct usb_conn_t *usb,
+			     struct http_message_t *msg)
+{
+  struct bulk_relay_t relay;
+  memset(&relay, 0, sizeof(relay));
+  relay.usb = usb;
+
+  struct usb_sock_t *usb_sock = usb != NULL ? usb->parent : NULL;
+  struct spool_t spool;
+  int is_spooled = 0;
+  int is_dma = 0;
+  if (g_options.spool_dir != NULL) {
+    size_t size = g_options.spool_max_size;
+    if (msg->type == HTTP_CONTENT_LENGTH &&
+	msg->claimed_size - msg->received_size < size)
+      size = msg->claimed_size - msg->received_size;
+    if (spool_open(&spool, size) == 0) {
+      relay.data = spool.data;
+      relay.capacity = spool.mapped_size;
+      is_spooled = 1;
+    } else
+      WARN("Thread #%d: M %p: Passing on job without spool",
+	   thread_num, msg);
+  }
+  if (!is_spooled) {
+    relay.capacity = http_pool_take(msg->pool, 2 * HTTP_BULK_BLOCK,
+				    2 * HTTP_SEGMENT_SIZE);
+    if (relay.capacity == 0) {
+      ERR("Thread #%d: M %p: No buffer budget left for bulk body",
+	  thread_num, msg);
+      return -1;
+    }
+    relay.data = usb_buffer_alloc(usb_sock, relay.capacity, &is_dma);
+    if (relay.data == NULL) {
+      ERR("Thread #%d: M %p: Failed to alloc bulk buffer", thread_num, msg);
+      http_pool_give(msg->pool, relay.capacity);
+      return -1;
+    }
+  }
+  pthread_mutex_init(&relay.lock, NULL);
+  pthread_cond_init(&relay.cond, NULL);
+
+  int status = 0;
+  pthread_t writer;
+  if (pthread_create(&writer, NULL, bulk_relay_write, &relay) != 0) {
+    ERR("Thread #%d: M %p: Failed to start bulk writer", thread_num, msg);
+    status = -1;
+    goto cleanup;
+  }
+
+  while (!msg->is_completed && !g_options.terminate) {
+    /* Wait for room, the printer may be behind by a full buffer */
+    pthread_mutex_lock(&relay.lock);
+    while (relay.received - relay.sent == relay.capacity &&
+	   !relay.is_failed)
+      pthread_cond_wait(&relay.cond, &relay.lock);
+    int is_failed = relay.is_failed;
+    size_t offset = relay.received % relay.capacity;
+    size_t space = relay.capacity - (relay.received - relay.sent);
+    pthread_mutex_unlock(&relay.lock);
+    if (is_failed)
+      break;
+    if (space > relay.capacity - offset)
+      space = relay.capacity - offset;
+    if (space > HTTP_BULK_BLOCK)
+      space = HTTP_BULK_BLOCK;
+    if (is_spooled && spool_extend(&spool, offset + space) != 0) {
+      status = -1;
+      break;
+    }
+
+    /* Wait for data, then add whatever else is there already */
+    size_t filled = 0;
+    while (filled < space && !msg->is_completed) {
+      ssize_t size = tcp_body_get(tcp, msg, relay.data + offset + filled,
+				  space - filled, filled == 0);
+      if (size < 0) {
+	status = -1;
+	break;
+      }
+      if (size == 0)
+	break;
+      filled += (size_t)size;
+    }
+
+    pthread_mutex_lock(&relay.lock);
+    relay.received += filled;
+    pthread_cond_broadcast(&relay.cond);
+    pthread_mutex_unlock(&relay.lock);
+    if (status != 0)
       break;
-  if (i >= *num_service_threads) {
-    ERR("Unregistering thread #%d: Cannot unregister, not found", thread_num);
-    return -1;
   }
-  (*num_service_threads) --;
-  for (; i < *num_service_threads; i ++)
-    (*service_threads)[i] = (*service_threads)[i + 1];
-  *service_threads = realloc(*service_threads,
-			     *num_service_threads * sizeof(void*));
-  if (*num_service_threads == 0)
-    *service_threads = NULL;
-  else if (*service_threads == NULL) {
-    ERR("Unregistering thread #%d: Failed to alloc space for thread registration list",
-	thread_num);
+  if (is_spooled)
+    NOTE("Thread #%d: M %p: Spooled %lu bytes of body, waiting for the "
+	 "printer to take them", thread_num, msg, relay.received);
+
+  /* Let the writer finish what it was given */
+  pthread_mutex_lock(&relay.lock);
+  relay.is_ended = 1;
+  pthread_cond_broadcast(&relay.cond);
+  pthread_mutex_unlock(&relay.lock);
+  pthread_join(writer, NULL);
+  if (relay.is_failed)
+    status = -1;
+
+  NOTE("Thread #%d: M %p: Passed on %lu bytes of body in bulk",
+       thread_num, msg, relay.sent);
+
+ cleanup:
+  pthread_cond_destroy(&relay.cond);
+  pthread_mutex_destroy(&relay.lock);
+  if (is_spooled)
+    spool_close(&spool);
+  else {
+    usb_buffer_free(usb_sock, relay.data, relay.capacity, is_dma);
+    http_pool_give(msg->pool, relay.capacity);
+  }
+  return status;
+}
+
+/* A request body which ends with the client closing its side of the
+   connection cannot end that way towards the printer, it goes on in
+   chunks there */
+static int send_rechunked(struct usb_conn_t *usb, struct http_message_t *msg,
+			  struct http_packet_t *pkt, int has_header)
+{
+  static const char *const dropped[] = { "Expect", NULL };
+  size_t header_size = has_header ? pkt->header_size : 0;
+  size_t body_size = pkt->filled_size - header_size;
+  size_t reserve = body_size + 32;
+  size_t capacity = reserve;
+  if (has_header)
+    capacity += msg->header.raw_size + 2 * msg->header.num_fields + 64;
+  uint8_t *data = malloc(capacity);
+  if (data == NULL)
     return -1;
+
+  size_t size = 0;
+  if (has_header) {
+    size = http_header_rewrite(&msg->header,
+			       msg->is_continued ? dropped : NULL,
+			       "Transfer-Encoding: chunked\r\n", data,
+			       capacity - reserve);
+    if (size == 0) {
+      free(data);
+      return -1;
+    }
+    /* Chunks need HTTP/1.1 */
+    size_t method_size = 0, target_size = 0, version_size = 0;
+    http_header_start_token(&msg->header, 0, &method_size);
+    http_header_start_token(&msg->header, 1, &target_size);
+    const char *version = http_header_start_token(&msg->header, 2,
+						  &version_size);
+    if (version != NULL && version_size == 8 &&
+	memcmp(version, "HTTP/1.0", 8) == 0)
+      data[method_size + 1 + target_size + 1 + 7] = '1';
   }
-  return 0;
+  if (body_size > 0) {
+    size += (size_t)sprintf((char *)data + size, "%lx\r\n", body_size);
+    size += packet_copy(pkt, header_size, data + size, body_size);
+    memcpy(data + size, "\r\n", 2);
+    size += 2;
+  }
+  if (msg->is_completed) {
+    memcpy(data + size, "0\r\n\r\n", 5);
+    size += 5;
+  }
+  int status = size > 0 ? usb_conn_send(usb, data, size) : 0;
+  free(data);
+  return status;
 }
 
-static void
-cleanup_handler(void *arg_void)
+/* With --printer-continue the printer decides whether the client
+   sends the body of a request expecting 100-continue. Its 100 Continue
+   goes on to the client, which then sends the body. A final response
+   right away means the printer refused the request before its body,
+   that response is passed on and, as whatever the client sends next
+   might still be that body, the connection closed. Returns 1 when the
+   request got its final response, 0 when the body is to follow and -1
+   if the client or the printer failed, the connection is closed then
+   too. */
+static int relay_printer_continue(int thread_num, struct tcp_conn_t *tcp,
+				  struct usb_conn_t *usb,
+				  struct http_pool_t *pool)
 {
-  int thread_num = *((int *)(arg_void));
-  NOTE("Thread #%d: Called clean-up handler", thread_num);
-  pthread_mutex_lock(&thread_register_mutex);
-  unregister_service_thread(&num_service_threads, &service_threads, thread_num);
-  list_service_threads(num_service_threads, service_threads);
-  pthread_mutex_unlock(&thread_register_mutex);
+  int status = 0;
+  struct http_packet_t *pkt = NULL;
+  struct http_message_t *msg = http_message_new(pool);
+  if (msg == NULL)
+    return -1;
+
+  pkt = usb_conn_packet_wait(usb, msg, PRINTER_CONTINUE_WAIT);
+  while (pkt != NULL && pkt->filled_size > 0) {
+    int code = http_header_status(&msg->header);
+    if (code >= 100 && code < 200 && msg->is_completed) {
+      NOTE("Thread #%d: Printer answered 100-continue with %d",
+	   thread_num, code);
+      status = tcp_packet_send(tcp, pkt);
+      packet_free(pkt);
+      pkt = NULL;
+      if (status != 0 || code == 100)
+	break;
+      /* Any other interim response, the decision is still to come */
+      struct http_message_t *interim = msg;
+      msg = http_message_new(pool);
+      if (msg == NULL) {
+	message_free(interim);
+	return -1;
+      }
+      message_pass_spare(interim, msg);
+      message_free(interim);
+      pkt = usb_conn_packet_wait(usb, msg, PRINTER_CONTINUE_WAIT);
+      continue;
+    }
+
+    NOTE("Thread #%d: Printer refused request before its body with %d",
+	 thread_num, code);
+    status = 1;
+    while (pkt != NULL) {
+      if (tcp_packet_send(tcp, pkt) != 0)
+	status = -1;
+      packet_free(pkt);
+      pkt = NULL;
+      if (status < 0 || msg->is_completed)
+	break;
+      pkt = usb_conn_packet_get(usb, msg);
+      if (pkt == NULL)
+	status = -1;
+    }
+    tcp->is_closed = 1;
+    break;
+  }
+  if (pkt != NULL) {
+    NOTE("Thread #%d: Printer did not answer 100-continue, body follows",
+	 thread_num);
+    packet_free(pkt);
+  } else if (status == 0 && !msg->is_completed)
+    status = -1;
+  if (status < 0)
+    tcp->is_closed = 1;
+  message_free(msg);
+  return status;
 }
 
-static void *service_connection(void *arg_void)
+static void service_connection(struct service_thread_param *arg)
 {
-  struct service_thread_param *arg =
-    (struct service_thread_param *)arg_void;
   int thread_num = arg->thread_num;
 
   NOTE("Thread #%d: Starting", thread_num);
 
-  /* Detach this thread so that the main thread does not need to join this thread
-     after termination for clean-up */
-  pthread_detach(pthread_self());
+  /* Messages, packets and their buffers are recycled for the lifetime
+     of the connection */
+  struct http_pool_t pool;
+  http_pool_init(&pool);
+  pool.budget = g_options.conn_buffer_size;
 
-  /* Register clean-up handler */
-  pthread_cleanup_push(cleanup_handler, &thread_num);
-
-  /* Allow immediate cancelling of this thread */
-  pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-  pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+  /* Requests sent to the printer, and the bytes the client sent
+     beyond the last request read: its next pipelined requests */
+  struct pipeline_t pipeline;
+  memset(&pipeline, 0, sizeof(pipeline));
+  struct http_message_t *next_msg = NULL;
 
   /* classify priority */
   struct usb_conn_t *usb = NULL;
   int usb_failed = 0;
+  int is_parked = 0;
+  int num_served = 0;
   while (!arg->tcp->is_closed && usb_failed == 0 && !g_options.terminate) {
     struct http_message_t *server_msg = NULL;
     struct http_message_t *client_msg = NULL;
+    struct usb_conn_t *server_usb = NULL;
+    struct cache_exchange_t xc;
+    struct ipp_cache_exchange_t ixc;
+    struct flight_t *flight = NULL;
+    int is_flight_leader = 0;
+    memset(&xc, 0, sizeof(xc));
+    memset(&ixc, 0, sizeof(ixc));
+
+    /* Read the client's next request once every earlier one is
+       answered, read-only requests pipelined behind it are forwarded
+       further down without waiting */
+    if (pipeline.count > 0)
+      goto pipelined;
+
+    /* Rather than waiting for a client which has nothing more to ask
+       for now, the connection goes back to the reactor and with it
+       the USB interface to whoever needs it */
+    if (next_msg == NULL && num_served > 0 &&
+	!tcp_conn_is_readable(arg->tcp)) {
+      NOTE("Thread #%d: Connection idle, handing it to the reactor",
+	   thread_num);
+      is_parked = 1;
+      break;
+    }
+    num_served++;
 
     /* Client's request */
-    client_msg = http_message_new();
+    client_msg = next_msg;
+    next_msg = NULL;
+    if (client_msg == NULL)
+      client_msg = http_message_new(&pool);
     if (client_msg == NULL) {
       ERR("Thread #%d: Failed to create client message", thread_num);
       break;
@@ -164,6 +625,9 @@ static void *service_connection(void *arg_void)
     NOTE("Thread #%d: M %p: Client msg starting",
 	 thread_num, client_msg);
 
+    int is_read_only = 0;
+    int is_first_pkt = 1;
+    int is_cached = 0;
     while (!client_msg->is_completed && !g_options.terminate) {
       struct http_packet_t *pkt;
       pkt = tcp_packet_get(arg->tcp, client_msg);
@@ -177,6 +641,91 @@ static void *service_connection(void *arg_void)
 	    thread_num, client_msg);
 	goto cleanup_subconn;
       }
+
+      /* Web interface assets are answered from the cache without
+	 taking a USB interface */
+      if (is_first_pkt && client_msg->is_completed &&
+	  arg->usb_sock != NULL) {
+	struct cache_entry_t *entry =
+	  cache_request(&xc, &client_msg->header);
+	if (entry != NULL) {
+	  packet_free(pkt);
+	  if (send_cache_entry(thread_num, arg->tcp, entry,
+			       xc.client_has_entry) != 0)
+	    goto cleanup_subconn;
+	  is_cached = 1;
+	  break;
+	}
+      }
+
+      /* Job queries are answered from what the printer poller saw
+	 last, event subscriptions are kept here */
+      if (is_first_pkt && arg->usb_sock != NULL) {
+	size_t size = 0;
+	uint8_t *answer = monitor_request(client_msg, pkt, &size);
+	if (answer != NULL) {
+	  packet_free(pkt);
+	  int status = tcp_send(arg->tcp, answer, size);
+	  free(answer);
+	  if (status != 0)
+	    goto cleanup_subconn;
+	  is_cached = 1;
+	  break;
+	}
+      }
+
+      /* Repeated Get-Printer-Attributes queries are answered from
+	 memory, anything changing the printer drops those answers */
+      if (is_first_pkt && arg->usb_sock != NULL) {
+	size_t size = 0;
+	uint8_t *answer = ipp_cache_request(&ixc, client_msg, pkt, &size);
+	if (answer != NULL) {
+	  packet_free(pkt);
+	  int status = tcp_send(arg->tcp, answer, size);
+	  free(answer);
+	  if (status != 0)
+	    goto cleanup_subconn;
+	  is_cached = 1;
+	  break;
+	}
+      }
+
+      /* Identical requests from other clients already on their way
+	 to the printer are waited for rather than sent again */
+      if (is_first_pkt && arg->usb_sock != NULL &&
+	  !cache_is_revalidating(&xc)) {
+	uint32_t request_id = 0;
+	flight = flight_join(client_msg, pkt, &is_flight_leader, &request_id);
+	if (flight != NULL && !is_flight_leader) {
+	  NOTE("Thread #%d: M %p: Waiting for identical request in flight",
+	       thread_num, client_msg);
+	  /* The interface from an earlier request goes back meanwhile,
+	     the leader may need it */
+	  if (usb != NULL) {
+	    pipeline_drain(thread_num, &pipeline, usb, &pool, usb_failed);
+	    NOTE("Thread #%d: Interface #%d: releasing usb conn while waiting",
+		 thread_num, usb->interface_index);
+	    usb_conn_release(usb);
+	    usb = NULL;
+	  }
+	  size_t size = 0;
+	  uint8_t *answer = NULL;
+	  if (flight_wait(flight) == 0)
+	    answer = flight_response(flight, request_id, &size);
+	  flight_release(flight);
+	  flight = NULL;
+	  if (answer != NULL) {
+	    packet_free(pkt);
+	    int status = tcp_send(arg->tcp, answer, size);
+	    free(answer);
+	    if (status != 0)
+	      goto cleanup_subconn;
+	    is_cached = 1;
+	    break;
+	  }
+	}
+      }
+
       if (usb == NULL && arg->usb_sock != NULL) {
 	usb = usb_conn_acquire(arg->usb_sock);
 	if (usb == NULL) {
@@ -195,14 +744,46 @@ static void *service_connection(void *arg_void)
       if (g_options.terminate)
 	goto cleanup_subconn;
 
+      int has_header = is_first_pkt;
+      if (is_first_pkt) {
+	is_read_only = request_is_read_only(client_msg, pkt);
+	/* The client got its 100 Continue from us, the printer must not
+	   send one more */
+	if (client_msg->is_continued &&
+	    packet_drop_header_field(pkt, "Expect") != 0)
+	  WARN("Thread #%d: M %p: Could not remove Expect field",
+	       thread_num, client_msg);
+      }
+      is_first_pkt = 0;
+
       NOTE("Thread #%d: M %p P %p: Pkt from tcp (buffer size: %d)\n===\n%s===",
 	   thread_num, client_msg, pkt,
 	   pkt->filled_size,
-	   hexdump(pkt->buffer, (int)pkt->filled_size));
+	   packet_hexdump(pkt));
       /* In no-printer mode we simply ignore passing the
 	 client message on to the printer */
       if (arg->usb_sock != NULL) {
-	if (usb_conn_packet_send(usb, pkt) != 0) {
+	struct http_packet_t *usb_pkt = pkt;
+	if (cache_is_revalidating(&xc)) {
+	  usb_pkt = revalidation_packet(&xc, client_msg);
+	  if (usb_pkt == NULL) {
+	    WARN("Thread #%d: M %p: Cannot revalidate cached response",
+		 thread_num, client_msg);
+	    cache_exchange_end(&xc);
+	    usb_pkt = pkt;
+	  }
+	}
+	int status;
+	if (client_msg->type == HTTP_CLOSE_DELIMITED)
+	  status = send_rechunked(usb, client_msg, usb_pkt, has_header);
+	else
+	  status = usb_conn_packet_send(usb, usb_pkt);
+	if (usb_pkt != pkt) {
+	  struct http_message_t *usb_msg = usb_pkt->parent_message;
+	  packet_free(usb_pkt);
+	  message_free(usb_msg);
+	}
+	if (status != 0) {
 	  ERR("Thread #%d: M %p P %p: Interface #%d: Unable to send client package via USB",
 	      thread_num,
 	      client_msg, pkt, usb->interface_index);
@@ -214,6 +795,22 @@ static void *service_connection(void *arg_void)
 	     client_msg, pkt, usb->interface_index);
       }
       packet_free(pkt);
+
+      if (has_header && g_options.printer_continue && usb != NULL &&
+	  !client_msg->is_completed &&
+	  tcp_request_expects_continue(client_msg)) {
+	client_msg->is_continued = 1;
+	if (relay_printer_continue(thread_num, arg->tcp, usb, &pool) != 0)
+	  goto cleanup_subconn;
+      }
+
+      /* The rest of a job's document bypasses packets */
+      if (client_msg->is_bulk && !client_msg->is_completed &&
+	  forward_body_bulk(thread_num, arg->tcp, usb, client_msg) != 0) {
+	ERR("Thread #%d: M %p: Unable to pass on message body",
+	    thread_num, client_msg);
+	goto cleanup_subconn;
+      }
     }
     if (usb != NULL)
       NOTE("Thread #%d: M %p: Interface #%d: Client msg completed",
@@ -222,31 +819,57 @@ static void *service_connection(void *arg_void)
     else
       NOTE("Thread #%d: M %p: Client msg completed",
 	   thread_num, client_msg);
+
+    /* Keep what the client sent beyond this request */
+    if (client_msg->spare_filled > 0) {
+      next_msg = http_message_new(&pool);
+      if (next_msg == NULL) {
+	ERR("Thread #%d: Failed to create client message", thread_num);
+	goto cleanup_subconn;
+      }
+      message_pass_spare(client_msg, next_msg);
+    }
     message_free(client_msg);
     client_msg = NULL;
 
+    if (is_cached) {
+      cache_exchange_end(&xc);
+      ipp_cache_exchange_end(&ixc);
+      continue;
+    }
+    pipeline_push(&pipeline, usb);
+    pipeline.read_only = is_read_only;
+
     if (g_options.terminate)
       goto cleanup_subconn;
 
+  pipelined:
+    if (arg->usb_sock != NULL &&
+	pipeline_forward_ahead(thread_num, arg, &pipeline, usb,
+			       &next_msg) != 0) {
+      usb_failed = 1;
+      goto cleanup_subconn;
+    }
 
     /* Server's response */
-    server_msg = http_message_new();
+    server_usb = pipeline_pop(&pipeline);
+    server_msg = http_message_new(&pool);
     if (server_msg == NULL) {
       ERR("Thread #%d: Failed to create server message",
 	  thread_num);
       goto cleanup_subconn;
     }
-    if (usb != NULL)
+    if (server_usb != NULL)
       NOTE("Thread #%d: M %p: Interface #%d: Server msg starting",
 	   thread_num, server_msg,
-	   usb->interface_index);
+	   server_usb->interface_index);
     else
       NOTE("Thread #%d: M %p: Server msg starting",
 	   thread_num, server_msg);
     while (!server_msg->is_completed && !g_options.terminate) {
       struct http_packet_t *pkt;
       if (arg->usb_sock != NULL) {
-	pkt = usb_conn_packet_get(usb, server_msg);
+	pkt = usb_conn_packet_get(server_usb, server_msg);
 	if (pkt == NULL) {
 	  usb_failed = 1;
 	  goto cleanup_subconn;
@@ -255,11 +878,17 @@ static void *service_connection(void *arg_void)
 	/* In no-printer mode we "invent" the answer
 	   of the printer, a simple HTML message as
 	   a pseudo web interface */
+	static const char page[] =
+	  "HTTP/1.1 200 OK\r\nContent-Type: text/html; name=ippusbxd.html; charset=UTF-8\r\n\r\n<html><h2>ippusbxd</h2><p>Debug/development mode without connection to IPP-over-USB printer</p></html>\r\n";
 	pkt = packet_new(server_msg);
-	snprintf((char*)(pkt->buffer),
-		 pkt->buffer_capacity - 1,
-		 "HTTP/1.1 200 OK\r\nContent-Type: text/html; name=ippusbxd.html; charset=UTF-8\r\n\r\n<html><h2>ippusbxd</h2><p>Debug/development mode without connection to IPP-over-USB printer</p></html>\r\n");
-	pkt->filled_size = 183;
+	if (pkt == NULL ||
+	    packet_append(pkt, page, sizeof(page) - 1) != 0) {
+	  ERR("Thread #%d: M %p: Failed to create pseudo answer",
+	      thread_num, server_msg);
+	  if (pkt != NULL)
+	    packet_free(pkt);
+	  goto cleanup_subconn;
+	}
 	/* End the TCP connection, so that a
 	   web browser does not wait for more data */
 	server_msg->is_completed = 1;
@@ -271,53 +900,150 @@ static void *service_connection(void *arg_void)
 
       NOTE("Thread #%d: M %p P %p: Pkt from usb (buffer size: %d)\n===\n%s===",
 	   thread_num, server_msg, pkt, pkt->filled_size,
-	   hexdump(pkt->buffer, (int)pkt->filled_size));
-      if (tcp_packet_send(arg->tcp, pkt) != 0) {
+	   packet_hexdump(pkt));
+
+      /* Interim responses go to the client as they are, the actual
+	 response follows them */
+      int code = http_header_status(&server_msg->header);
+      if (server_msg->is_completed && code >= 100 && code < 200 &&
+	  code != 101) {
+	int status = tcp_packet_send(arg->tcp, pkt);
+	packet_free(pkt);
+	if (status != 0)
+	  goto cleanup_subconn;
+	struct http_message_t *interim = server_msg;
+	server_msg = http_message_new(&pool);
+	if (server_msg == NULL) {
+	  message_free(interim);
+	  ERR("Thread #%d: Failed to create server message", thread_num);
+	  goto cleanup_subconn;
+	}
+	message_pass_spare(interim, server_msg);
+	message_free(interim);
+	continue;
+      }
+      if (flight != NULL)
+	flight_collect(flight, server_msg, pkt);
+      ipp_cache_response(&ixc, server_msg, pkt);
+      enum cache_action_t action = cache_response(&xc, server_msg, pkt);
+      if (action == CACHE_HOLD || action == CACHE_DROP) {
+	packet_free(pkt);
+	continue;
+      }
+      int status;
+      if (action == CACHE_FLUSH) {
+	size_t held_size = 0;
+	const uint8_t *held = cache_held_data(&xc, &held_size);
+	status = tcp_send(arg->tcp, held, held_size);
+      } else
+	status = tcp_packet_send(arg->tcp, pkt);
+      if (status != 0) {
 	ERR("Thread #%d: M %p P %p: Unable to send client package via TCP",
 	    thread_num,
 	    client_msg, pkt);
 	packet_free(pkt);
 	goto cleanup_subconn;
       }
-      if (usb != NULL)
+      if (server_usb != NULL)
 	NOTE("Thread #%d: M %p P %p: Interface #%d: Server pkt done",
 	     thread_num, server_msg, pkt,
-	     usb->interface_index);
+	     server_usb->interface_index);
       else
 	NOTE("Thread #%d: M %p P %p: Server pkt done",
 	     thread_num, server_msg, pkt);
       packet_free(pkt);
     }
-    if (usb != NULL)
+    if (server_usb != NULL)
       NOTE("Thread #%d: M %p: Interface #%d: Server msg completed",
 	   thread_num, server_msg,
-	   usb->interface_index);
+	   server_usb->interface_index);
     else
       NOTE("Thread #%d: M %p: Server msg completed",
 	   thread_num, server_msg);
 
+    if (flight != NULL)
+      flight_land(flight, server_msg);
+    ipp_cache_response_done(&ixc, server_msg);
+
+    /* Only closing the connection tells the client where a response
+       without length ends */
+    if (server_msg->type == HTTP_IDLE_DELIMITED) {
+      NOTE("Thread #%d: M %p: Closing connection after response without length",
+	   thread_num, server_msg);
+      arg->tcp->is_closed = 1;
+    }
+
+    /* The printer confirmed the cached response */
+    struct cache_entry_t *validated = cache_response_done(&xc, server_msg);
+    if (validated != NULL)
+      send_cache_entry(thread_num, arg->tcp, validated,
+		       xc.client_has_entry);
+
   cleanup_subconn:
+    /* Interfaces taken for pipelined requests go back once their
+       response is through */
+    if (server_usb != NULL && server_usb != usb) {
+      if (server_msg == NULL || !server_msg->is_completed) {
+	/* Response was cut off, do not hand out the interface with
+	   the rest of it pending */
+	pipeline_push(&pipeline, server_usb);
+	pipeline_drain(thread_num, &pipeline, usb, &pool, usb_failed);
+      } else {
+	NOTE("Thread #%d: Interface #%d: releasing pipelined usb conn",
+	     thread_num, server_usb->interface_index);
+	usb_conn_release(server_usb);
+      }
+    }
     if (usb != NULL && (arg->tcp->is_closed || usb_failed == 1)) {
+      pipeline_drain(thread_num, &pipeline, usb, &pool, usb_failed);
       NOTE("Thread #%d: M %p: Interface #%d: releasing usb conn",
 	   thread_num, server_msg, usb->interface_index);
       usb_conn_release(usb);
       usb = NULL;
     }
+    /* Whoever waits for a response which did not come through asks
+       the printer itself */
+    if (flight != NULL) {
+      flight_land(flight, server_msg);
+      flight_release(flight);
+    }
+    cache_exchange_end(&xc);
+    ipp_cache_exchange_end(&ixc);
     if (client_msg != NULL)
       message_free(client_msg);
     if (server_msg != NULL)
       message_free(server_msg);
   }
 
+  pipeline_drain(thread_num, &pipeline, usb, &pool, usb_failed);
+  if (usb != NULL) {
+    NOTE("Thread #%d: Interface #%d: releasing usb conn",
+	 thread_num, usb->interface_index);
+    usb_conn_release(usb);
+  }
+  if (next_msg != NULL)
+    message_free(next_msg);
+
   NOTE("Thread #%d: Closing, %s", thread_num,
        g_options.terminate ? "shutdown requested" : "communication thread terminated");
-  tcp_conn_close(arg->tcp);
-  free(arg);
-
-  /* Execute clean-up handler */
-  pthread_cleanup_pop(1);
+  NOTE("Thread #%d: Buffer pool: %lu allocations, %lu reuses, "
+       "peak %lu segments, peak %lu KiB held", thread_num, pool.allocations,
+       pool.reuses, pool.peak_segments_in_use, pool.peak_held / 1024);
+  http_pool_destroy(&pool);
+  if (is_parked)
+    reactor_park(arg->tcp);
+  else
+    tcp_conn_close(arg->tcp);
+}
 
-  pthread_exit(NULL);
+/* Runs on a worker for every connection with a request */
+static void serve_connection(struct tcp_conn_t *tcp, int num, void *context)
+{
+  struct service_thread_param arg;
+  arg.tcp = tcp;
+  arg.usb_sock = context;
+  arg.thread_num = num;
+  service_connection(&arg);
 }
 
 static void start_daemon()
@@ -339,12 +1065,15 @@ static void start_daemon()
 
   /* Capture a socket */
   uint16_t desired_port = g_options.desired_port;
-  g_options.tcp_socket = NULL;
-  g_options.tcp6_socket = NULL;
+  g_options.num_tcp_sockets = 0;
   for (;;) {
-    g_options.tcp_socket = tcp_open(desired_port, g_options.interface);
-    g_options.tcp6_socket = tcp6_open(desired_port, g_options.interface);
-    if (g_options.tcp_socket || g_options.tcp6_socket || g_options.only_desired_port)
+    int num_socks = tcp_open(desired_port, g_options.interfaces,
+			     g_options.num_interfaces, g_options.tcp_sockets,
+			     TCP_MAX_LISTENERS);
+    if (num_socks < 0)
+      goto cleanup_tcp;
+    g_options.num_tcp_sockets = num_socks;
+    if (num_socks > 0 || g_options.only_desired_port)
       break;
     /* Search for a free port */
     desired_port ++;
@@ -357,25 +1086,29 @@ static void start_daemon()
       desired_port = 49152;
     NOTE("Access to desired port failed, trying alternative port %d", desired_port);
   }
-  if (g_options.tcp_socket == NULL && g_options.tcp6_socket == NULL)
+  if (g_options.num_tcp_sockets == 0)
     goto cleanup_tcp;
 
-  if (g_options.tcp_socket)
-    g_options.real_port = tcp_port_number_get(g_options.tcp_socket);
-  else
-    g_options.real_port = tcp_port_number_get(g_options.tcp6_socket);
+  g_options.real_port = tcp_port_number_get(g_options.tcp_sockets[0]);
   if (desired_port != 0 && g_options.only_desired_port == 1 &&
       desired_port != g_options.real_port) {
     ERR("Received port number did not match requested port number."
 	" The requested port number may be too high.");
     goto cleanup_tcp;
   }
+  NOTE("Port: %d, listening on %d addresses", g_options.real_port,
+       g_options.num_tcp_sockets);
+
+  if (g_options.unix_socket != NULL) {
+    struct tcp_sock_t *sock = tcp_unix_open(g_options.unix_socket);
+    if (sock == NULL)
+      goto cleanup_tcp;
+    g_options.tcp_sockets[g_options.num_tcp_sockets++] = sock;
+  }
+
   printf("%u|", g_options.real_port);
   fflush(stdout);
 
-  NOTE("Port: %d, IPv4 %savailable, IPv6 %savailable",
-       g_options.real_port, g_options.tcp_socket ? "" : "not ", g_options.tcp6_socket ? "" : "not ");
-
   /* Lose connection to caller */
   uint16_t pid;
   if (!g_options.nofork_mode && (pid = fork()) > 0) {
@@ -384,10 +1117,11 @@ static void start_daemon()
   }
 
   /* Redirect SIGINT and SIGTERM so that we do a proper shutdown, unregistering
-     the printer from DNS-SD */
+     the printer from DNS-SD. SIGUSR1 asks for statistics. */
 #ifdef HAVE_SIGSET /* Use System V signals over POSIX to avoid bugs */
   sigset(SIGTERM, sigterm_handler);
   sigset(SIGINT, sigterm_handler);
+  sigset(SIGUSR1, sigusr1_handler);
   NOTE("Using signal handler SIGSET");
 #elif defined(HAVE_SIGACTION)
   struct sigaction action; /* Actions for POSIX signals */
@@ -400,10 +1134,15 @@ static void start_daemon()
   sigaddset(&action.sa_mask, SIGINT);
   action.sa_handler = sigterm_handler;
   sigaction(SIGINT, &action, NULL);
+  sigemptyset(&action.sa_mask);
+  sigaddset(&action.sa_mask, SIGUSR1);
+  action.sa_handler = sigusr1_handler;
+  sigaction(SIGUSR1, &action, NULL);
   NOTE("Using signal handler SIGACTION");
 #else
   signal(SIGTERM, sigterm_handler);
   signal(SIGINT, sigterm_handler);
+  signal(SIGUSR1, sigusr1_handler);
   NOTE("Using signal handler SIGNAL");
 #endif /* HAVE_SIGSET */
 
@@ -418,56 +1157,40 @@ static void start_daemon()
       goto cleanup_tcp;
   }
 
+  cache_init(g_options.cache_size);
+  ipp_cache_init(g_options.ipp_cache_ttl);
+  monitor_init(usb_sock, g_options.poll_interval);
+  if (timeouts_start() != 0)
+    goto cleanup_tcp;
+  if (reactor_init(g_options.tcp_sockets, g_options.num_tcp_sockets) != 0)
+    goto cleanup_tcp;
+
   /* Main loop */
-  int i = 0;
-  pthread_mutex_init(&thread_register_mutex, NULL);
+  if (workers_start(g_options.num_threads, g_options.thread_stack_size,
+		    serve_connection, usb_sock) != 0)
+    goto cleanup_tcp;
   while (!g_options.terminate) {
-    i ++;
-    struct service_thread_param *args = calloc(1, sizeof(*args));
-    if (args == NULL) {
-      ERR("Preparing thread #%d: Failed to alloc space for thread args",
-	  i);
-      goto cleanup_thread;
-    }
-
-    args->thread_num = i;
-    args->usb_sock = usb_sock;
-
-    /* For each request/response round we use the socket (IPv4 or
-       IPv6) which receives data first */
-    args->tcp = tcp_conn_select(g_options.tcp_socket, g_options.tcp6_socket);
-    if (g_options.terminate)
-      goto cleanup_thread;
-    if (args->tcp == NULL) {
-      ERR("Preparing thread #%d: Failed to open tcp connection", i);
-      goto cleanup_thread;
+    /* A worker serves a connection as long as the client keeps
+       sending requests, once it stops the reactor watches it */
+    struct tcp_conn_t *tcp = reactor_next();
+    if (g_options.report_stats) {
+      g_options.report_stats = 0;
+      workers_report();
+      reactor_report();
+      http_report();
+      if (tcp == NULL && !g_options.terminate)
+	continue;
     }
-
-    pthread_mutex_lock(&thread_register_mutex);
-    register_service_thread(&num_service_threads, &service_threads, args);
-    list_service_threads(num_service_threads, service_threads);
-    pthread_mutex_unlock(&thread_register_mutex);
-    int status = pthread_create(&args->thread_handle, NULL,
-				&service_connection, args);
-    if (status) {
-      ERR("Creating thread #%d: Failed to spawn thread, error %d",
-	  i, status);
-      pthread_mutex_lock(&thread_register_mutex);
-      unregister_service_thread(&num_service_threads, &service_threads, i);
-      list_service_threads(num_service_threads, service_threads);
-      pthread_mutex_unlock(&thread_register_mutex);
-      goto cleanup_thread;
+    if (g_options.terminate) {
+      if (tcp != NULL)
+	tcp_conn_close(tcp);
+      break;
     }
-
-    continue;
-
-  cleanup_thread:
-    if (args != NULL) {
-      if (args->tcp != NULL)
-	tcp_conn_close(args->tcp);
-      free(args);
+    if (tcp == NULL) {
+      ERR("Failed to open tcp connection");
+      break;
     }
-    break;
+    workers_submit(tcp);
   }
 
  cleanup_tcp:
@@ -475,26 +1198,23 @@ static void start_daemon()
   if (g_options.dnssd_data != NULL)
     dnssd_shutdown();
 
-  /* Cancel communication threads which did not terminate by themselves when
-     stopping ippusbxd, so that no USB communication with the printer can
-     happen after the final reset */
-  while (num_service_threads) {
-    NOTE("Thread #%d did not terminate, canceling it now ...",
-	 service_threads[0]->thread_num);
-    i = num_service_threads;
-    pthread_cancel(service_threads[0]->thread_handle);
-    while (i == num_service_threads)
-      usleep(1000000);
-  }
+  /* Cut off clients a worker waits for, then wait for the workers to
+     finish their connections, so that no USB communication with the
+     printer can happen after the final reset */
+  timeouts_stop();
+  workers_stop();
+
+  reactor_shutdown();
+  monitor_shutdown();
+  cache_shutdown();
+  ipp_cache_shutdown();
 
   /* Wait for USB unplug event observer thread to terminate */
   pthread_join(g_options.usb_event_thread_handle, NULL);
 
   /* TCP clean-up */
-  if (g_options.tcp_socket!= NULL)
-    tcp_close(g_options.tcp_socket);
-  if (g_options.tcp6_socket!= NULL)
-    tcp_close(g_options.tcp6_socket);
+  for (int i = 0; i < g_options.num_tcp_sockets; i++)
+    tcp_close(g_options.tcp_sockets[i]);
 
  cleanup_usb:
   /* USB clean-up and final reset of the printer */
@@ -539,17 +1259,37 @@ int main(int argc, char *argv[])
     {"no-fork",      no_argument,       0,  'n' },
     {"no-broadcast", no_argument,       0,  'B' },
     {"no-printer",   no_argument,       0,  'N' },
+    {"cache-size",   required_argument, 0,  'C' },
+    {"ipp-cache-ttl", required_argument, 0, 'T' },
+    {"printer-continue", no_argument,     0,  'E' },
+    {"response-idle", required_argument, 0, 'Y' },
+    {"poll-interval", required_argument, 0, 'I' },
+    {"spool",        required_argument, 0,  'S' },
+    {"spool-max-size", required_argument, 0, 'M' },
+    {"threads",      required_argument, 0,  'W' },
+    {"thread-stack", required_argument, 0,  'K' },
+    {"backlog",      required_argument, 0,  'L' },
+    {"unix-socket",  required_argument, 0,  'U' },
+    {"conn-buffer",  required_argument, 0,  'R' },
     {"help",         no_argument,       0,  'h' },
     {NULL,           0,                 0,  0   }
   };
   g_options.log_destination = LOGGING_STDERR;
   g_options.only_desired_port = 1;
-  g_options.interface = "lo";
   g_options.serial_num = NULL;
   g_options.vendor_id = 0;
   g_options.product_id = 0;
   g_options.bus = 0;
   g_options.device = 0;
+  g_options.cache_size = CACHE_DEFAULT_SIZE * 1024;
+  g_options.ipp_cache_ttl = IPP_CACHE_DEFAULT_TTL;
+  g_options.response_idle = USB_IDLE_TIMEOUT;
+  g_options.poll_interval = MONITOR_DEFAULT_INTERVAL;
+  g_options.spool_max_size = (size_t)SPOOL_DEFAULT_MAX_SIZE << 20;
+  g_options.num_threads = WORKERS_DEFAULT_THREADS;
+  g_options.thread_stack_size = (size_t)WORKERS_DEFAULT_STACK * 1024;
+  g_options.listen_backlog = HTTP_MAX_PENDING_CONNS;
+  g_options.conn_buffer_size = (size_t)HTTP_CONN_DEFAULT_BUFFER * 1024;
 
   while ((c = getopt_long(argc, argv, "qnhdp:P:i:s:lv:m:NB",
 			  long_options, &option_index)) != -1) {
@@ -581,8 +1321,13 @@ int main(int argc, char *argv[])
 	break;
       }
     case 'i':
-      /* Request a specific network interface */
-      g_options.interface = strdup(optarg);
+      /* Request a specific network interface, given more than once
+	 we listen on all of them */
+      if (g_options.num_interfaces == TCP_MAX_INTERFACES) {
+	ERR("At most %d interfaces can be given", TCP_MAX_INTERFACES);
+	return 1;
+      }
+      g_options.interfaces[g_options.num_interfaces++] = strdup(optarg);
       break;
     case 'l':
       g_options.log_destination = LOGGING_SYSLOG;
@@ -630,8 +1375,96 @@ int main(int argc, char *argv[])
     case 'B':
       g_options.nobroadcast = 1;
       break;
+    case 'C':
+      {
+	long size = atol(optarg);
+	if (size < 0) {
+	  ERR("Cache size must be non-negative");
+	  return 1;
+	}
+	g_options.cache_size = (size_t)size * 1024;
+	break;
+      }
+    case 'T':
+      g_options.ipp_cache_ttl = atoi(optarg);
+      if (g_options.ipp_cache_ttl < 0) {
+	ERR("IPP cache time must be non-negative");
+	return 1;
+      }
+      break;
+    case 'E':
+      g_options.printer_continue = 1;
+      break;
+    case 'Y':
+      g_options.response_idle = atoi(optarg);
+      if (g_options.response_idle < 1) {
+	ERR("Response idle time must be positive");
+	return 1;
+      }
+      break;
+    case 'I':
+      g_options.poll_interval = atoi(optarg);
+      if (g_options.poll_interval < 0) {
+	ERR("Poll interval must be non-negative");
+	return 1;
+      }
+      break;
+    case 'S':
+      g_options.spool_dir = optarg;
+      break;
+    case 'M':
+      {
+	long size = atol(optarg);
+	if (size <= 0) {
+	  ERR("Spool size must be positive");
+	  return 1;
+	}
+	g_options.spool_max_size = (size_t)size << 20;
+	break;
+      }
+    case 'W':
+      g_options.num_threads = atoi(optarg);
+      if (g_options.num_threads < 1) {
+	ERR("Number of threads must be positive");
+	return 1;
+      }
+      break;
+    case 'K':
+      {
+	long size = atol(optarg);
+	if (size < 0) {
+	  ERR("Thread stack size must be non-negative");
+	  return 1;
+	}
+	g_options.thread_stack_size = (size_t)size * 1024;
+	break;
+      }
+    case 'L':
+      g_options.listen_backlog = atoi(optarg);
+      if (g_options.listen_backlog < 1) {
+	ERR("Backlog must be positive");
+	return 1;
+      }
+      break;
+    case 'U':
+      g_options.unix_socket = strdup(optarg);
+      break;
+    case 'R':
+      {
+	long size = atol(optarg);
+	if (size < HTTP_CONN_MIN_BUFFER) {
+	  ERR("Connection buffer must be at least %d KiB",
+	      HTTP_CONN_MIN_BUFFER);
+	  return 1;
+	}
+	g_options.conn_buffer_size = (size_t)size * 1024;
+	break;
+      }
     }
   }
+  if (g_options.num_interfaces == 0)
+    g_options.interfaces[g_options.num_interfaces++] = "lo";
+  g_options.interface = g_options.interfaces[0];
 
   if (g_options.help_mode) {
     printf("Usage: %s -v <vendorid> -m <productid> -s <serial> -P <port>\n"
@@ -661,7 +1494,8 @@ int main(int argc, char *argv[])
 	   "               taken\n"
 	   "  --interface <interface>\n"
 	   "  -i <interface> Network interface to use. Default is the loopback interface\n"
-	   "               (lo, localhost).\n"
+	   "               (lo, localhost). Given more than once, all of them are\n"
+	   "               served, DNS-SD announces the printer on the first one.\n"
 	   "  --logging\n"
 	   "  -l           Redirect logging to syslog\n"
 	   "  --verbose\n"
@@ -675,7 +1509,49 @@ int main(int argc, char *argv[])
 	   "  --no-printer\n"
 	   "  -N           No-printer mode, debug/developer mode which makes ippusbxd\n"
 	   "               run without IPP-over-USB printer\n"
-	   , argv[0], argv[0], argv[0]);
+	   "  --cache-size <kbytes>\n"
+	   "               Memory for caching the printer's web interface assets,\n"
+	   "               0 disables the cache. Default is %d KiB\n"
+	   "  --ipp-cache-ttl <seconds>\n"
+	   "               Time for which Get-Printer-Attributes responses are\n"
+	   "               reused, 0 disables this. Default is %d seconds\n"
+	   "  --printer-continue\n"
+	   "               Leave answering \"Expect: 100-continue\" to the printer,\n"
+	   "               for printers which reject jobs before their data\n"
+	   "  --response-idle <milliseconds>\n"
+	   "               Silence after which a response of the printer without\n"
+	   "               length is taken as complete. Default is %d ms\n"
+	   "  --poll-interval <seconds>\n"
+	   "               Time between two polls of the printer's jobs on behalf\n"
+	   "               of all clients, 0 leaves polling and event subscriptions\n"
+	   "               to the printer. Default is %d seconds\n"
+	   "  --spool <directory>\n"
+	   "               Take in print jobs as fast as the client sends them,\n"
+	   "               into a file in this directory, best on tmpfs like\n"
+	   "               /dev/shm, while the printer gets them at its own pace\n"
+	   "  --spool-max-size <mbytes>\n"
+	   "               Most of a job held in the spool at a time, beyond it\n"
+	   "               the job goes at the printer's speed. Default is %d MiB\n"
+	   "  --threads <number>\n"
+	   "               Threads serving client requests, started up front.\n"
+	   "               Default is %d\n"
+	   "  --thread-stack <kbytes>\n"
+	   "               Stack size of these threads, 0 for the system's\n"
+	   "               default. Default is %d KiB\n"
+	   "  --backlog <number>\n"
+	   "               Connections the kernel completes before they get\n"
+	   "               accepted, capped by net.core.somaxconn. Default is %d\n"
+	   "  --unix-socket <path>\n"
+	   "               Also serve local clients on a Unix domain socket\n"
+	   "  --conn-buffer <kbytes>\n"
+	   "               Buffers one connection may hold, beyond it the side\n"
+	   "               which is ahead waits for the other one. At least %d,\n"
+	   "               default is %d KiB\n"
+	   , argv[0], argv[0], argv[0], CACHE_DEFAULT_SIZE,
+	   IPP_CACHE_DEFAULT_TTL, USB_IDLE_TIMEOUT, MONITOR_DEFAULT_INTERVAL,
+	   SPOOL_DEFAULT_MAX_SIZE, WORKERS_DEFAULT_THREADS,
+	   WORKERS_DEFAULT_STACK, HTTP_MAX_PENDING_CONNS,
+	   HTTP_CONN_MIN_BUFFER, HTTP_CONN_DEFAULT_BUFFER);
     return 0;
   }
 
@@ -0,0 +1,1314 @@
+/* Copyright (C) 2014 Daniel Dressler and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "logging.h"
+#include "options.h"
+#include "ipp.h"
+#include "monitor.h"
+#include "usb.h"
+
+/* One thread watches the printer for everybody. Print dialogs, status
+   applets and cups-browsed each poll the printer's jobs on their own
+   schedule, and subscribers to events are served from what it saw
+   rather than from a subscription of their own on the printer. */
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t wakeup;
+  pthread_t thread;
+  int is_running;
+  int is_stopping;
+  int is_woken;
+  int interval;
+  struct usb_sock_t *usb_sock;
+  time_t started;
+
+  struct monitor_view_t *views;
+  size_t num_views;
+  unsigned long round;
+
+  /* Target and Host of the latest IPP request, the printer's state is
+     queried the same way */
+  char *target;
+  char *host;
+
+  /* Only touched by the poller */
+  struct monitor_state_t state;
+
+  struct monitor_subscription_t *subscriptions;
+  size_t num_subscriptions;
+  int32_t next_subscription_id;
+
+  /* The latest events of all subscriptions, oldest first */
+  struct monitor_event_t events[MONITOR_MAX_EVENTS];
+  size_t first_event;
+  size_t num_events;
+
+  /* Statistics */
+  size_t polls;
+  size_t answers;
+  size_t notifications;
+} monitor = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .wakeup = PTHREAD_COND_INITIALIZER,
+  .next_subscription_id = 1
+};
+
+static const struct {
+  unsigned int event;
+  const char *keyword;
+} monitor_events[] = {
+  { MONITOR_EVENT_PRINTER_STATE_CHANGED, "printer-state-changed" },
+  { MONITOR_EVENT_PRINTER_STOPPED, "printer-stopped" },
+  { MONITOR_EVENT_JOB_CREATED, "job-created" },
+  { MONITOR_EVENT_JOB_COMPLETED, "job-completed" },
+  { MONITOR_EVENT_JOB_STATE_CHANGED, "job-state-changed" }
+};
+
+#define MONITOR_NUM_EVENTS (sizeof(monitor_events) / sizeof(monitor_events[0]))
+
+/* printer-state and job-state values */
+#define PRINTER_STATE_STOPPED 5
+#define JOB_STATE_CANCELED 7
+#define JOB_STATE_COMPLETED 9
+
+static const char *const printer_states[] = {
+  "idle", "processing", "stopped"
+};
+
+static const char *const job_states[] = {
+  "pending", "pending-held", "processing", "processing-stopped",
+  "canceled", "aborted", "completed"
+};
+
+static time_t monitor_now(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec;
+}
+
+static int job_state_is_final(int32_t state)
+{
+  return state >= JOB_STATE_CANCELED && state <= JOB_STATE_COMPLETED;
+}
+
+static const char *state_name(const char *const *names, size_t num_names,
+			      int32_t state)
+{
+  if (state < 3 || (size_t)(state - 3) >= num_names)
+    return "unknown";
+  return names[state - 3];
+}
+
+static struct monitor_subscription_t *monitor_subscription_find(int32_t id)
+{
+  struct monitor_subscription_t *sub;
+  for (sub = monitor.subscriptions; sub != NULL; sub = sub->next)
+    if (sub->id == id)
+      break;
+  return sub;
+}
+
+static void monitor_view_free(struct monitor_view_t *view)
+{
+  free(view->key);
+  free(view->request);
+  free(view->response);
+  free(view);
+}
+
+/* Drops queries nobody asks any more and lapsed subscriptions. Called
+   with monitor locked. */
+static void monitor_expire(time_t now)
+{
+  struct monitor_view_t **view = &monitor.views;
+  while (*view != NULL) {
+    if (now - (*view)->used > MONITOR_VIEW_IDLE) {
+      struct monitor_view_t *idle = *view;
+      *view = idle->next;
+      monitor_view_free(idle);
+      monitor.num_views--;
+    } else
+      view = &(*view)->next;
+  }
+
+  struct monitor_subscription_t **sub = &monitor.subscriptions;
+  while (*sub != NULL) {
+    if ((*sub)->expires != 0 && (*sub)->expires <= now) {
+      struct monitor_subscription_t *lapsed = *sub;
+      NOTE("Monitor: Subscription %d lapsed", lapsed->id);
+      *sub = lapsed->next;
+      free(lapsed);
+      monitor.num_subscriptions--;
+    } else
+      sub = &(*sub)->next;
+  }
+}
+
+/* Sends a request on a free interface and reads the response. Returns
+   NULL if no interface is free or the response is not a complete IPP
+   response with a Content-Length. */
+static uint8_t *monitor_exchange(const uint8_t *request, size_t request_size,
+				 size_t *size, size_t *ipp_offset)
+{
+  struct usb_conn_t *usb = usb_conn_try_acquire(monitor.usb_sock);
+  if (usb == NULL)
+    return NULL;
+
+  struct http_pool_t pool;
+  http_pool_init(&pool);
+  uint8_t *response = NULL;
+  size_t response_size = 0;
+  size_t capacity = 0;
+  int is_usable = 1;
+  struct http_message_t *msg = http_message_new(&pool);
+  if (msg == NULL || usb_conn_send(usb, request, request_size) != 0) {
+    is_usable = 0;
+    goto cleanup;
+  }
+
+  /* The response is read to its end even when it is of no use, the
+     next user of the interface must not find any of it */
+  while (!msg->is_completed && !g_options.terminate) {
+    struct http_packet_t *pkt = usb_conn_packet_get(usb, msg);
+    if (pkt == NULL) {
+      is_usable = 0;
+      break;
+    }
+    if (msg->header.raw != NULL &&
+	(http_header_status(&msg->header) != 200 ||
+	 msg->type != HTTP_CONTENT_LENGTH ||
+	 msg->claimed_size > MONITOR_MAX_RESPONSE))
+      is_usable = 0;
+    if (is_usable && response_size + pkt->filled_size > capacity) {
+      size_t grown_capacity = capacity > 0 ? capacity : 4096;
+      while (grown_capacity < response_size + pkt->filled_size)
+	grown_capacity *= 2;
+      uint8_t *grown = realloc(response, grown_capacity);
+      if (grown == NULL)
+	is_usable = 0;
+      else {
+	response = grown;
+	capacity = grown_capacity;
+      }
+    }
+    if (is_usable)
+      response_size += packet_copy(pkt, 0, response + response_size,
+				   pkt->filled_size);
+    packet_free(pkt);
+  }
+
+  ssize_t ipp_size = http_header_content_length(&msg->header);
+  if (!msg->is_completed || ipp_size < IPP_HEADER_SIZE ||
+      (size_t)ipp_size > response_size)
+    is_usable = 0;
+  else
+    *ipp_offset = response_size - (size_t)ipp_size;
+
+ cleanup:
+  if (msg != NULL)
+    message_free(msg);
+  http_pool_destroy(&pool);
+  usb_conn_release(usb);
+  if (!is_usable) {
+    free(response);
+    return NULL;
+  }
+  monitor.polls++;
+  *size = response_size;
+  return response;
+}
+
+/* Asks the printer again for every query due */
+static void monitor_poll_views(void)
+{
+  pthread_mutex_lock(&monitor.lock);
+  unsigned long round = ++monitor.round;
+  while (!monitor.is_stopping) {
+    time_t now = monitor_now();
+    struct monitor_view_t *view;
+    for (view = monitor.views; view != NULL; view = view->next)
+      if (view->polled != round &&
+	  (view->response == NULL || view->is_stale ||
+	   now - view->updated >= monitor.interval))
+	break;
+    if (view == NULL)
+      break;
+    view->polled = round;
+
+    /* The view may be gone once the response is in */
+    uint8_t *key = malloc(view->key_size);
+    uint8_t *request = malloc(view->request_size);
+    size_t key_size = view->key_size;
+    size_t request_size = view->request_size;
+    if (key == NULL || request == NULL) {
+      free(key);
+      free(request);
+      break;
+    }
+    memcpy(key, view->key, key_size);
+    memcpy(request, view->request, request_size);
+    pthread_mutex_unlock(&monitor.lock);
+
+    size_t size = 0, ipp_offset = 0;
+    uint8_t *response = monitor_exchange(request, request_size, &size,
+					 &ipp_offset);
+    free(request);
+
+    pthread_mutex_lock(&monitor.lock);
+    for (view = monitor.views; view != NULL; view = view->next)
+      if (view->key_size == key_size &&
+	  memcmp(view->key, key, key_size) == 0)
+	break;
+    free(key);
+    if (response == NULL)
+      continue;
+    if (view == NULL) {
+      free(response);
+      continue;
+    }
+    free(view->response);
+    view->response = response;
+    view->response_size = size;
+    view->ipp_offset = ipp_offset;
+    view->updated = monitor_now();
+    view->is_stale = 0;
+  }
+  pthread_mutex_unlock(&monitor.lock);
+}
+
+/* A query of the poller's own, on the printer URI clients use */
+static uint8_t *monitor_query(uint16_t op, int32_t job_id,
+			      const char *const *requested,
+			      const char *target, const char *host,
+			      size_t *size)
+{
+  char uri[1024];
+  int uri_size = snprintf(uri, sizeof(uri), "ipp://%s%s", host, target);
+  if (uri_size < 0 || (size_t)uri_size >= sizeof(uri))
+    return NULL;
+
+  struct ipp_writer_t writer;
+  ipp_writer_init(&writer, 1, 1, op, 1);
+  ipp_put_group(&writer, IPP_TAG_OPERATION);
+  ipp_put_string(&writer, IPP_TAG_CHARSET, "attributes-charset", "utf-8");
+  ipp_put_string(&writer, IPP_TAG_LANGUAGE, "attributes-natural-language",
+		 "en");
+  ipp_put_string(&writer, IPP_TAG_URI, "printer-uri", uri);
+  if (job_id != 0)
+    ipp_put_integer(&writer, IPP_TAG_INTEGER, "job-id", job_id);
+  if (op == IPP_OP_GET_JOBS)
+    ipp_put_string(&writer, IPP_TAG_KEYWORD, "which-jobs", "not-completed");
+  for (size_t i = 0; requested[i] != NULL; i++)
+    ipp_put_string(&writer, IPP_TAG_KEYWORD,
+		   i == 0 ? "requested-attributes" : NULL, requested[i]);
+  ipp_put_group(&writer, IPP_TAG_END);
+  if (writer.is_failed)
+    return NULL;
+
+  char header[1280];
+  int header_size = snprintf(header, sizeof(header),
+			     "POST %s HTTP/1.1\r\n"
+			     "Host: %s\r\n"
+			     "Content-Type: application/ipp\r\n"
+			     "Content-Length: %lu\r\n\r\n",
+			     target, host, writer.size);
+  uint8_t *request = NULL;
+  if (header_size > 0 && (size_t)header_size < sizeof(header))
+    request = malloc((size_t)header_size + writer.size);
+  if (request != NULL) {
+    memcpy(request, header, (size_t)header_size);
+    memcpy(request + header_size, writer.data, writer.size);
+    *size = (size_t)header_size + writer.size;
+  }
+  free(writer.data);
+  return request;
+}
+
+/* Keyword values joined with commas */
+static void monitor_keywords(const struct ipp_attr_t *attr, char *out,
+			     size_t out_size)
+{
+  size_t used = 0;
+  struct ipp_view_t values = attr->all, value;
+  out[0] = '\0';
+  while (ipp_attr_value_next(&values, &value)) {
+    if (used + (used > 0) + value.size >= out_size)
+      break;
+    if (used > 0)
+      out[used++] = ',';
+    used += ipp_view_copy(&value, out + used, value.size);
+    out[used] = '\0';
+  }
+}
+
+/* Runs a query of the poller's own, returns 0 with the response's IPP
+   message in *ipp */
+static int monitor_ask(uint16_t op, int32_t job_id,
+		       const char *const *requested, const char *target,
+		       const char *host, uint8_t **response,
+		       const uint8_t **ipp, size_t *ipp_size)
+{
+  size_t request_size = 0;
+  uint8_t *request = monitor_query(op, job_id, requested, target, host,
+				   &request_size);
+  if (request == NULL)
+    return -1;
+  size_t size = 0, ipp_offset = 0;
+  *response = monitor_exchange(request, request_size, &size, &ipp_offset);
+  free(request);
+  if (*response == NULL)
+    return -1;
+
+  struct ipp_reader_t reader;
+  *ipp = *response + ipp_offset;
+  *ipp_size = size - ipp_offset;
+  if (ipp_reader_init_buffer(&reader, *ipp, *ipp_size) != 0 ||
+      reader.op_status > 0xff) {
+    free(*response);
+    *response = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+/* Reads printer-state or the jobs off a response */
+static void monitor_state_parse(struct monitor_state_t *state,
+				const uint8_t *ipp, size_t ipp_size)
+{
+  struct ipp_reader_t reader;
+  struct ipp_attr_t attr;
+  struct monitor_job_t *job = NULL;
+  if (ipp_reader_init_buffer(&reader, ipp, ipp_size) != 0)
+    return;
+  for (;;) {
+    /* Every job comes in a group of its own */
+    uint8_t tag = 0;
+    if (ipp_view_copy(&reader.pos, &tag, 1) == 1 && tag == IPP_TAG_JOB) {
+      job = NULL;
+      if (state->num_jobs < MONITOR_MAX_JOBS) {
+	job = &state->jobs[state->num_jobs++];
+	memset(job, 0, sizeof(*job));
+      }
+    }
+    if (ipp_attr_next(&reader, &attr) != 1)
+      break;
+
+    if (attr.group == IPP_TAG_PRINTER) {
+      if (ipp_attr_is(&attr, "printer-state"))
+	ipp_view_integer(&attr.value, &state->printer_state);
+      else if (ipp_attr_is(&attr, "printer-state-reasons"))
+	monitor_keywords(&attr, state->printer_reasons,
+			 sizeof(state->printer_reasons));
+    } else if (attr.group == IPP_TAG_JOB && job != NULL) {
+      if (ipp_attr_is(&attr, "job-id"))
+	ipp_view_integer(&attr.value, &job->id);
+      else if (ipp_attr_is(&attr, "job-state"))
+	ipp_view_integer(&attr.value, &job->state);
+      else if (ipp_attr_is(&attr, "job-state-reasons"))
+	monitor_keywords(&attr, job->reasons, sizeof(job->reasons));
+    }
+  }
+
+  /* Groups without a job-id are of no use */
+  size_t kept = 0;
+  for (size_t i = 0; i < state->num_jobs; i++)
+    if (state->jobs[i].id > 0)
+      state->jobs[kept++] = state->jobs[i];
+  state->num_jobs = kept;
+}
+
+static const struct monitor_job_t *
+monitor_job_find(const struct monitor_state_t *state, int32_t id)
+{
+  for (size_t i = 0; i < state->num_jobs; i++)
+    if (state->jobs[i].id == id)
+      return &state->jobs[i];
+  return NULL;
+}
+
+/* Records an event for every subscription asking for it. Called with
+   monitor locked. */
+static void monitor_notify(unsigned int event,
+			   const struct monitor_state_t *state,
+			   const struct monitor_job_t *job, time_t now)
+{
+  for (struct monitor_subscription_t *sub = monitor.subscriptions;
+       sub != NULL; sub = sub->next) {
+    if ((sub->events & event) == 0 ||
+	(sub->job_id != 0 && (job == NULL || job->id != sub->job_id)))
+      continue;
+
+    if (monitor.num_events == MONITOR_MAX_EVENTS) {
+      monitor.first_event = (monitor.first_event + 1) % MONITOR_MAX_EVENTS;
+      monitor.num_events--;
+    }
+    struct monitor_event_t *e =
+      &monitor.events[(monitor.first_event + monitor.num_events++) %
+		      MONITOR_MAX_EVENTS];
+    memset(e, 0, sizeof(*e));
+    e->subscription_id = sub->id;
+    e->sequence = ++sub->sequence;
+    e->event = event;
+    e->time = now;
+    e->printer_state = state->printer_state;
+    memcpy(e->printer_reasons, state->printer_reasons,
+	   sizeof(e->printer_reasons));
+    if (job != NULL) {
+      e->job_id = job->id;
+      e->job_state = job->state;
+      memcpy(e->job_reasons, job->reasons, sizeof(e->job_reasons));
+    }
+    monitor.notifications++;
+
+    /* The subscriber gets a while to pick up the last event */
+    if (event == MONITOR_EVENT_JOB_COMPLETED && sub->job_id != 0)
+      sub->expires = now + MONITOR_JOB_LINGER;
+  }
+}
+
+/* Compares the poll with the one before. Called with monitor locked. */
+static void monitor_compare(const struct monitor_state_t *last,
+			    const struct monitor_state_t *state)
+{
+  time_t now = monitor_now();
+  if (state->printer_state != last->printer_state ||
+      strcmp(state->printer_reasons, last->printer_reasons) != 0) {
+    NOTE("Monitor: Printer is %s (%s)",
+	 state_name(printer_states, 3, state->printer_state),
+	 state->printer_reasons);
+    monitor_notify(MONITOR_EVENT_PRINTER_STATE_CHANGED, state, NULL, now);
+    if (state->printer_state == PRINTER_STATE_STOPPED)
+      monitor_notify(MONITOR_EVENT_PRINTER_STOPPED, state, NULL, now);
+  }
+
+  for (size_t i = 0; i < state->num_jobs; i++) {
+    const struct monitor_job_t *job = &state->jobs[i];
+    const struct monitor_job_t *was = monitor_job_find(last, job->id);
+    if (was == NULL)
+      monitor_notify(MONITOR_EVENT_JOB_CREATED, state, job, now);
+    else if (was->state != job->state ||
+	     strcmp(was->reasons, job->reasons) != 0)
+      monitor_notify(MONITOR_EVENT_JOB_STATE_CHANGED, state, job, now);
+    else
+      continue;
+    NOTE("Monitor: Job %d is %s", job->id,
+	 state_name(job_states, 7, job->state));
+    if (job_state_is_final(job->state) &&
+	(was == NULL || !job_state_is_final(was->state)))
+      monitor_notify(MONITOR_EVENT_JOB_COMPLETED, state, job, now);
+  }
+}
+
+/* Polls printer and job state while anyone is subscribed to events */
+static void monitor_poll_state(void)
+{
+  static const char *const printer_requested[] = {
+    "printer-state", "printer-state-reasons", NULL
+  };
+  static const char *const job_requested[] = {
+    "job-id", "job-state", "job-state-reasons", NULL
+  };
+
+  char *target = NULL, *host = NULL;
+  pthread_mutex_lock(&monitor.lock);
+  {
+    if (monitor.num_subscriptions == 0)
+      monitor.state.is_valid = 0;
+    else if (monitor.target != NULL && monitor.host != NULL) {
+      target = strdup(monitor.target);
+      host = strdup(monitor.host);
+    }
+  }
+  pthread_mutex_unlock(&monitor.lock);
+  if (target == NULL || host == NULL)
+    goto cleanup;
+
+  struct monitor_state_t *state = calloc(1, sizeof(*state));
+  if (state == NULL)
+    goto cleanup;
+  uint8_t *response = NULL;
+  const uint8_t *ipp = NULL;
+  size_t ipp_size = 0;
+  if (monitor_ask(IPP_OP_GET_PRINTER_ATTRIBUTES, 0, printer_requested,
+		  target, host, &response, &ipp, &ipp_size) != 0)
+    goto cleanup_state;
+  monitor_state_parse(state, ipp, ipp_size);
+  free(response);
+  if (monitor_ask(IPP_OP_GET_JOBS, 0, job_requested, target, host,
+		  &response, &ipp, &ipp_size) != 0)
+    goto cleanup_state;
+  monitor_state_parse(state, ipp, ipp_size);
+  free(response);
+
+  /* Jobs which left the list of active ones have ended, the printer
+     tells how */
+  const struct monitor_state_t *last = &monitor.state;
+  for (size_t i = 0; last->is_valid && i < last->num_jobs; i++) {
+    const struct monitor_job_t *was = &last->jobs[i];
+    if (job_state_is_final(was->state) ||
+	monitor_job_find(state, was->id) != NULL ||
+	state->num_jobs >= MONITOR_MAX_JOBS)
+      continue;
+    struct monitor_job_t *job = &state->jobs[state->num_jobs++];
+    memset(job, 0, sizeof(*job));
+    job->id = was->id;
+    job->state = JOB_STATE_COMPLETED;
+    if (monitor_ask(IPP_OP_GET_JOB_ATTRIBUTES, was->id, job_requested,
+		    target, host, &response, &ipp, &ipp_size) == 0) {
+      struct monitor_state_t *ended = calloc(1, sizeof(*ended));
+      if (ended != NULL) {
+	monitor_state_parse(ended, ipp, ipp_size);
+	const struct monitor_job_t *final = monitor_job_find(ended, was->id);
+	if (final != NULL && job_state_is_final(final->state))
+	  *job = *final;
+	free(ended);
+      }
+      free(response);
+    }
+  }
+
+  state->is_valid = 1;
+  pthread_mutex_lock(&monitor.lock);
+  {
+    if (monitor.state.is_valid)
+      monitor_compare(&monitor.state, state);
+    monitor.state = *state;
+  }
+  pthread_mutex_unlock(&monitor.lock);
+
+ cleanup_state:
+  free(state);
+ cleanup:
+  free(target);
+  free(host);
+}
+
+static void *monitor_poll(void *arg)
+{
+  (void)arg;
+  NOTE("Monitor: Polling the printer every %d seconds", monitor.interval);
+  pthread_mutex_lock(&monitor.lock);
+  while (!monitor.is_stopping && !g_options.terminate) {
+    if (!monitor.is_woken) {
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += monitor.interval;
+      pthread_cond_timedwait(&monitor.wakeup, &monitor.lock, &deadline);
+    }
+    monitor.is_woken = 0;
+    if (monitor.is_stopping || g_options.terminate)
+      break;
+    monitor_expire(monitor_now());
+    pthread_mutex_unlock(&monitor.lock);
+
+    monitor_poll_views();
+    monitor_poll_state();
+
+    pthread_mutex_lock(&monitor.lock);
+  }
+  pthread_mutex_unlock(&monitor.lock);
+  return NULL;
+}
+
+/* Called with monitor locked */
+static void monitor_wake(void)
+{
+  monitor.is_woken = 1;
+  pthread_cond_signal(&monitor.wakeup);
+}
+
+void monitor_init(struct usb_sock_t *usb_sock, int interval)
+{
+  if (usb_sock == NULL || interval <= 0)
+    return;
+  monitor.usb_sock = usb_sock;
+  monitor.interval = interval;
+  monitor.started = monitor_now();
+  monitor.is_stopping = 0;
+  if (pthread_create(&monitor.thread, NULL, monitor_poll, NULL) != 0) {
+    ERR("Monitor: Failed to start the poller, clients poll the printer themselves");
+    return;
+  }
+  monitor.is_running = 1;
+}
+
+void monitor_shutdown(void)
+{
+  if (!monitor.is_running)
+    return;
+  pthread_mutex_lock(&monitor.lock);
+  {
+    monitor.is_stopping = 1;
+    pthread_cond_signal(&monitor.wakeup);
+  }
+  pthread_mutex_unlock(&monitor.lock);
+  pthread_join(monitor.thread, NULL);
+  monitor.is_running = 0;
+
+  NOTE("Monitor: %lu polls, %lu answers to clients, %lu notifications",
+       monitor.polls, monitor.answers, monitor.notifications);
+  while (monitor.views != NULL) {
+    struct monitor_view_t *view = monitor.views;
+    monitor.views = view->next;
+    monitor_view_free(view);
+  }
+  monitor.num_views = 0;
+  while (monitor.subscriptions != NULL) {
+    struct monitor_subscription_t *sub = monitor.subscriptions;
+    monitor.subscriptions = sub->next;
+    free(sub);
+  }
+  monitor.num_subscriptions = 0;
+  free(monitor.target);
+  free(monitor.host);
+  monitor.target = NULL;
+  monitor.host = NULL;
+}
+
+/* Starts reading an IPP request which came in completely, returns the
+   size of its IPP message or -1 if it has no header to read */
+static ssize_t monitor_parse(const struct http_message_t *msg,
+			     const struct http_packet_t *pkt,
+			     struct ipp_reader_t *reader)
+{
+  ssize_t body_size = http_header_content_length(&msg->header);
+  if (!msg->is_completed || msg->type != HTTP_CONTENT_LENGTH ||
+      body_size < IPP_HEADER_SIZE || (size_t)body_size > pkt->filled_size ||
+      ipp_reader_init(reader, pkt,
+		      pkt->filled_size - (size_t)body_size) != 0)
+    return -1;
+  return body_size;
+}
+
+static int request_integer(struct ipp_reader_t *request, uint8_t group,
+			   const char *name, int32_t *value)
+{
+  struct ipp_attr_t attr;
+  if (!ipp_attr_find(request, group, name, &attr) ||
+      attr.tag != IPP_TAG_INTEGER)
+    return -1;
+  return ipp_view_integer(&attr.value, value);
+}
+
+/* Starts a response with the operation attributes all of them have */
+static void monitor_response_start(struct ipp_writer_t *writer,
+				   struct ipp_reader_t *request,
+				   uint16_t status)
+{
+  ipp_writer_init(writer, request->version_major, request->version_minor,
+		  status, request->request_id);
+  ipp_put_group(writer, IPP_TAG_OPERATION);
+  ipp_put_string(writer, IPP_TAG_CHARSET, "attributes-charset", "utf-8");
+  ipp_put_string(writer, IPP_TAG_LANGUAGE, "attributes-natural-language",
+		 "en");
+}
+
+static uint8_t *monitor_response_end(struct ipp_writer_t *writer,
+				     size_t *size)
+{
+  ipp_put_group(writer, IPP_TAG_END);
+  if (writer->is_failed) {
+    free(writer->data);
+    return NULL;
+  }
+
+  char header[128];
+  int header_size = snprintf(header, sizeof(header),
+			     "HTTP/1.1 200 OK\r\n"
+			     "Content-Type: application/ipp\r\n"
+			     "Content-Length: %lu\r\n\r\n", writer->size);
+  uint8_t *response = NULL;
+  if (header_size > 0 && (size_t)header_size < sizeof(header))
+    response = malloc((size_t)header_size + writer->size);
+  if (response != NULL) {
+    memcpy(response, header, (size_t)header_size);
+    memcpy(response + header_size, writer->data, writer->size);
+    *size = (size_t)header_size + writer->size;
+  }
+  free(writer->data);
+  return response;
+}
+
+static uint8_t *monitor_status_response(struct ipp_reader_t *request,
+					uint16_t status, size_t *size)
+{
+  struct ipp_writer_t writer;
+  monitor_response_start(&writer, request, status);
+  return monitor_response_end(&writer, size);
+}
+
+static void monitor_put_keywords(struct ipp_writer_t *writer,
+				 const char *name, const char *keywords)
+{
+  if (keywords[0] == '\0') {
+    ipp_put_string(writer, IPP_TAG_KEYWORD, name, "none");
+    return;
+  }
+  const char *keyword = keywords;
+  for (;;) {
+    const char *end = strchr(keyword, ',');
+    size_t size = end != NULL ? (size_t)(end - keyword) : strlen(keyword);
+    ipp_put_attr(writer, IPP_TAG_KEYWORD, keyword == keywords ? name : NULL,
+		 keyword, size);
+    if (end == NULL)
+      break;
+    keyword = end + 1;
+  }
+}
+
+static void monitor_put_subscription(struct ipp_writer_t *writer,
+				     const struct monitor_subscription_t *sub,
+				     time_t now)
+{
+  ipp_put_group(writer, IPP_TAG_SUBSCRIPTION);
+  ipp_put_integer(writer, IPP_TAG_INTEGER, "notify-subscription-id",
+		  sub->id);
+  ipp_put_string(writer, IPP_TAG_KEYWORD, "notify-pull-method", "ippget");
+  const char *name = "notify-events";
+  for (size_t i = 0; i < MONITOR_NUM_EVENTS; i++)
+    if (sub->events & monitor_events[i].event) {
+      ipp_put_string(writer, IPP_TAG_KEYWORD, name,
+		     monitor_events[i].keyword);
+      name = NULL;
+    }
+  if (sub->job_id != 0)
+    ipp_put_integer(writer, IPP_TAG_INTEGER, "notify-job-id", sub->job_id);
+  else
+    ipp_put_integer(writer, IPP_TAG_INTEGER, "notify-lease-duration",
+		    sub->expires != 0 ? (int32_t)(sub->expires - now) : 0);
+  if (sub->user_name[0] != '\0')
+    ipp_put_string(writer, IPP_TAG_NAME, "notify-subscriber-user-name",
+		   sub->user_name);
+  if (sub->user_data_size > 0)
+    ipp_put_attr(writer, IPP_TAG_OCTETSTRING, "notify-user-data",
+		 sub->user_data, sub->user_data_size);
+}
+
+/* Create-Printer-Subscriptions and Create-Job-Subscriptions. Only the
+   first subscription template of a request is looked at. Called with
+   monitor locked. */
+static uint8_t *monitor_subscribe(struct ipp_reader_t *request,
+				  size_t *size)
+{
+  int32_t job_id = 0;
+  if (request->op_status == IPP_OP_CREATE_JOB_SUBSCRIPTIONS &&
+      (request_integer(request, IPP_TAG_OPERATION, "notify-job-id",
+		      &job_id) != 0 || job_id <= 0))
+    return monitor_status_response(request, IPP_STATUS_BAD_REQUEST, size);
+
+  struct ipp_attr_t attr;
+  int has_pull = ipp_attr_find(request, IPP_TAG_SUBSCRIPTION,
+			       "notify-pull-method", &attr);
+  int is_ippget = has_pull && ipp_view_is(&attr.value, "ippget");
+  int has_recipient = ipp_attr_find(request, IPP_TAG_SUBSCRIPTION,
+				    "notify-recipient-uri", &attr);
+  if (!has_pull && !has_recipient)
+    return monitor_status_response(request, IPP_STATUS_BAD_REQUEST, size);
+
+  /* Events are only handed out on request, there is no pushing them */
+  uint16_t sub_status = IPP_STATUS_OK;
+  if (has_recipient || !is_ippget)
+    sub_status = IPP_STATUS_ATTRIBUTES_NOT_SUPPORTED;
+
+  unsigned int events = 0;
+  if (ipp_attr_find(request, IPP_TAG_SUBSCRIPTION, "notify-events", &attr)) {
+    struct ipp_view_t values = attr.all, value;
+    while (ipp_attr_value_next(&values, &value))
+      for (size_t i = 0; i < MONITOR_NUM_EVENTS; i++)
+	if (ipp_view_is(&value, monitor_events[i].keyword))
+	  events |= monitor_events[i].event;
+    if (events == 0)
+      sub_status = IPP_STATUS_ATTRIBUTES_NOT_SUPPORTED;
+  } else
+    events = job_id != 0 ? MONITOR_EVENT_JOB_COMPLETED :
+      MONITOR_EVENT_PRINTER_STATE_CHANGED;
+
+  if (sub_status == IPP_STATUS_OK &&
+      monitor.num_subscriptions >= MONITOR_MAX_SUBSCRIPTIONS)
+    return monitor_status_response(request,
+				   IPP_STATUS_TOO_MANY_SUBSCRIPTIONS, size);
+
+  struct monitor_subscription_t *sub = NULL;
+  if (sub_status == IPP_STATUS_OK) {
+    sub = calloc(1, sizeof(*sub));
+    if (sub == NULL)
+      return NULL;
+    time_t now = monitor_now();
+    int32_t lease = MONITOR_DEFAULT_LEASE;
+    if (request_integer(request, IPP_TAG_SUBSCRIPTION,
+		       "notify-lease-duration", &lease) != 0 || lease < 0)
+      lease = MONITOR_DEFAULT_LEASE;
+    sub->id = monitor.next_subscription_id++;
+    sub->job_id = job_id;
+    sub->events = events;
+    /* Job subscriptions end with their job, the lease only guards
+       against jobs never seen */
+    sub->lease = job_id != 0 ? 0 : lease;
+    sub->expires = job_id != 0 ? now + MONITOR_DEFAULT_LEASE :
+      lease > 0 ? now + lease : 0;
+
+    if (ipp_attr_find(request, IPP_TAG_OPERATION, "requesting-user-name",
+		      &attr) && attr.value.size < sizeof(sub->user_name))
+      ipp_view_copy(&attr.value, sub->user_name, attr.value.size);
+    if (ipp_attr_find(request, IPP_TAG_SUBSCRIPTION, "notify-user-data",
+		      &attr) && attr.value.size <= sizeof(sub->user_data))
+      sub->user_data_size = ipp_view_copy(&attr.value, sub->user_data,
+					  attr.value.size);
+
+    sub->next = monitor.subscriptions;
+    monitor.subscriptions = sub;
+    monitor.num_subscriptions++;
+    NOTE("Monitor: Subscription %d created%s", sub->id,
+	 job_id != 0 ? " for a job" : "");
+
+    /* The state right now is what later events are measured against */
+    monitor_wake();
+  }
+
+  struct ipp_writer_t writer;
+  monitor_response_start(&writer, request, sub != NULL ? IPP_STATUS_OK :
+			 IPP_STATUS_IGNORED_ALL_SUBSCRIPTIONS);
+  ipp_put_group(&writer, IPP_TAG_SUBSCRIPTION);
+  if (sub != NULL) {
+    ipp_put_integer(&writer, IPP_TAG_INTEGER, "notify-subscription-id",
+		    sub->id);
+    if (sub->job_id == 0)
+      ipp_put_integer(&writer, IPP_TAG_INTEGER, "notify-lease-duration",
+		      sub->lease);
+  } else
+    ipp_put_integer(&writer, IPP_TAG_ENUM, "notify-status-code", sub_status);
+  return monitor_response_end(&writer, size);
+}
+
+static void monitor_put_event(struct ipp_writer_t *writer,
+			      const struct monitor_event_t *e,
+			      const struct monitor_subscription_t *sub)
+{
+  const char *keyword = "";
+  for (size_t i = 0; i < MONITOR_NUM_EVENTS; i++)
+    if (e->event == monitor_events[i].event)
+      keyword = monitor_events[i].keyword;
+
+  char text[128];
+  if (e->job_id != 0)
+    snprintf(text, sizeof(text), "Job %d is %s", e->job_id,
+	     state_name(job_states, 7, e->job_state));
+  else
+    snprintf(text, sizeof(text), "Printer is %s",
+	     state_name(printer_states, 3, e->printer_state));
+  char uri[1024];
+  snprintf(uri, sizeof(uri), "ipp://%s%s",
+	   monitor.host != NULL ? monitor.host : "localhost",
+	   monitor.target != NULL ? monitor.target : "/ipp/print");
+
+  ipp_put_group(writer, IPP_TAG_EVENT_NOTIFICATION);
+  ipp_put_integer(writer, IPP_TAG_INTEGER, "notify-subscription-id",
+		  e->subscription_id);
+  ipp_put_integer(writer, IPP_TAG_INTEGER, "notify-sequence-number",
+		  e->sequence);
+  ipp_put_string(writer, IPP_TAG_KEYWORD, "notify-subscribed-event",
+		 keyword);
+  ipp_put_string(writer, IPP_TAG_TEXT, "notify-text", text);
+  ipp_put_string(writer, IPP_TAG_CHARSET, "notify-charset", "utf-8");
+  ipp_put_string(writer, IPP_TAG_LANGUAGE, "notify-natural-language", "en");
+  ipp_put_string(writer, IPP_TAG_URI, "notify-printer-uri", uri);
+  ipp_put_integer(writer, IPP_TAG_INTEGER, "printer-up-time",
+		  (int32_t)(e->time - monitor.started));
+  if (sub->user_data_size > 0)
+    ipp_put_attr(writer, IPP_TAG_OCTETSTRING, "notify-user-data",
+		 sub->user_data, sub->user_data_size);
+  if (e->job_id != 0) {
+    ipp_put_integer(writer, IPP_TAG_INTEGER, "notify-job-id", e->job_id);
+    ipp_put_integer(writer, IPP_TAG_ENUM, "job-state", e->job_state);
+    monitor_put_keywords(writer, "job-state-reasons", e->job_reasons);
+  } else {
+    ipp_put_integer(writer, IPP_TAG_ENUM, "printer-state", e->printer_state);
+    monitor_put_keywords(writer, "printer-state-reasons",
+			 e->printer_reasons);
+  }
+}
+
+/* Get-Notifications, which never waits: notify-get-interval tells
+   when there may be more. Called with monitor locked. */
+static uint8_t *monitor_notifications(struct ipp_reader_t *request,
+				      size_t *size)
+{
+  struct ipp_attr_t ids, sequences;
+  if (!ipp_attr_find(request, IPP_TAG_OPERATION, "notify-subscription-ids",
+		     &ids) || ids.tag != IPP_TAG_INTEGER)
+    return monitor_status_response(request, IPP_STATUS_BAD_REQUEST, size);
+  struct ipp_view_t sequence_values;
+  sequence_values.size = 0;
+  if (ipp_attr_find(request, IPP_TAG_OPERATION, "notify-sequence-numbers",
+		    &sequences))
+    sequence_values = sequences.all;
+
+  struct ipp_view_t values = ids.all, value;
+  int32_t id = 0;
+  while (ipp_attr_value_next(&values, &value))
+    if (ipp_view_integer(&value, &id) != 0 ||
+	monitor_subscription_find(id) == NULL)
+      return monitor_status_response(request, IPP_STATUS_NOT_FOUND, size);
+
+  time_t now = monitor_now();
+  struct ipp_writer_t writer;
+  monitor_response_start(&writer, request, IPP_STATUS_OK);
+  ipp_put_integer(&writer, IPP_TAG_INTEGER, "notify-get-interval",
+		  monitor.interval);
+  ipp_put_integer(&writer, IPP_TAG_INTEGER, "printer-up-time",
+		  (int32_t)(now - monitor.started));
+
+  values = ids.all;
+  while (ipp_attr_value_next(&values, &value)) {
+    ipp_view_integer(&value, &id);
+    const struct monitor_subscription_t *sub = monitor_subscription_find(id);
+    int32_t sequence = 1;
+    struct ipp_view_t sequence_value;
+    if (ipp_attr_value_next(&sequence_values, &sequence_value) &&
+	ipp_view_integer(&sequence_value, &sequence) != 0)
+      sequence = 1;
+
+    for (size_t i = 0; i < monitor.num_events; i++) {
+      const struct monitor_event_t *e =
+	&monitor.events[(monitor.first_event + i) % MONITOR_MAX_EVENTS];
+      if (e->subscription_id == sub->id && e->sequence >= sequence)
+	monitor_put_event(&writer, e, sub);
+    }
+  }
+  return monitor_response_end(&writer, size);
+}
+
+/* Get-Subscription-Attributes, Get-Subscriptions, Renew-Subscription
+   and Cancel-Subscription. Called with monitor locked. */
+static uint8_t *monitor_subscription_op(struct ipp_reader_t *request,
+					size_t *size)
+{
+  time_t now = monitor_now();
+  struct ipp_writer_t writer;
+  uint16_t op = request->op_status;
+  if (op == IPP_OP_GET_SUBSCRIPTIONS) {
+    int32_t job_id = 0;
+    request_integer(request, IPP_TAG_OPERATION, "notify-job-id", &job_id);
+    monitor_response_start(&writer, request, IPP_STATUS_OK);
+    for (const struct monitor_subscription_t *sub = monitor.subscriptions;
+	 sub != NULL; sub = sub->next)
+      if (sub->job_id == job_id)
+	monitor_put_subscription(&writer, sub, now);
+    return monitor_response_end(&writer, size);
+  }
+
+  int32_t id = 0;
+  if (request_integer(request, IPP_TAG_OPERATION, "notify-subscription-id",
+		     &id) != 0)
+    return monitor_status_response(request, IPP_STATUS_BAD_REQUEST, size);
+  struct monitor_subscription_t *sub = monitor_subscription_find(id);
+  if (sub == NULL)
+    return monitor_status_response(request, IPP_STATUS_NOT_FOUND, size);
+
+  switch (op) {
+  case IPP_OP_GET_SUBSCRIPTION_ATTRIBUTES:
+    monitor_response_start(&writer, request, IPP_STATUS_OK);
+    monitor_put_subscription(&writer, sub, now);
+    return monitor_response_end(&writer, size);
+  case IPP_OP_RENEW_SUBSCRIPTION:
+    {
+      if (sub->job_id != 0)
+	return monitor_status_response(request, IPP_STATUS_NOT_POSSIBLE,
+				       size);
+      int32_t lease = MONITOR_DEFAULT_LEASE;
+      if (request_integer(request, IPP_TAG_OPERATION,
+			 "notify-lease-duration", &lease) != 0 || lease < 0)
+	lease = MONITOR_DEFAULT_LEASE;
+      sub->lease = lease;
+      sub->expires = lease > 0 ? now + lease : 0;
+      monitor_response_start(&writer, request, IPP_STATUS_OK);
+      ipp_put_group(&writer, IPP_TAG_SUBSCRIPTION);
+      ipp_put_integer(&writer, IPP_TAG_INTEGER, "notify-lease-duration",
+		      lease);
+      return monitor_response_end(&writer, size);
+    }
+  default:
+    for (struct monitor_subscription_t **link = &monitor.subscriptions;
+	 *link != NULL; link = &(*link)->next)
+      if (*link == sub) {
+	*link = sub->next;
+	break;
+      }
+    NOTE("Monitor: Subscription %d canceled", sub->id);
+    free(sub);
+    monitor.num_subscriptions--;
+    return monitor_status_response(request, IPP_STATUS_OK, size);
+  }
+}
+
+static int monitor_op_is_subscription(uint16_t op)
+{
+  return op >= IPP_OP_CREATE_PRINTER_SUBSCRIPTIONS &&
+    op <= IPP_OP_GET_NOTIFICATIONS;
+}
+
+/* The printer is being changed, what it reported on its jobs may not
+   hold any more. The next poll asks again. */
+static void monitor_changed(void)
+{
+  pthread_mutex_lock(&monitor.lock);
+  {
+    for (struct monitor_view_t *view = monitor.views; view != NULL;
+	 view = view->next)
+      view->is_stale = 1;
+  }
+  pthread_mutex_unlock(&monitor.lock);
+}
+
+/* What makes job queries identical: target, Host and the IPP request
+   but its request-id */
+static uint8_t *monitor_view_key(const struct http_message_t *msg,
+				 const struct http_packet_t *pkt,
+				 size_t body_size, size_t *key_size)
+{
+  size_t target_size = 0, host_size = 0;
+  const char *target = http_header_start_token(&msg->header, 1,
+					       &target_size);
+  const char *host = http_header_get(&msg->header, "Host", &host_size);
+  if (target == NULL || host == NULL ||
+      http_header_get(&msg->header, "Authorization", NULL) != NULL)
+    return NULL;
+
+  *key_size = target_size + 1 + host_size + 1 + body_size;
+  uint8_t *key = malloc(*key_size);
+  if (key == NULL)
+    return NULL;
+  memcpy(key, target, target_size);
+  key[target_size] = '\0';
+  memcpy(key + target_size + 1, host, host_size);
+  key[target_size + 1 + host_size] = '\0';
+  uint8_t *ipp = key + target_size + 1 + host_size + 1;
+  packet_copy(pkt, pkt->filled_size - body_size, ipp, body_size);
+  memset(ipp + 4, 0, 4);
+  return key;
+}
+
+static struct monitor_view_t *monitor_view_find(const uint8_t *key,
+						size_t key_size)
+{
+  struct monitor_view_t *view;
+  for (view = monitor.views; view != NULL; view = view->next)
+    if (view->key_size == key_size && memcmp(view->key, key, key_size) == 0)
+      break;
+  return view;
+}
+
+/* Called with monitor locked */
+static struct monitor_view_t *monitor_view_new(const struct http_message_t *msg,
+					       const struct http_packet_t *pkt,
+					       size_t body_size, uint8_t *key,
+					       size_t key_size)
+{
+  static const char *const dropped[] = { "Expect", NULL };
+  struct monitor_view_t *view = calloc(1, sizeof(*view));
+  if (view == NULL)
+    return NULL;
+
+  /* Every field may grow by the space after its colon */
+  size_t capacity = pkt->filled_size + 2 * msg->header.num_fields + 2;
+  view->request = malloc(capacity);
+  size_t header_size = 0;
+  if (view->request != NULL)
+    header_size = http_header_rewrite(&msg->header, dropped, NULL,
+				      view->request, capacity - body_size);
+  if (header_size == 0) {
+    free(view->request);
+    free(view);
+    return NULL;
+  }
+  view->request_size = header_size +
+    packet_copy(pkt, pkt->filled_size - body_size,
+		view->request + header_size, body_size);
+  view->key = key;
+  view->key_size = key_size;
+  view->used = monitor_now();
+  view->next = monitor.views;
+  monitor.views = view;
+  monitor.num_views++;
+  return view;
+}
+
+static int monitor_view_is_fresh(const struct monitor_view_t *view,
+				 time_t now)
+{
+  return view->response != NULL && !view->is_stale &&
+    now - view->updated <= 2 * monitor.interval;
+}
+
+/* Answers a job query from the last poll. A query not seen before is
+   polled from now on. */
+static uint8_t *monitor_view_request(const struct http_message_t *msg,
+				     const struct http_packet_t *pkt,
+				     size_t body_size, uint32_t request_id,
+				     size_t *size)
+{
+  size_t key_size = 0;
+  uint8_t *key = monitor_view_key(msg, pkt, body_size, &key_size);
+  if (key == NULL)
+    return NULL;
+
+  uint8_t *response = NULL;
+  pthread_mutex_lock(&monitor.lock);
+  {
+    time_t now = monitor_now();
+    struct monitor_view_t *view = monitor_view_find(key, key_size);
+    if (view == NULL) {
+      if (monitor.num_views < MONITOR_MAX_VIEWS &&
+	  monitor_view_new(msg, pkt, body_size, key, key_size) != NULL) {
+	key = NULL;
+	monitor_wake();
+      }
+      goto unlock;
+    }
+    view->used = now;
+    if (!monitor_view_is_fresh(view, now))
+      goto unlock;
+
+    response = malloc(view->response_size);
+    if (response == NULL)
+      goto unlock;
+    memcpy(response, view->response, view->response_size);
+    uint8_t *ipp = response + view->ipp_offset;
+    ipp[4] = (uint8_t)(request_id >> 24);
+    ipp[5] = (uint8_t)(request_id >> 16);
+    ipp[6] = (uint8_t)(request_id >> 8);
+    ipp[7] = (uint8_t)request_id;
+    *size = view->response_size;
+    monitor.answers++;
+  }
+ unlock:
+  pthread_mutex_unlock(&monitor.lock);
+  free(key);
+  return response;
+}
+
+/* Remembers where clients find the printer, the poller asks it there */
+static void monitor_remember_printer(const struct http_header_index_t *header)
+{
+  size_t target_size = 0, host_size = 0;
+  const char *target = http_header_start_token(header, 1, &target_size);
+  const char *host = http_header_get(header, "Host", &host_size);
+  if (target == NULL || host == NULL)
+    return;
+  if (monitor.target != NULL && monitor.host != NULL &&
+      strlen(monitor.target) == target_size &&
+      strlen(monitor.host) == host_size &&
+      memcmp(monitor.target, target, target_size) == 0 &&
+      memcmp(monitor.host, host, host_size) == 0)
+    return;
+  char *target_copy = strndup(target, target_size);
+  char *host_copy = strndup(host, host_size);
+  if (target_copy == NULL || host_copy == NULL) {
+    free(target_copy);
+    free(host_copy);
+    return;
+  }
+  free(monitor.target);
+  free(monitor.host);
+  monitor.target = target_copy;
+  monitor.host = host_copy;
+}
+
+uint8_t *monitor_request(const struct http_message_t *msg,
+			 const struct http_packet_t *pkt, size_t *size)
+{
+  if (!monitor.is_running ||
+      !http_header_method_is(&msg->header, "POST") ||
+      !http_header_has_token(&msg->header, "Content-Type",
+			     "application/ipp"))
+    return NULL;
+
+  struct ipp_reader_t reader;
+  ssize_t body_size = monitor_parse(msg, pkt, &reader);
+  if (body_size < 0) {
+    /* A body still on its way is a document, queries come at once. One
+       which is in without an operation-id changes nothing. */
+    if (!msg->is_completed)
+      monitor_changed();
+    return NULL;
+  }
+
+  uint16_t op = reader.op_status;
+  int is_valid = ipp_reader_check(&reader) == 0;
+  if (is_valid &&
+      (op == IPP_OP_GET_JOBS || op == IPP_OP_GET_JOB_ATTRIBUTES))
+    return monitor_view_request(msg, pkt, (size_t)body_size,
+				reader.request_id, size);
+  if (!is_valid || !monitor_op_is_subscription(op)) {
+    if (!ipp_op_is_read_only(op))
+      monitor_changed();
+    return NULL;
+  }
+
+  uint8_t *response = NULL;
+  pthread_mutex_lock(&monitor.lock);
+  {
+    monitor_remember_printer(&msg->header);
+    monitor_expire(monitor_now());
+    if (op == IPP_OP_CREATE_PRINTER_SUBSCRIPTIONS ||
+	op == IPP_OP_CREATE_JOB_SUBSCRIPTIONS)
+      response = monitor_subscribe(&reader, size);
+    else if (op == IPP_OP_GET_NOTIFICATIONS)
+      response = monitor_notifications(&reader, size);
+    else
+      response = monitor_subscription_op(&reader, size);
+  }
+  pthread_mutex_unlock(&monitor.lock);
+  return response;
+}
+
+/* Whether a request would be answered without the printer */
+int monitor_has(const struct http_message_t *msg,
+		const struct http_packet_t *pkt)
+{
+  if (!monitor.is_running ||
+      !http_header_method_is(&msg->header, "POST") ||
+      !http_header_has_token(&msg->header, "Content-Type",
+			     "application/ipp"))
+    return 0;
+
+  struct ipp_reader_t reader;
+  ssize_t body_size = monitor_parse(msg, pkt, &reader);
+  if (body_size < 0 || ipp_reader_check(&reader) != 0)
+    return 0;
+  uint16_t op = reader.op_status;
+  if (monitor_op_is_subscription(op))
+    return 1;
+  if (op != IPP_OP_GET_JOBS && op != IPP_OP_GET_JOB_ATTRIBUTES)
+    return 0;
+
+  size_t key_size = 0;
+  uint8_t *key = monitor_view_key(msg, pkt, (size_t)body_size, &key_size);
+  if (key == NULL)
+    return 0;
+  pthread_mutex_lock(&monitor.lock);
+  const struct monitor_view_t *view = monitor_view_find(key, key_size);
+  int found = view != NULL && monitor_view_is_fresh(view, monitor_now());
+  pthread_mutex_unlock(&monitor.lock);
+  free(key);
+  return found;
+}
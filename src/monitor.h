@@ -0,0 +1,121 @@
+/* Copyright (C) 2014 Daniel Dressler and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. */
+
+#pragma once
+#include <stdint.h>
+#include <time.h>
+
+#include "http.h"
+
+/* Default time in seconds between two polls of the printer */
+#define MONITOR_DEFAULT_INTERVAL 2
+/* Queries no client asked for in this many seconds are not polled
+   any more */
+#define MONITOR_VIEW_IDLE 30
+#define MONITOR_MAX_VIEWS 16
+#define MONITOR_MAX_RESPONSE (1 << 20)
+#define MONITOR_MAX_JOBS 32
+#define MONITOR_MAX_SUBSCRIPTIONS 64
+#define MONITOR_MAX_EVENTS 128
+/* Lease in seconds for printer subscriptions which ask for none */
+#define MONITOR_DEFAULT_LEASE 3600
+/* Time in seconds a job subscription outlives its job, for the
+   subscriber to fetch the job-completed event */
+#define MONITOR_JOB_LINGER 60
+
+/* Events a subscription can ask for */
+#define MONITOR_EVENT_PRINTER_STATE_CHANGED 0x01
+#define MONITOR_EVENT_PRINTER_STOPPED 0x02
+#define MONITOR_EVENT_JOB_CREATED 0x04
+#define MONITOR_EVENT_JOB_COMPLETED 0x08
+#define MONITOR_EVENT_JOB_STATE_CHANGED 0x10
+
+struct usb_sock_t;
+
+/* A job query clients keep repeating, Get-Jobs or Get-Job-Attributes.
+   The poller asks the printer once per interval and every client
+   gets the last response. */
+struct monitor_view_t {
+  struct monitor_view_t *next;
+
+  /* Target, Host and the IPP request with its request-id zeroed */
+  uint8_t *key;
+  size_t key_size;
+
+  /* The request as it goes to the printer */
+  uint8_t *request;
+  size_t request_size;
+
+  /* Last response and where its IPP message starts */
+  uint8_t *response;
+  size_t response_size;
+  size_t ipp_offset;
+
+  time_t updated;
+  time_t used;
+  int is_stale;
+  /* Round of the poller which last asked for it */
+  unsigned long polled;
+};
+
+struct monitor_job_t {
+  int32_t id;
+  int32_t state;
+  char reasons[128];
+};
+
+/* Printer and job state as of the last poll, keywords are joined
+   with commas */
+struct monitor_state_t {
+  int is_valid;
+  int32_t printer_state;
+  char printer_reasons[256];
+  size_t num_jobs;
+  struct monitor_job_t jobs[MONITOR_MAX_JOBS];
+};
+
+/* A subscription with the "ippget" pull method, the only one offered */
+struct monitor_subscription_t {
+  struct monitor_subscription_t *next;
+  int32_t id;
+  /* 0 for printer subscriptions */
+  int32_t job_id;
+  unsigned int events;
+  /* In seconds, 0 for none */
+  int32_t lease;
+  time_t expires;
+  int32_t sequence;
+  char user_name[256];
+  uint8_t user_data[63];
+  size_t user_data_size;
+};
+
+struct monitor_event_t {
+  int32_t subscription_id;
+  int32_t sequence;
+  unsigned int event;
+  time_t time;
+  int32_t printer_state;
+  char printer_reasons[256];
+  int32_t job_id;
+  int32_t job_state;
+  char job_reasons[128];
+};
+
+void monitor_init(struct usb_sock_t *, int);
+void monitor_shutdown(void);
+
+uint8_t *monitor_request(const struct http_message_t *,
+			 const struct http_packet_t *, size_t *);
+int monitor_has(const struct http_message_t *, const struct http_packet_t *);
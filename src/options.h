@@ -17,6 +17,7 @@
 #include <pthread.h>
 
 #include "dnssd.h"
+#include "tcp.h"
 
 enum log_target {
   LOGGING_STDERR,
@@ -28,7 +29,10 @@ struct options {
   uint16_t desired_port;
   int only_desired_port;
   uint16_t real_port;
+  /* The first one is announced via DNS-SD */
   char *interface;
+  char *interfaces[TCP_MAX_INTERFACES];
+  int num_interfaces;
   enum log_target log_destination;
 
   /* Behavior */
@@ -37,6 +41,17 @@ struct options {
   int nofork_mode;
   int noprinter_mode;
   int nobroadcast;
+  size_t cache_size;
+  int ipp_cache_ttl;
+  int printer_continue;
+  int response_idle;
+  int poll_interval;
+  char *spool_dir;
+  size_t spool_max_size;
+  int num_threads;
+  size_t thread_stack_size;
+  int listen_backlog;
+  size_t conn_buffer_size;
 
   /* Printer identity */
   unsigned char *serial_num;
@@ -48,10 +63,13 @@ struct options {
 
   /* Global variables */
   int terminate;
+  int report_stats;
   dnssd_t *dnssd_data;
   pthread_t usb_event_thread_handle;
-  struct tcp_sock_t *tcp_socket;
-  struct tcp_sock_t *tcp6_socket;
+  /* The TCP ones, then the Unix domain socket if any */
+  char *unix_socket;
+  struct tcp_sock_t *tcp_sockets[TCP_MAX_LISTENERS + 1];
+  int num_tcp_sockets;
 };
 
 extern struct options g_options;
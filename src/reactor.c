@@ -0,0 +1,221 @@
+/* Copyright (C) 2014 Daniel Dressler and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+
+#include "options.h"
+#include "logging.h"
+#include "reactor.h"
+#include "timeouts.h"
+
+/* Connections only get a thread while there is a request to serve.
+   The reactor watches the listening sockets and every connection
+   without a request, new ones and those between two requests, and
+   hands a connection on once the client sends something. Clients
+   which keep connections open cost a socket and no thread. */
+static struct {
+  int epoll_fd;
+  struct tcp_sock_t **socks;
+  int num_socks;
+
+  /* Connections watched, their idle timeout is in the timing wheels */
+  pthread_mutex_t lock;
+  struct tcp_conn_t *idle_first;
+  struct tcp_conn_t *idle_last;
+  size_t num_idle;
+
+  /* Events of the last wait not handled yet */
+  struct epoll_event events[REACTOR_MAX_EVENTS];
+  int num_events;
+  int next_event;
+} reactor = {
+  .epoll_fd = -1,
+  .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static void reactor_idle_remove(struct tcp_conn_t *conn)
+{
+  if (conn->idle_prev != NULL)
+    conn->idle_prev->idle_next = conn->idle_next;
+  else
+    reactor.idle_first = conn->idle_next;
+  if (conn->idle_next != NULL)
+    conn->idle_next->idle_prev = conn->idle_prev;
+  else
+    reactor.idle_last = conn->idle_prev;
+  conn->idle_prev = NULL;
+  conn->idle_next = NULL;
+  reactor.num_idle--;
+}
+
+/* Watch a connection until the client sends something. It fires only
+   once, whoever gets it owns it until it is parked again. */
+static int reactor_watch(struct tcp_conn_t *conn, int op)
+{
+  timeout_arm(&conn->timeout, conn, TIMEOUT_KIND_IDLE, REACTOR_IDLE_TIMEOUT);
+  pthread_mutex_lock(&reactor.lock);
+  conn->idle_prev = reactor.idle_last;
+  conn->idle_next = NULL;
+  if (reactor.idle_last != NULL)
+    reactor.idle_last->idle_next = conn;
+  else
+    reactor.idle_first = conn;
+  reactor.idle_last = conn;
+  reactor.num_idle++;
+  pthread_mutex_unlock(&reactor.lock);
+
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+  event.data.ptr = conn;
+  if (epoll_ctl(reactor.epoll_fd, op, conn->sd, &event) != 0) {
+    ERR("Reactor: Cannot watch connection: %s", strerror(errno));
+    timeout_cancel(&conn->timeout);
+    pthread_mutex_lock(&reactor.lock);
+    reactor_idle_remove(conn);
+    pthread_mutex_unlock(&reactor.lock);
+    return -1;
+  }
+  return 0;
+}
+
+int reactor_init(struct tcp_sock_t **socks, int num_socks)
+{
+  reactor.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (reactor.epoll_fd < 0) {
+    ERR("Reactor: Cannot create epoll instance: %s", strerror(errno));
+    return -1;
+  }
+
+  reactor.socks = socks;
+  reactor.num_socks = num_socks;
+  for (int i = 0; i < num_socks; i++) {
+    /* A connection reset before it is accepted must not block us */
+    int flags = fcntl(reactor.socks[i]->sd, F_GETFL);
+    fcntl(reactor.socks[i]->sd, F_SETFL, flags | O_NONBLOCK);
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = reactor.socks[i];
+    if (epoll_ctl(reactor.epoll_fd, EPOLL_CTL_ADD, reactor.socks[i]->sd,
+		  &event) != 0) {
+      ERR("Reactor: Cannot watch listening socket: %s", strerror(errno));
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void reactor_shutdown(void)
+{
+  pthread_mutex_lock(&reactor.lock);
+  while (reactor.idle_first != NULL) {
+    struct tcp_conn_t *conn = reactor.idle_first;
+    reactor_idle_remove(conn);
+    tcp_conn_close(conn);
+  }
+  pthread_mutex_unlock(&reactor.lock);
+
+  if (reactor.epoll_fd >= 0)
+    close(reactor.epoll_fd);
+  reactor.epoll_fd = -1;
+}
+
+/* Take all connections pending on a listening socket, a burst of
+   clients costs one wakeup */
+static void reactor_accept(struct tcp_sock_t *sock)
+{
+  struct tcp_conn_t *conn;
+  int num_accepted = 0;
+  while ((conn = tcp_conn_accept(sock)) != NULL) {
+    num_accepted++;
+    if (reactor_watch(conn, EPOLL_CTL_ADD) != 0)
+      tcp_conn_close(conn);
+  }
+  if (num_accepted > 0)
+    NOTE("Reactor: Accepted %d connection(s) on %s", num_accepted,
+	 sock->name);
+}
+
+static struct tcp_sock_t *reactor_listener(void *ptr)
+{
+  for (int i = 0; i < reactor.num_socks; i++)
+    if (ptr == reactor.socks[i])
+      return reactor.socks[i];
+  return NULL;
+}
+
+/* The next connection with a request to serve, NULL when shutting
+   down or asked for statistics */
+struct tcp_conn_t *reactor_next(void)
+{
+  while (!g_options.terminate && !g_options.report_stats) {
+    while (reactor.next_event < reactor.num_events) {
+      struct epoll_event *event = &reactor.events[reactor.next_event++];
+      struct tcp_sock_t *sock = reactor_listener(event->data.ptr);
+      if (sock != NULL) {
+	reactor_accept(sock);
+	continue;
+      }
+      struct tcp_conn_t *conn = event->data.ptr;
+      pthread_mutex_lock(&reactor.lock);
+      reactor_idle_remove(conn);
+      pthread_mutex_unlock(&reactor.lock);
+      /* Shut down for being idle too long, that woke us */
+      if (timeout_cancel(&conn->timeout)) {
+	tcp_conn_close(conn);
+	continue;
+      }
+      return conn;
+    }
+
+    /* Connections whose deadline passed are only shut down, they come
+       back here or to the thread serving them for closing. The wait
+       ends once a second for signals caught by another thread. */
+    reactor.next_event = 0;
+    reactor.num_events = epoll_wait(reactor.epoll_fd, reactor.events,
+				    REACTOR_MAX_EVENTS, 1000);
+    if (reactor.num_events < 0) {
+      reactor.num_events = 0;
+      if (errno == EINTR)
+	continue;
+      ERR("Reactor: Waiting for connections failed: %s", strerror(errno));
+      return NULL;
+    }
+  }
+  return NULL;
+}
+
+/* A connection without request is watched again, the thread which
+   served it is done with it */
+void reactor_park(struct tcp_conn_t *conn)
+{
+  if (reactor_watch(conn, EPOLL_CTL_MOD) != 0)
+    tcp_conn_close(conn);
+}
+
+void reactor_report(void)
+{
+  pthread_mutex_lock(&reactor.lock);
+  NOTE("Reactor: %lu idle connections", reactor.num_idle);
+  pthread_mutex_unlock(&reactor.lock);
+}
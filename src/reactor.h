@@ -0,0 +1,29 @@
+/* Copyright (C) 2014 Daniel Dressler and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. */
+
+#pragma once
+
+#include "tcp.h"
+
+/* In seconds a client may keep a connection open without sending a
+   request */
+#define REACTOR_IDLE_TIMEOUT 30
+#define REACTOR_MAX_EVENTS 64
+
+int reactor_init(struct tcp_sock_t **, int);
+void reactor_shutdown(void);
+
+struct tcp_conn_t *reactor_next(void);
+void reactor_park(struct tcp_conn_t *);
+void reactor_report(void);
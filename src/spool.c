@@ -0,0 +1,95 @@
+/* Copyright (C) 2014 Daniel Dressler and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "options.h"
+#include "logging.h"
+#include "spool.h"
+
+int spool_open(struct spool_t *spool, size_t size)
+{
+  memset(spool, 0, sizeof(*spool));
+  spool->fd = -1;
+  if (size == 0)
+    return -1;
+
+  char path[4096];
+  int path_size = snprintf(path, sizeof(path), "%s/ippusbxd-spool-XXXXXX",
+			   g_options.spool_dir);
+  if (path_size < 0 || (size_t)path_size >= sizeof(path)) {
+    ERR("Spool: Directory name too long");
+    return -1;
+  }
+  spool->fd = mkstemp(path);
+  if (spool->fd < 0) {
+    ERR("Spool: Cannot create %s: %s", path, strerror(errno));
+    return -1;
+  }
+  unlink(path);
+
+  void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    spool->fd, 0);
+  if (data == MAP_FAILED) {
+    ERR("Spool: Cannot map %lu bytes: %s", size, strerror(errno));
+    close(spool->fd);
+    spool->fd = -1;
+    return -1;
+  }
+  spool->data = data;
+  spool->mapped_size = size;
+  NOTE("Spool: Mapped %lu bytes in %s", size, g_options.spool_dir);
+  return 0;
+}
+
+/* Writing to the mapping beyond the end of the file would kill us with
+   SIGBUS, as would a full file system. The space is allocated before
+   it is written to, running out of it is an error instead. */
+int spool_extend(struct spool_t *spool, size_t size)
+{
+  if (size <= spool->file_size)
+    return 0;
+  if (size > spool->mapped_size)
+    return -1;
+
+  size_t new_size = spool->file_size + SPOOL_STEP;
+  if (new_size < size)
+    new_size = size;
+  if (new_size > spool->mapped_size)
+    new_size = spool->mapped_size;
+  int status = posix_fallocate(spool->fd, 0, (off_t)new_size);
+  if (status != 0) {
+    ERR("Spool: Cannot grow to %lu bytes: %s", new_size, strerror(status));
+    return -1;
+  }
+  spool->file_size = new_size;
+  return 0;
+}
+
+void spool_close(struct spool_t *spool)
+{
+  if (spool->data != NULL)
+    munmap(spool->data, spool->mapped_size);
+  if (spool->fd >= 0)
+    close(spool->fd);
+  spool->data = NULL;
+  spool->fd = -1;
+}
@@ -0,0 +1,37 @@
+/* Copyright (C) 2014 Daniel Dressler and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. */
+
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+/* Default limit for one job's spool in MiB */
+#define SPOOL_DEFAULT_MAX_SIZE 256
+/* The spool file grows in steps of this size */
+#define SPOOL_STEP (1 << 20)
+
+/* A job's document on its way to the printer, in a file mapped into
+   memory. The file is unlinked once created, in a tmpfs directory it
+   only takes memory and is gone with the mapping. The whole mapping is
+   set up at once but the file only grows as data comes in. */
+struct spool_t {
+  int fd;
+  uint8_t *data;
+  size_t mapped_size;
+  size_t file_size;
+};
+
+int spool_open(struct spool_t *, size_t);
+int spool_extend(struct spool_t *, size_t);
+void spool_close(struct spool_t *);
@@ -23,8 +23,11 @@
 #include <ifaddrs.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <net/if.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 
 #include <fcntl.h>
 #include <unistd.h>
@@ -35,19 +38,21 @@
 #include "tcp.h"
 
 
-struct tcp_sock_t *tcp_open(uint16_t port, char* interface)
+/* A listening socket on one address */
+static struct tcp_sock_t *tcp_listen(const struct sockaddr *addr,
+				     socklen_t addr_size, const char *name,
+				     int *bind_errno)
 {
   struct tcp_sock_t *this = calloc(1, sizeof *this);
   if (this == NULL) {
-    ERR("IPv4: callocing this failed");
-    goto error;
+    ERR("TCP: callocing listener for %s failed", name);
+    return NULL;
   }
 
   /* Open [S]ocket [D]escriptor */
-  this->sd = -1;
-  this->sd = socket(AF_INET, SOCK_STREAM, 0);
+  this->sd = socket(addr->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
   if (this->sd < 0) {
-    ERR("IPv4 socket open failed");
+    ERR("TCP: socket open failed for %s", name);
     goto error;
   }
   /* Set SO_REUSEADDR option to allow for a clean host/port unbinding even with
@@ -56,151 +61,202 @@ struct tcp_sock_t *tcp_open(uint16_t port, char* interface)
      http://stackoverflow.com/questions/10619952/how-to-completely-destroy-a-socket-connection-in-c */
   int true = 1;
   if (setsockopt(this->sd, SOL_SOCKET, SO_REUSEADDR, &true, sizeof(int)) == -1) {
-    ERR("IPv4 setting socket options failed");
-    goto error;
-  }
-
-  /* Find the IP address for the selected interface */
-  struct ifaddrs *ifaddr, *ifa;
-  getifaddrs(&ifaddr);
-  for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
-    if (ifa->ifa_addr == NULL)
-      continue;
-    if ((strcmp(ifa->ifa_name, interface) == 0) &&
-	(ifa->ifa_addr->sa_family == AF_INET))
-      break;
-  }
-  if (ifa == NULL) {
-    ERR("Interface %s does not exist or IPv4 IP not found.", interface);
+    ERR("TCP: setting socket options failed for %s", name);
     goto error;
   }
 
-  /* Configure socket params */
-  struct sockaddr_in addr, *if_addr;
-  if_addr = (struct sockaddr_in *) ifa->ifa_addr;
-  memset(&addr, 0, sizeof addr);
-  addr.sin_family = AF_INET;
-  addr.sin_port = htons(port);
-  addr.sin_addr.s_addr = if_addr->sin_addr.s_addr;
-  /* addr.sin_addr.s_addr = htonl(0xC0A8000F); */
-  NOTE("IPv4: Binding to %s:%d", inet_ntoa(if_addr->sin_addr), port);
-
   /* Bind to the interface/IP/port */
-  if (bind(this->sd,
-	   (struct sockaddr *)&addr,
-	   sizeof addr) < 0) {
-    if (g_options.only_desired_port == 1)
-      ERR("IPv4 bind on port failed. "
-	  "Requested port may be taken or require root permissions.");
+  if (bind(this->sd, addr, addr_size) < 0) {
+    *bind_errno = errno;
     goto error;
   }
 
-  /* Let kernel over-accept max number of connections */
-  if (listen(this->sd, HTTP_MAX_PENDING_CONNS) < 0) {
-    ERR("IPv4 listen failed on socket");
+  /* Let the kernel complete connections of a burst of clients while
+     we accept */
+  if (listen(this->sd, g_options.listen_backlog) < 0) {
+    ERR("TCP: listen failed on %s", name);
     goto error;
   }
-
   return this;
 
  error:
-  if (this != NULL) {
-    if (this->sd != -1) {
-      close(this->sd);
-    }
-    free(this);
-  }
+  if (this->sd >= 0)
+    close(this->sd);
+  free(this);
   return NULL;
 }
 
-struct tcp_sock_t *tcp6_open(uint16_t port, char* interface)
+static int tcp_interface_index(const char *interface, char **interfaces,
+			       int num_interfaces)
 {
-  struct tcp_sock_t *this = calloc(1, sizeof *this);
-  if (this == NULL) {
-    ERR("IPv6: callocing this failed");
-    goto error;
-  }
+  for (int i = 0; i < num_interfaces; i++)
+    if (strcmp(interface, interfaces[i]) == 0)
+      return i;
+  return -1;
+}
 
-  /* Open [S]ocket [D]escriptor */
-  this->sd = -1;
-  this->sd = socket(AF_INET6, SOCK_STREAM, 0);
-  if (this->sd < 0) {
-    ERR("Ipv6 socket open failed");
-    goto error;
-  }
-  /* Set SO_REUSEADDR option to allow for a clean host/port unbinding even with
-     pending requests on shutdown of ippusbxd. Otherwise the port will stay
-     unavailable for a certain kernel-defined timeout. See also
-     http://stackoverflow.com/questions/10619952/how-to-completely-destroy-a-socket-connection-in-c */
-  int true = 1;
-  if (setsockopt(this->sd, SOL_SOCKET, SO_REUSEADDR, &true, sizeof(int)) == -1) {
-    ERR("IPv6 setting socket options failed");
-    goto error;
+/* Listen on one port on all IPv4 and IPv6 addresses of the given
+   interfaces. Gives the number of sockets opened, 0 if the port is
+   not available on one of the addresses, -1 if one of the interfaces
+   has no address or there is nothing to listen on. Port 0 takes the
+   port the first address gets for all others. */
+int tcp_open(uint16_t port, char **interfaces, int num_interfaces,
+	     struct tcp_sock_t **socks, int max_socks)
+{
+  struct ifaddrs *ifaddr, *ifa;
+  if (getifaddrs(&ifaddr) != 0) {
+    ERR("TCP: Cannot list network interfaces: %s", strerror(errno));
+    return -1;
   }
 
-  /* Find the IP address for the selected interface */
-  struct ifaddrs *ifaddr, *ifa;
-  getifaddrs(&ifaddr);
+  int num_socks = 0;
+  int status = -1;
+  int num_found[TCP_MAX_INTERFACES] = { 0 };
   for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
-    if (ifa->ifa_addr == NULL)
+    if (ifa->ifa_addr == NULL ||
+	(ifa->ifa_addr->sa_family != AF_INET &&
+	 ifa->ifa_addr->sa_family != AF_INET6))
       continue;
-    if ((strcmp(ifa->ifa_name, interface) == 0) &&
-	(ifa->ifa_addr->sa_family == AF_INET6))
-      break;
+    int index = tcp_interface_index(ifa->ifa_name, interfaces,
+				    num_interfaces);
+    if (index < 0)
+      continue;
+    num_found[index]++;
+    if (num_socks == max_socks) {
+      WARN("TCP: More than %d addresses, not listening on %s",
+	   max_socks, ifa->ifa_name);
+      continue;
+    }
+
+    /* Configure socket params */
+    struct sockaddr_storage addr;
+    socklen_t addr_size;
+    char buf[INET6_ADDRSTRLEN];
+    char name[IF_NAMESIZE + INET6_ADDRSTRLEN + 3];
+    memset(&addr, 0, sizeof addr);
+    if (ifa->ifa_addr->sa_family == AF_INET) {
+      struct sockaddr_in *addr4 = (struct sockaddr_in *)&addr;
+      addr4->sin_family = AF_INET;
+      addr4->sin_port = htons(port);
+      addr4->sin_addr = ((struct sockaddr_in *)ifa->ifa_addr)->sin_addr;
+      addr_size = sizeof *addr4;
+      inet_ntop(AF_INET, &addr4->sin_addr, buf, sizeof(buf));
+      snprintf(name, sizeof(name), "%s %s", ifa->ifa_name, buf);
+    } else {
+      struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&addr;
+      addr6->sin6_family = AF_INET6;
+      addr6->sin6_port = htons(port);
+      addr6->sin6_addr = ((struct sockaddr_in6 *)ifa->ifa_addr)->sin6_addr;
+      addr6->sin6_scope_id = if_nametoindex(ifa->ifa_name);
+      addr_size = sizeof *addr6;
+      inet_ntop(AF_INET6, &addr6->sin6_addr, buf, sizeof(buf));
+      snprintf(name, sizeof(name), "%s [%s]", ifa->ifa_name, buf);
+    }
+
+    NOTE("TCP: Binding to %s:%d", name, port);
+    int bind_errno = 0;
+    struct tcp_sock_t *sock = tcp_listen((struct sockaddr *)&addr, addr_size,
+					 name, &bind_errno);
+    if (sock == NULL) {
+      /* An IPv6 address still being checked for duplicates cannot be
+	 bound yet, the others are enough */
+      if (bind_errno == EADDRNOTAVAIL) {
+	WARN("TCP: Address of %s not available, skipping it", name);
+	continue;
+      }
+      if (bind_errno != 0 && g_options.only_desired_port == 1)
+	ERR("TCP: bind on %s:%d failed: %s. Requested port may be taken or "
+	    "require root permissions.", name, port, strerror(bind_errno));
+      status = bind_errno != 0 ? 0 : -1;
+      goto error;
+    }
+    snprintf(sock->name, sizeof(sock->name), "%s:%d", name,
+	     tcp_port_number_get(sock));
+    socks[num_socks++] = sock;
+
+    /* All addresses get the same port */
+    if (port == 0)
+      port = tcp_port_number_get(sock);
   }
-  if (ifa == NULL) {
-    ERR("Interface %s does not exist or IPv6 IP not found.", interface);
+  /* Every interface asked for is served, a mistyped one is not
+     silently left out */
+  for (int i = 0; i < num_interfaces; i++)
+    if (num_found[i] == 0) {
+      ERR("TCP: Interface %s does not exist or has no IP address.",
+	  interfaces[i]);
+      goto error;
+    }
+  if (num_socks == 0) {
+    ERR("TCP: No address to listen on");
     goto error;
   }
+  freeifaddrs(ifaddr);
+  return num_socks;
 
-  /* Configure socket params */
-  struct sockaddr_in6 addr, *if_addr;
-  char buf[64];
-  if_addr = (struct sockaddr_in6 *) ifa->ifa_addr;
+ error:
+  freeifaddrs(ifaddr);
+  while (num_socks > 0)
+    tcp_close(socks[--num_socks]);
+  return status;
+}
+
+/* Listen on a Unix domain socket, for local clients which can talk
+   to the printer without going through the TCP/IP stack. A socket
+   left behind by an earlier run is replaced, one still in use is
+   not. */
+struct tcp_sock_t *tcp_unix_open(const char *path)
+{
+  struct sockaddr_un addr;
   memset(&addr, 0, sizeof addr);
-  addr.sin6_family = AF_INET6;
-  addr.sin6_port = htons(port);
-  addr.sin6_addr = if_addr->sin6_addr;
-  addr.sin6_scope_id=if_nametoindex(interface);
-  if (inet_ntop(addr.sin6_family, (void *)&(addr.sin6_addr),
-		buf, sizeof(buf)) == NULL) {
-    ERR("Could not determine IPv6 IP address for interface %s.",
-	interface);
-    goto error;
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    ERR("TCP: Socket path %s too long", path);
+    return NULL;
   }
-  NOTE("IPv6: Binding to [%s]:%d", buf, port);
+  strcpy(addr.sun_path, path);
 
-  /* Bind to the interface/IP/port */
-  if (bind(this->sd,
-	   (struct sockaddr *)&addr,
-	   sizeof addr) < 0) {
-    if (g_options.only_desired_port == 1)
-      ERR("IPv6 bind on port failed. "
-	  "Requested port may be taken or require root permissions.");
-    goto error;
+  struct stat status;
+  if (lstat(path, &status) == 0) {
+    if (!S_ISSOCK(status.st_mode)) {
+      ERR("TCP: %s exists and is not a socket", path);
+      return NULL;
+    }
+    int sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int is_used = sd >= 0 &&
+      connect(sd, (struct sockaddr *)&addr, sizeof addr) == 0;
+    if (sd >= 0)
+      close(sd);
+    if (is_used) {
+      ERR("TCP: Socket %s is in use", path);
+      return NULL;
+    }
+    unlink(path);
   }
 
-  /* Let kernel over-accept max number of connections */
-  if (listen(this->sd, HTTP_MAX_PENDING_CONNS) < 0) {
-    ERR("IPv6 listen failed on socket");
-    goto error;
+  int bind_errno = 0;
+  struct tcp_sock_t *this = tcp_listen((struct sockaddr *)&addr,
+				       sizeof addr, path, &bind_errno);
+  if (this == NULL) {
+    if (bind_errno != 0)
+      ERR("TCP: bind on %s failed: %s", path, strerror(bind_errno));
+    return NULL;
   }
+  snprintf(this->name, sizeof(this->name), "%s", path);
+  this->path = strdup(path);
 
+  /* Like the loopback port it is open to all local users */
+  chmod(path, 0666);
+  NOTE("TCP: Listening on %s", path);
   return this;
-
- error:
-  if (this != NULL) {
-    if (this->sd != -1) {
-      close(this->sd);
-    }
-    free(this);
-  }
-  return NULL;
 }
 
 void tcp_close(struct tcp_sock_t *this)
 {
   close(this->sd);
+  if (this->path != NULL) {
+    unlink(this->path);
+    free(this->path);
+  }
   free(this);
 }
 
@@ -221,6 +277,57 @@ uint16_t tcp_port_number_get(struct tcp_sock_t *sock)
   return 0;
 }
 
+/* Whether the client holds back the body of its request until it is
+   told to go on, HTTP/1.0 clients never do */
+int tcp_request_expects_continue(const struct http_message_t *msg)
+{
+  const struct http_header_index_t *header = &msg->header;
+  if (header->raw == NULL || http_header_is_response(header))
+    return 0;
+
+  size_t version_size = 0;
+  const char *version = http_header_start_token(header, 2, &version_size);
+  if (version == NULL ||
+      (version_size == 8 && memcmp(version, "HTTP/1.0", 8) == 0))
+    return 0;
+  return http_header_has_token(header, "Expect", "100-continue");
+}
+
+/* Let the client send the body right away instead of waiting for the
+   printer to ask for it */
+static int tcp_continue(struct tcp_conn_t *tcp, struct http_message_t *msg)
+{
+  static const char interim[] = "HTTP/1.1 100 Continue\r\n\r\n";
+  if (msg->is_continued || msg->is_completed || g_options.printer_continue ||
+      !tcp_request_expects_continue(msg))
+    return 0;
+
+  NOTE("TCP: Answering 100-continue");
+  msg->is_continued = 1;
+  return tcp_send(tcp, interim, sizeof(interim) - 1);
+}
+
+/* The whole header has to come within TIMEOUT_HEADER, so that a
+   client sending it bit by bit cannot hold a thread. After it the
+   client only has to keep the body coming. */
+static void tcp_await_request(struct tcp_conn_t *tcp,
+			      const struct http_message_t *msg)
+{
+  if (msg->type == HTTP_UNSET) {
+    if (tcp->header_deadline == 0)
+      tcp->header_deadline = timeouts_now() + TIMEOUT_HEADER;
+    timeout_arm_at(&tcp->timeout, tcp, TIMEOUT_KIND_HEADER,
+		   tcp->header_deadline);
+  } else
+    timeout_arm(&tcp->timeout, tcp, TIMEOUT_KIND_BODY, TIMEOUT_BODY);
+}
+
+static void tcp_timeout_cancel(struct tcp_conn_t *tcp)
+{
+  if (timeout_cancel(&tcp->timeout))
+    tcp->is_closed = 1;
+}
+
 struct http_packet_t *tcp_packet_get(struct tcp_conn_t *tcp,
                                      struct http_message_t *msg)
 {
@@ -237,16 +344,24 @@ struct http_packet_t *tcp_packet_get(struct tcp_conn_t *tcp,
     return pkt;
   }
 
-  struct timeval tv;
-  tv.tv_sec = 3;
-  tv.tv_usec = 0;
-  setsockopt(tcp->sd, SOL_SOCKET, SO_RCVTIMEO,
-	     (char *)&tv, sizeof(struct timeval));
+  while (want_size != 0 && !msg->is_completed && !msg->is_bulk &&
+	 !g_options.terminate) {
+    if (tcp_continue(tcp, msg) != 0)
+      goto error;
 
-  while (want_size != 0 && !msg->is_completed && !g_options.terminate) {
+    size_t space = 0;
+    uint8_t *subbuffer = packet_write_ptr(pkt, 1, &space);
+    if (subbuffer == NULL) {
+      ERR("TCP: No room left in packet");
+      goto error;
+    }
+    if (want_size > space)
+      want_size = space;
     NOTE("TCP: Getting %d bytes", want_size);
-    uint8_t *subbuffer = pkt->buffer + pkt->filled_size;
+    tcp_await_request(tcp, msg);
     ssize_t gotten_size = recv(tcp->sd, subbuffer, want_size, 0);
+    if (msg->type != HTTP_UNSET)
+      tcp->header_deadline = 0;
     if (gotten_size < 0) {
       int errno_saved = errno;
       ERR("recv failed with err %d:%s", errno_saved,
@@ -255,6 +370,13 @@ struct http_packet_t *tcp_packet_get(struct tcp_conn_t *tcp,
       goto error;
     }
     NOTE("TCP: Got %d bytes", gotten_size);
+    if (gotten_size == 0 && msg->type == HTTP_CLOSE_DELIMITED) {
+      /* The client is done sending, it still waits for the response */
+      NOTE("TCP: Client closed its side, request without length ends after %lu bytes",
+	   msg->received_size);
+      msg->is_completed = 1;
+      break;
+    }
     if (gotten_size == 0) {
       tcp->is_closed = 1;
       if (pkt->filled_size == 0) {
@@ -267,26 +389,115 @@ struct http_packet_t *tcp_packet_get(struct tcp_conn_t *tcp,
 
     packet_mark_received(pkt, (unsigned) gotten_size);
     want_size = packet_pending_bytes(pkt);
+
+    /* The printer is asked first whether the body may come, see
+       --printer-continue */
+    if (g_options.printer_continue && !msg->is_continued &&
+	msg->type != HTTP_UNSET && tcp_request_expects_continue(msg))
+      break;
     NOTE("TCP: Want more %d bytes; Message %scompleted", want_size, msg->is_completed ? "" : "not ");
   }
 
+  tcp_timeout_cancel(tcp);
+  if (msg->is_bulk && tcp_continue(tcp, msg) != 0)
+    goto error;
+
   NOTE("TCP: Received %lu bytes", pkt->filled_size);
   return pkt;
 
  error:
+  tcp_timeout_cancel(tcp);
   if (pkt != NULL)
     packet_free(pkt);
   return NULL;
 }
 
+/* Reads the next part of the body of a bulk message into buf, never
+   beyond the end of the message. Bytes which arrived with the header
+   come first. Without wait it only takes what is already there.
+   Returns the number of bytes, 0 if nothing was there and -1 if the
+   connection failed or was closed. */
+ssize_t tcp_body_get(struct tcp_conn_t *tcp, struct http_message_t *msg,
+		     uint8_t *buf, size_t size, int wait)
+{
+  if (msg->type == HTTP_CONTENT_LENGTH &&
+      msg->claimed_size - msg->received_size < size)
+    size = msg->claimed_size - msg->received_size;
+  if (size == 0 || msg->is_completed)
+    return 0;
+
+  if (msg->spare_filled > 0) {
+    size_t copied = message_spare_copy(msg, buf, size);
+    size_t used = message_body_received(msg, buf, copied);
+    message_spare_skip(msg, used);
+    return (ssize_t)used;
+  }
+
+  if (wait)
+    tcp_await_request(tcp, msg);
+  ssize_t gotten_size = recv(tcp->sd, buf, size, wait ? 0 : MSG_DONTWAIT);
+  if (wait)
+    tcp_timeout_cancel(tcp);
+  if (gotten_size < 0) {
+    int errno_saved = errno;
+    if (!wait && (errno_saved == EAGAIN || errno_saved == EWOULDBLOCK))
+      return 0;
+    ERR("recv failed with err %d:%s", errno_saved,
+	strerror(errno_saved));
+    tcp->is_closed = 1;
+    return -1;
+  }
+  if (gotten_size == 0) {
+    ERR("TCP: Client closed connection within message body");
+    tcp->is_closed = 1;
+    return -1;
+  }
+
+  /* A chunked body may end within what was read */
+  size_t used = message_body_received(msg, buf, (size_t)gotten_size);
+  if (used < (size_t)gotten_size &&
+      message_spare_put(msg, buf + used, (size_t)gotten_size - used) != 0) {
+    ERR("TCP: Failed to keep data following the message");
+    return -1;
+  }
+  return (ssize_t)used;
+}
+
+/* A small response arriving from the printer in pieces is only of use
+   to the client once it is complete, so its pieces are held in the
+   kernel (MSG_MORE) and go out together with the last one. Large and
+   open-ended responses go out piece by piece, as soon as they come. */
+static int tcp_packet_flags(const struct http_packet_t *pkt)
+{
+  const struct http_message_t *msg = pkt->parent_message;
+  if (msg != NULL && !msg->is_completed &&
+      msg->type == HTTP_CONTENT_LENGTH &&
+      msg->claimed_size <= TCP_HOLD_MAX_SIZE)
+    return MSG_NOSIGNAL | MSG_MORE;
+  return MSG_NOSIGNAL;
+}
+
 int tcp_packet_send(struct tcp_conn_t *conn, struct http_packet_t *pkt)
 {
   size_t remaining = pkt->filled_size;
   size_t total = 0;
+  int flags = tcp_packet_flags(pkt);
+  timeout_arm(&conn->timeout, conn, TIMEOUT_KIND_SEND, TIMEOUT_SEND);
   while (remaining > 0 && !g_options.terminate) {
-    ssize_t sent = send(conn->sd, pkt->buffer + total,
-			remaining, MSG_NOSIGNAL);
+    /* Hand all of the packet's segments to the kernel at once */
+    struct iovec iov[16];
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = iov;
+    hdr.msg_iovlen = packet_iovec(pkt, total, iov, 16);
+    if (hdr.msg_iovlen == 0) {
+      tcp_timeout_cancel(conn);
+      ERR("TCP: Packet ends %lu bytes short of its size", remaining);
+      return -1;
+    }
+    ssize_t sent = sendmsg(conn->sd, &hdr, flags);
     if (sent < 0) {
+      tcp_timeout_cancel(conn);
       if (errno == EPIPE) {
 	conn->is_closed = 1;
 	return 0;
@@ -302,68 +513,76 @@ int tcp_packet_send(struct tcp_conn_t *conn, struct http_packet_t *pkt)
     else
       remaining -= sent_ulong;
   }
+  tcp_timeout_cancel(conn);
   NOTE("TCP: sent %lu bytes", total);
   return 0;
 }
 
 
-struct tcp_conn_t *tcp_conn_select(struct tcp_sock_t *sock,
-				   struct tcp_sock_t *sock6)
+int tcp_send(struct tcp_conn_t *conn, const void *data, size_t size)
+{
+  size_t total = 0;
+  timeout_arm(&conn->timeout, conn, TIMEOUT_KIND_SEND, TIMEOUT_SEND);
+  while (total < size && !g_options.terminate) {
+    ssize_t sent = send(conn->sd, (const uint8_t *)data + total,
+			size - total, MSG_NOSIGNAL);
+    if (sent < 0) {
+      tcp_timeout_cancel(conn);
+      if (errno == EPIPE) {
+	conn->is_closed = 1;
+	return 0;
+      }
+      ERR("Failed to sent data over TCP");
+      return -1;
+    }
+    total += (size_t)sent;
+  }
+  tcp_timeout_cancel(conn);
+  NOTE("TCP: sent %lu bytes", total);
+  return 0;
+}
+
+struct tcp_conn_t *tcp_conn_accept(struct tcp_sock_t *sock)
 {
   struct tcp_conn_t *conn = calloc(1, sizeof *conn);
   if (conn == NULL) {
     ERR("Calloc for connection struct failed");
-    goto error;
-  }
-  fd_set rfds;
-  int retval = 0;
-  int nfds = 0;
-  FD_ZERO(&rfds);
-  if (sock) {
-    FD_SET(sock->sd, &rfds);
-    nfds = sock->sd;
-  }
-  if (sock6) {
-    FD_SET(sock6->sd, &rfds);
-    if (sock6->sd > nfds)
-      nfds = sock6->sd;
-  }
-  if (nfds == 0) {
-    ERR("No valid TCP socket supplied.");
-    goto error;
-  }
-  nfds += 1;
-  retval = select(nfds, &rfds, NULL, NULL, NULL);
-  if (g_options.terminate)
-    goto error;
-  if (retval < 1) {
-    ERR("Failed to open tcp connection");
-    goto error;
-  }
-  if (sock && FD_ISSET(sock->sd, &rfds)) {
-    conn->sd = accept(sock->sd, NULL, NULL);
-    NOTE ("Using IPv4");
-  } else if (sock6 && FD_ISSET(sock6->sd, &rfds)) {
-    conn->sd = accept(sock6->sd, NULL, NULL);
-    NOTE ("Using IPv6");
-  } else {
-    ERR("select failed");
-    goto error;
+    return NULL;
   }
+  /* The connection itself stays blocking for the worker serving it */
+  conn->sd = accept4(sock->sd, NULL, NULL, SOCK_CLOEXEC);
   if (conn->sd < 0) {
-    ERR("accept failed");
-    goto error;
+    /* Another wakeup took the connection, or it was reset already */
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED)
+      ERR("accept failed: %s", strerror(errno));
+    free(conn);
+    return NULL;
+  }
+
+  /* What we send is never held back waiting for the client to
+     acknowledge earlier data, see tcp_packet_send() for how small
+     responses still go out whole */
+  if (sock->path == NULL) {
+    int true = 1;
+    if (setsockopt(conn->sd, IPPROTO_TCP, TCP_NODELAY, &true,
+		   sizeof(true)) != 0)
+      WARN("TCP: Cannot disable Nagle's algorithm: %s", strerror(errno));
   }
   return conn;
+}
 
- error:
-  if (conn != NULL)
-    free(conn);
-  return NULL;
+/* Whether the client sent anything not read yet, or closed */
+int tcp_conn_is_readable(struct tcp_conn_t *conn)
+{
+  uint8_t byte;
+  ssize_t size = recv(conn->sd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+  return size >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
 }
 
 void tcp_conn_close(struct tcp_conn_t *conn)
 {
+  timeout_cancel(&conn->timeout);
+
   /* Unbind host/port cleanly even with pending requests. Otherwise
      the port will stay unavailable for a certain kernel-defined
      timeout. See also
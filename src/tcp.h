@@ -19,10 +19,19 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <net/if.h>
 
 #include "http.h"
+#include "timeouts.h"
 
-#define HTTP_MAX_PENDING_CONNS 0
+/* Default for connections the kernel completes before they are
+   accepted */
+#define HTTP_MAX_PENDING_CONNS 128
+/* Interfaces and addresses of all of them listened on */
+#define TCP_MAX_INTERFACES 8
+#define TCP_MAX_LISTENERS 32
+/* Responses up to this size leave in one go, see tcp_packet_send() */
+#define TCP_HOLD_MAX_SIZE (1 << 16)
 #define BUFFER_STEP (1 << 13)
 #define BUFFER_STEP_RATIO (2)
 #define BUFFER_INIT_RATIO (1)
@@ -32,22 +41,40 @@ struct tcp_sock_t {
   int sd;
   struct sockaddr_in6 info;
   socklen_t info_size;
+
+  /* Interface and address, for the log */
+  char name[IF_NAMESIZE + INET6_ADDRSTRLEN + 10];
+  /* Of a Unix domain socket, removed on close */
+  char *path;
 };
 
 struct tcp_conn_t {
   int sd;
   int is_closed;
+
+  /* While idle between requests the connection is watched by the
+     reactor, see reactor.c */
+  struct tcp_conn_t *idle_prev;
+  struct tcp_conn_t *idle_next;
+
+  /* Whatever the connection waits for, the client gets this long */
+  struct timeout_t timeout;
+  uint64_t header_deadline;
 };
 
-struct tcp_sock_t *tcp_open(uint16_t, char* interface);
-struct tcp_sock_t *tcp6_open(uint16_t, char* interface);
+int tcp_open(uint16_t, char **, int, struct tcp_sock_t **, int);
+struct tcp_sock_t *tcp_unix_open(const char *);
 void tcp_close(struct tcp_sock_t *);
 uint16_t tcp_port_number_get(struct tcp_sock_t *);
 
-struct tcp_conn_t *tcp_conn_select(struct tcp_sock_t *sock,
-				   struct tcp_sock_t *sock6);
+struct tcp_conn_t *tcp_conn_accept(struct tcp_sock_t *);
+int tcp_conn_is_readable(struct tcp_conn_t *);
+int tcp_request_expects_continue(const struct http_message_t *);
 void tcp_conn_close(struct tcp_conn_t *);
 
 struct http_packet_t *tcp_packet_get(struct tcp_conn_t *,
                                      struct http_message_t *);
 int tcp_packet_send(struct tcp_conn_t *, struct http_packet_t *);
+ssize_t tcp_body_get(struct tcp_conn_t *, struct http_message_t *,
+		     uint8_t *, size_t, int);
+int tcp_send(struct tcp_conn_t *, const void *, size_t);
@@ -0,0 +1,258 @@
+/* Copyright (C) 2014 Daniel Dressler and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "logging.h"
+#include "tcp.h"
+#include "timeouts.h"
+
+/* All deadlines of all connections, in hierarchical timing wheels
+   with a slot per second: the first wheel holds what expires within
+   the current turn of it, the second one what expires in later turns,
+   moved down to the first wheel when its turn comes. Arming, moving
+   and canceling a deadline take constant time, however many
+   connections there are. A thread of its own advances the wheels,
+   whatever the reactor and the workers are stuck in. */
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t stopped;
+  pthread_t thread;
+  int is_running;
+  int is_stopping;
+  uint64_t current;
+  /* Heads of circular lists */
+  struct timeout_t slots[TIMEOUTS_NUM_WHEELS][TIMEOUTS_WHEEL_SIZE];
+} timeouts = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .stopped = PTHREAD_COND_INITIALIZER
+};
+
+static const char *const timeout_reasons[] = {
+  "idle for too long",
+  "no complete request header in time",
+  "client stopped sending its request",
+  "client stopped taking the response"
+};
+
+/* Only the thread serving the connection closes it, a blocked read or
+   write of it returns right away */
+static void timeout_fire(struct timeout_t *timeout, const char *reason)
+{
+  timeout->is_expired = 1;
+  NOTE("TCP: Closing connection, %s", reason);
+  shutdown(timeout->conn->sd, SHUT_RDWR);
+}
+
+/* In seconds, on a clock which is never set back */
+uint64_t timeouts_now(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec;
+}
+
+static void timeouts_init(void)
+{
+  pthread_mutex_lock(&timeouts.lock);
+  for (int wheel = 0; wheel < TIMEOUTS_NUM_WHEELS; wheel++)
+    for (int i = 0; i < TIMEOUTS_WHEEL_SIZE; i++) {
+      struct timeout_t *head = &timeouts.slots[wheel][i];
+      head->prev = head;
+      head->next = head;
+    }
+  timeouts.current = timeouts_now();
+  pthread_mutex_unlock(&timeouts.lock);
+}
+
+static void timeout_unlink(struct timeout_t *timeout)
+{
+  timeout->prev->next = timeout->next;
+  timeout->next->prev = timeout->prev;
+  timeout->prev = NULL;
+  timeout->next = NULL;
+}
+
+/* Deadlines before the earliest second still to come are moved to
+   it */
+static void timeout_link(struct timeout_t *timeout, uint64_t earliest)
+{
+  if (timeout->expires < earliest)
+    timeout->expires = earliest;
+  uint64_t expires = timeout->expires;
+
+  struct timeout_t *head;
+  if (expires >> TIMEOUTS_WHEEL_BITS ==
+      timeouts.current >> TIMEOUTS_WHEEL_BITS)
+    head = &timeouts.slots[0][expires % TIMEOUTS_WHEEL_SIZE];
+  else {
+    /* Beyond the second wheel it waits in its last slot, and comes
+       back there until its turn */
+    uint64_t turn = expires >> TIMEOUTS_WHEEL_BITS;
+    uint64_t last = (timeouts.current >> TIMEOUTS_WHEEL_BITS) +
+      TIMEOUTS_WHEEL_SIZE - 1;
+    if (turn > last)
+      turn = last;
+    head = &timeouts.slots[1][turn % TIMEOUTS_WHEEL_SIZE];
+  }
+  timeout->prev = head->prev;
+  timeout->next = head;
+  head->prev->next = timeout;
+  head->prev = timeout;
+}
+
+/* Give the connection till the deadline, replacing the one it had */
+void timeout_arm_at(struct timeout_t *timeout, struct tcp_conn_t *conn,
+		    enum timeout_kind_t kind, uint64_t expires)
+{
+  pthread_mutex_lock(&timeouts.lock);
+  if (timeout->next != NULL)
+    timeout_unlink(timeout);
+  timeout->conn = conn;
+  timeout->kind = kind;
+  timeout->expires = expires;
+  timeout->is_expired = 0;
+  if (timeouts.is_stopping)
+    timeout_fire(timeout, "shutting down");
+  else
+    timeout_link(timeout, timeouts.current + 1);
+  pthread_mutex_unlock(&timeouts.lock);
+}
+
+void timeout_arm(struct timeout_t *timeout, struct tcp_conn_t *conn,
+		 enum timeout_kind_t kind, int seconds)
+{
+  timeout_arm_at(timeout, conn, kind, timeouts_now() + (uint64_t)seconds);
+}
+
+/* Whether the deadline had passed. Afterwards the connection is not
+   touched here any more and may be closed. */
+int timeout_cancel(struct timeout_t *timeout)
+{
+  pthread_mutex_lock(&timeouts.lock);
+  if (timeout->next != NULL)
+    timeout_unlink(timeout);
+  int is_expired = timeout->is_expired;
+  timeout->is_expired = 0;
+  pthread_mutex_unlock(&timeouts.lock);
+  return is_expired;
+}
+
+static void timeouts_expire(struct timeout_t *head, const char *reason)
+{
+  while (head->next != head) {
+    struct timeout_t *timeout = head->next;
+    timeout_unlink(timeout);
+    timeout_fire(timeout, reason != NULL ? reason :
+		 timeout_reasons[timeout->kind]);
+  }
+}
+
+/* Shut down the connections whose deadline passed since the last
+   call */
+static void timeouts_advance(void)
+{
+  uint64_t now = timeouts_now();
+  pthread_mutex_lock(&timeouts.lock);
+  while (timeouts.current < now) {
+    timeouts.current++;
+    size_t index = timeouts.current % TIMEOUTS_WHEEL_SIZE;
+
+    /* A new turn of the first wheel, take over what is due in it */
+    if (index == 0) {
+      struct timeout_t *head =
+	&timeouts.slots[1][(timeouts.current >> TIMEOUTS_WHEEL_BITS) %
+			   TIMEOUTS_WHEEL_SIZE];
+      struct timeout_t *first = head->next;
+      struct timeout_t *last = head->prev;
+      head->prev = head;
+      head->next = head;
+      if (first != head) {
+	/* Detach the list first, timeout_link() may put entries back
+	   into this slot */
+	last->next = NULL;
+	while (first != NULL) {
+	  struct timeout_t *timeout = first;
+	  first = first->next;
+	  timeout_link(timeout, timeouts.current);
+	}
+      }
+    }
+    timeouts_expire(&timeouts.slots[0][index], NULL);
+  }
+  pthread_mutex_unlock(&timeouts.lock);
+}
+
+static void *timeouts_run(void *arg_void)
+{
+  (void)arg_void;
+
+  /* Signals are for the main loop */
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+  pthread_mutex_lock(&timeouts.lock);
+  while (!timeouts.is_stopping) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec++;
+    pthread_cond_timedwait(&timeouts.stopped, &timeouts.lock, &deadline);
+    if (timeouts.is_stopping)
+      break;
+    pthread_mutex_unlock(&timeouts.lock);
+    timeouts_advance();
+    pthread_mutex_lock(&timeouts.lock);
+  }
+  pthread_mutex_unlock(&timeouts.lock);
+  return NULL;
+}
+
+int timeouts_start(void)
+{
+  timeouts_init();
+  int status = pthread_create(&timeouts.thread, NULL, timeouts_run, NULL);
+  if (status != 0) {
+    ERR("Timeouts: Failed to spawn thread, error %d", status);
+    return -1;
+  }
+  timeouts.is_running = 1;
+  return 0;
+}
+
+/* Shuts down every connection with a deadline, and from now on every
+   one which gets one, so that whoever serves them finishes soon */
+void timeouts_stop(void)
+{
+  if (!timeouts.is_running)
+    return;
+  pthread_mutex_lock(&timeouts.lock);
+  timeouts.is_stopping = 1;
+  for (int wheel = 0; wheel < TIMEOUTS_NUM_WHEELS; wheel++)
+    for (int i = 0; i < TIMEOUTS_WHEEL_SIZE; i++)
+      timeouts_expire(&timeouts.slots[wheel][i], "shutting down");
+  pthread_cond_signal(&timeouts.stopped);
+  pthread_mutex_unlock(&timeouts.lock);
+
+  pthread_join(timeouts.thread, NULL);
+  timeouts.is_running = 0;
+}
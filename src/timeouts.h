@@ -0,0 +1,58 @@
+/* Copyright (C) 2014 Daniel Dressler and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. */
+
+#pragma once
+#include <stdint.h>
+
+/* In seconds: for the whole header of a request, for the client to
+   send more of a body, or to take more of a response */
+#define TIMEOUT_HEADER 10
+#define TIMEOUT_BODY 10
+#define TIMEOUT_SEND 10
+
+/* The wheels, slots of a second and of a turn of the first wheel */
+#define TIMEOUTS_WHEEL_BITS 6
+#define TIMEOUTS_WHEEL_SIZE (1 << TIMEOUTS_WHEEL_BITS)
+#define TIMEOUTS_NUM_WHEELS 2
+
+enum timeout_kind_t {
+  TIMEOUT_KIND_IDLE,
+  TIMEOUT_KIND_HEADER,
+  TIMEOUT_KIND_BODY,
+  TIMEOUT_KIND_SEND
+};
+
+struct tcp_conn_t;
+
+/* A deadline of a connection, unarmed when zeroed. Once it passes the
+   connection is shut down, whoever waits on it gets an error and
+   closes it. */
+struct timeout_t {
+  struct timeout_t *prev;
+  struct timeout_t *next;
+  uint64_t expires;
+  enum timeout_kind_t kind;
+  struct tcp_conn_t *conn;
+  uint8_t is_expired;
+};
+
+int timeouts_start(void);
+void timeouts_stop(void);
+
+void timeout_arm(struct timeout_t *, struct tcp_conn_t *,
+		 enum timeout_kind_t, int);
+void timeout_arm_at(struct timeout_t *, struct tcp_conn_t *,
+		    enum timeout_kind_t, uint64_t);
+int timeout_cancel(struct timeout_t *);
+uint64_t timeouts_now(void);
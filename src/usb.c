@@ -493,10 +493,8 @@ static int LIBUSB_CALL usb_exit_on_unplug(libusb_context *context,
       dnssd_shutdown();
 
     /* TCP clean-up */
-    if (g_options.tcp_socket!= NULL)
-      tcp_close(g_options.tcp_socket);
-    if (g_options.tcp6_socket!= NULL)
-      tcp_close(g_options.tcp6_socket);
+    for (int i = 0; i < g_options.num_tcp_sockets; i++)
+      tcp_close(g_options.tcp_sockets[i]);
 
     exit(0);
   }
@@ -601,6 +599,48 @@ static int usb_all_conns_staled(struct usb_sock_t *usb)
   return staled;
 }
 
+static struct usb_conn_t *usb_conn_take(struct usb_sock_t *);
+
+/* Reads away what the printer still sends after a response without
+   length, which would otherwise come before the answer to the next
+   request on the interface. An interface which does not go quiet is
+   not handed out. */
+static int usb_conn_settle(struct usb_conn_t *conn)
+{
+  uint8_t buffer[4 * 512];
+  size_t dropped = 0;
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (;;) {
+    int gotten_size = 0;
+    int status = libusb_bulk_transfer(conn->parent->printer,
+				      conn->interface->endpoint_in,
+				      buffer, sizeof(buffer), &gotten_size,
+				      USB_SETTLE_TIMEOUT);
+    if (gotten_size > 0)
+      dropped += (size_t)gotten_size;
+    if (status == LIBUSB_ERROR_TIMEOUT && gotten_size == 0)
+      break;
+    if (status != 0 && status != LIBUSB_ERROR_TIMEOUT) {
+      ERR("Interface #%d: Settling failed with error code %d",
+	  conn->interface_index, status);
+      return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec - start.tv_sec >= PRINTER_CRASH_TIMEOUT_ANSWER ||
+	g_options.terminate) {
+      ERR("Interface #%d: Printer keeps sending after a response without length",
+	  conn->interface_index);
+      return -1;
+    }
+  }
+  if (dropped > 0)
+    WARN("Interface #%d: Dropped %lu bytes which came after a response without length",
+	 conn->interface_index, dropped);
+  conn->interface->is_unsettled = 0;
+  return 0;
+}
+
 struct usb_conn_t *usb_conn_acquire(struct usb_sock_t *usb)
 {
   int i;
@@ -619,6 +659,18 @@ struct usb_conn_t *usb_conn_acquire(struct usb_sock_t *usb)
     usleep(100000);
   }
 
+  return usb_conn_take(usb);
+}
+
+struct usb_conn_t *usb_conn_try_acquire(struct usb_sock_t *usb)
+{
+  if (usb->num_avail <= 0)
+    return NULL;
+  return usb_conn_take(usb);
+}
+
+static struct usb_conn_t *usb_conn_take(struct usb_sock_t *usb)
+{
   struct usb_conn_t *conn = calloc(1, sizeof(*conn));
   if (conn == NULL) {
     ERR("Failed to alloc space for usb connection");
@@ -629,6 +681,12 @@ struct usb_conn_t *usb_conn_acquire(struct usb_sock_t *usb)
   {
     conn->parent = usb;
 
+    /* Another thread may have taken the last interface meanwhile */
+    if (usb->num_avail <= 0) {
+      NOTE("No free USB interface left");
+      goto acquire_error;
+    }
+
     uint32_t slot = usb->num_taken;
 
     conn->interface_index = usb->interface_pool[slot];
@@ -687,6 +745,11 @@ struct usb_conn_t *usb_conn_acquire(struct usb_sock_t *usb)
     usb->num_avail--;
   }
   sem_post(&usb->pool_manage_lock);
+
+  if (conn->interface->is_unsettled && usb_conn_settle(conn) != 0) {
+    usb_conn_release(conn);
+    return NULL;
+  }
   return conn;
 
  acquire_error:
@@ -725,32 +788,67 @@ void usb_conn_release(struct usb_conn_t *conn)
   sem_post(&usb->pool_manage_lock);
 }
 
-int usb_conn_packet_send(struct usb_conn_t *conn, struct http_packet_t *pkt)
+/* Memory for data going out in bulk transfers which the kernel's USB
+   driver uses as it is, instead of copying every byte into a buffer
+   of its own first. Plain memory where the kernel or libusb cannot do
+   that, is_dma tells which one it is for usb_buffer_free(). */
+uint8_t *usb_buffer_alloc(struct usb_sock_t *usb, size_t size, int *is_dma)
+{
+  *is_dma = 0;
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+  if (usb != NULL) {
+    uint8_t *data = libusb_dev_mem_alloc(usb->printer, size);
+    if (data != NULL) {
+      NOTE("USB: Transfer buffer of %lu bytes in device memory", size);
+      *is_dma = 1;
+      return data;
+    }
+  }
+#else
+  IGNORE(usb);
+#endif
+  return malloc(size);
+}
+
+void usb_buffer_free(struct usb_sock_t *usb, uint8_t *data, size_t size,
+		     int is_dma)
+{
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+  if (is_dma) {
+    libusb_dev_mem_free(usb->printer, data, size);
+    return;
+  }
+#else
+  IGNORE(usb);
+  IGNORE(is_dma);
+#endif
+  IGNORE(size);
+  free(data);
+}
+
+/* One bulk transfer for all of data, libusb splits it as needed */
+int usb_conn_send(struct usb_conn_t *conn, const uint8_t *data, size_t size)
 {
   int size_sent = 0;
   const int timeout = 1000; /* 1 sec */
   int num_timeouts = 0;
   size_t sent = 0;
-  size_t pending = pkt->filled_size;
-  while (pending > 0 && !g_options.terminate) {
-    int to_send = (int)pending;
-
-    NOTE("P %p: USB: want to send %d bytes", pkt, to_send);
+  while (sent < size && !g_options.terminate) {
+    int to_send = size - sent > INT_MAX ? INT_MAX : (int)(size - sent);
+    NOTE("USB: want to send %d bytes", to_send);
     int status = libusb_bulk_transfer(conn->parent->printer,
 				      conn->interface->endpoint_out,
-				      pkt->buffer + sent, to_send,
+				      (unsigned char *)data + sent, to_send,
 				      &size_sent, timeout);
     if (status == LIBUSB_ERROR_NO_DEVICE) {
-      ERR("P %p: Printer has been disconnected",
-	  pkt);
+      ERR("USB: Printer has been disconnected");
       return -1;
     }
     if (status == LIBUSB_ERROR_TIMEOUT) {
-      NOTE("P %p: USB: send timed out, retrying", pkt);
+      NOTE("USB: send timed out, retrying");
 
       if (num_timeouts++ > PRINTER_CRASH_TIMEOUT_RECEIVE) {
-	ERR("P %p: Usb send fully timed out",
-	    pkt);
+	ERR("USB: send fully timed out");
 	return -1;
       }
 
@@ -762,29 +860,51 @@ int usb_conn_packet_send(struct usb_conn_t *conn, struct http_packet_t *pkt)
       if (size_sent == 0)
 	continue;
     } else if (status < 0) {
-      ERR("P %p: USB: send failed with status %s",
-	  pkt, libusb_error_name(status));
+      ERR("USB: send failed with status %s", libusb_error_name(status));
       return -1;
     }
     if (size_sent < 0) {
-      ERR("P %p: Unexpected negative size_sent",
-	  pkt);
+      ERR("USB: Unexpected negative size_sent");
       return -1;
     }
 
-    pending -= (size_t) size_sent;
     sent += (size_t) size_sent;
-    NOTE("P %p: USB: sent %d bytes", pkt, size_sent);
+    NOTE("USB: sent %d bytes", size_sent);
+  }
+  return 0;
+}
+
+int usb_conn_packet_send(struct usb_conn_t *conn, struct http_packet_t *pkt)
+{
+  size_t sent = 0;
+  while (sent < pkt->filled_size && !g_options.terminate) {
+    /* One bulk transfer per segment */
+    struct iovec iov;
+    if (packet_iovec(pkt, sent, &iov, 1) == 0) {
+      ERR("P %p: USB: packet shorter than its filled size", pkt);
+      return -1;
+    }
+    NOTE("P %p: USB: sending %lu bytes", pkt, iov.iov_len);
+    if (usb_conn_send(conn, iov.iov_base, iov.iov_len) != 0)
+      return -1;
+    sent += iov.iov_len;
   }
   NOTE("P %p: USB: sent %d bytes in total", pkt, sent);
   return 0;
 }
 
-struct http_packet_t *usb_conn_packet_get(struct usb_conn_t *conn, struct http_message_t *msg)
+/* With wait, the first read gives up after that many milliseconds
+   without a byte, the packet then comes back empty */
+static struct http_packet_t *usb_conn_packet_read(struct usb_conn_t *conn,
+						  struct http_message_t *msg,
+						  int wait)
 {
   if (msg->is_completed)
     return NULL;
 
+  /* Responses go on to the client read by read */
+  msg->is_streamed = 1;
+
   struct http_packet_t *pkt = packet_new(msg);
   if (pkt == NULL) {
     ERR("failed to create packet for incoming usb message");
@@ -792,7 +912,6 @@ struct http_packet_t *usb_conn_packet_get(struct usb_conn_t *conn, struct http_m
   }
 
   /* File packet */
-  const int timeout = 1000; /* 1 sec */
   size_t read_size_ulong = packet_pending_bytes(pkt);
   if (read_size_ulong == 0)
     return pkt;
@@ -806,17 +925,25 @@ struct http_packet_t *usb_conn_packet_get(struct usb_conn_t *conn, struct http_m
     /* Pad read_size to multiple of usb's max packet size */
     read_size += (512 - (read_size % 512)) % 512;
 
-    /* Expand buffer if needed */
-    if (pkt->buffer_capacity < pkt->filled_size + read_size_ulong)
-      if (packet_expand(pkt) < 0) {
-	ERR("Failed to ensure room for usb pkt");
-	goto cleanup;
-      }
-
+    /* Room for whole USB packets, in a new segment if needed */
+    size_t space = 0;
+    uint8_t *dst = packet_write_ptr(pkt, 512, &space);
+    if (dst == NULL) {
+      ERR("Failed to ensure room for usb pkt");
+      goto cleanup;
+    }
+    if ((size_t)read_size > space)
+      read_size = (int)space;
+
+    int timeout = 1000; /* 1 sec */
+    if (msg->type == HTTP_IDLE_DELIMITED)
+      timeout = g_options.response_idle;
+    if (wait > 0)
+      timeout = wait;
     int gotten_size = 0;
     int status = libusb_bulk_transfer(conn->parent->printer,
 		                      conn->interface->endpoint_in,
-		                      pkt->buffer + pkt->filled_size,
+				      dst,
 		                      read_size,
 		                      &gotten_size, timeout);
 
@@ -825,10 +952,25 @@ struct http_packet_t *usb_conn_packet_get(struct usb_conn_t *conn, struct http_m
       goto cleanup;
     }
 
+    if (wait > 0 && gotten_size == 0 &&
+	(status == 0 || status == LIBUSB_ERROR_TIMEOUT)) {
+      NOTE("USB: Nothing from the printer within %d ms", wait);
+      return pkt;
+    }
+    wait = 0;
+
     if (status != 0 && status != LIBUSB_ERROR_TIMEOUT) {
       ERR("bulk xfer failed with error code %d", status);
       ERR("tried reading %d bytes", read_size);
       goto cleanup;
+    } else if (status == LIBUSB_ERROR_TIMEOUT && gotten_size == 0 &&
+	       msg->type == HTTP_IDLE_DELIMITED) {
+      /* Nothing else tells that the response is over */
+      NOTE("USB: Printer went quiet, response without length ends after %lu bytes",
+	   msg->received_size);
+      conn->interface->is_unsettled = 1;
+      msg->is_completed = 1;
+      break;
     } else if (status == LIBUSB_ERROR_TIMEOUT) {
       ERR("bulk xfer timed out, retrying ...");
       ERR("tried reading %d bytes, actually read %d bytes",
@@ -888,8 +1030,7 @@ struct http_packet_t *usb_conn_packet_get(struct usb_conn_t *conn, struct http_m
 	     times_staled / TIMEOUT_RATIO);
 	if (pkt->filled_size > 0)
 	  NOTE("Packet so far \n===\n%s===\n",
-	       hexdump(pkt->buffer,
-		       pkt->filled_size));
+	       packet_hexdump(pkt));
       }
  
       if (times_staled > stale_timeout) {
@@ -911,11 +1052,17 @@ struct http_packet_t *usb_conn_packet_get(struct usb_conn_t *conn, struct http_m
     }
     packet_mark_received(pkt, (size_t)gotten_size);
     read_size_ulong = packet_pending_bytes(pkt);
+
+    /* Once the header tells how the message ends, whatever came in
+       goes on right away instead of waiting for the rest */
+    if (gotten_size > 0 && msg->type != HTTP_UNSET)
+      break;
   }
   NOTE("USB: Received %d bytes of %d with type %d",
        pkt->filled_size, pkt->expected_size, msg->type);
 
-  if (pkt->filled_size == 0)
+  /* An empty packet only ends a response without length */
+  if (pkt->filled_size == 0 && !msg->is_completed)
     goto cleanup;
 
   return pkt;
@@ -925,3 +1072,17 @@ struct http_packet_t *usb_conn_packet_get(struct usb_conn_t *conn, struct http_m
     packet_free(pkt);
   return NULL;
 }
+
+struct http_packet_t *usb_conn_packet_get(struct usb_conn_t *conn, struct http_message_t *msg)
+{
+  return usb_conn_packet_read(conn, msg, 0);
+}
+
+/* An answer the printer may or may not give, like to a request which
+   expects 100-continue: an empty packet when nothing came in time */
+struct http_packet_t *usb_conn_packet_wait(struct usb_conn_t *conn,
+					   struct http_message_t *msg,
+					   int wait)
+{
+  return usb_conn_packet_read(conn, msg, wait);
+}
@@ -22,6 +22,15 @@
 #define PRINTER_CRASH_TIMEOUT_ANSWER 5
 #define CONN_STALE_THRESHHOLD 5
 
+/* In milliseconds: a response without a length is over once the
+   printer sent nothing for this long, by default */
+#define USB_IDLE_TIMEOUT 2000
+
+/* In milliseconds: anything the printer sends after such a response
+   ended is read away until it is quiet for this long, up to
+   PRINTER_CRASH_TIMEOUT_ANSWER seconds */
+#define USB_SETTLE_TIMEOUT 100
+
 struct usb_interface {
   uint8_t interface_number;
   uint8_t libusb_interface_index;
@@ -29,6 +38,10 @@ struct usb_interface {
   uint8_t endpoint_in;
   uint8_t endpoint_out;
   sem_t lock;
+
+  /* A response without length ended when the printer went quiet, the
+     rest of it may still come */
+  int is_unsettled;
 };
 
 struct usb_sock_t {
@@ -64,7 +77,14 @@ int usb_can_callback(struct usb_sock_t *);
 void usb_register_callback(struct usb_sock_t *);
 
 struct usb_conn_t *usb_conn_acquire(struct usb_sock_t *);
+struct usb_conn_t *usb_conn_try_acquire(struct usb_sock_t *);
 void usb_conn_release(struct usb_conn_t *);
 
+uint8_t *usb_buffer_alloc(struct usb_sock_t *, size_t, int *);
+void usb_buffer_free(struct usb_sock_t *, uint8_t *, size_t, int);
+
+int usb_conn_send(struct usb_conn_t *, const uint8_t *, size_t);
 int usb_conn_packet_send(struct usb_conn_t *, struct http_packet_t *);
 struct http_packet_t *usb_conn_packet_get(struct usb_conn_t *, struct http_message_t *);
+struct http_packet_t *usb_conn_packet_wait(struct usb_conn_t *,
+					   struct http_message_t *, int);
@@ -0,0 +1,191 @@
+/* Copyright (C) 2014 Daniel Dressler and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "options.h"
+#include "logging.h"
+#include "workers.h"
+
+/* Threads started once which serve the connections the reactor hands
+   on. A burst of clients, like right after the printer got announced,
+   costs no thread creation, and the number of threads, each with its
+   stack, stays fixed however many clients there are. */
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t queued;
+  pthread_cond_t taken;
+
+  workers_serve_t serve;
+  void *context;
+  pthread_t *threads;
+  int num_threads;
+  int is_stopping;
+
+  /* Connections waiting for a worker, a ring */
+  struct tcp_conn_t *queue[WORKERS_QUEUE_SIZE];
+  size_t queue_head;
+  size_t queue_count;
+  int next_num;
+
+  /* Statistics */
+  int num_busy;
+  int peak_busy;
+  size_t peak_queued;
+  unsigned long served;
+} workers = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .queued = PTHREAD_COND_INITIALIZER,
+  .taken = PTHREAD_COND_INITIALIZER
+};
+
+static void *workers_run(void *arg_void)
+{
+  (void)arg_void;
+
+  /* Signals are for the main loop */
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+  pthread_mutex_lock(&workers.lock);
+  for (;;) {
+    while (workers.queue_count == 0 && !workers.is_stopping)
+      pthread_cond_wait(&workers.queued, &workers.lock);
+    if (workers.queue_count == 0)
+      break;
+    struct tcp_conn_t *conn = workers.queue[workers.queue_head];
+    workers.queue_head = (workers.queue_head + 1) % WORKERS_QUEUE_SIZE;
+    workers.queue_count--;
+    int num = ++workers.next_num;
+    workers.num_busy++;
+    if (workers.num_busy > workers.peak_busy)
+      workers.peak_busy = workers.num_busy;
+    pthread_cond_signal(&workers.taken);
+    pthread_mutex_unlock(&workers.lock);
+
+    workers.serve(conn, num, workers.context);
+
+    pthread_mutex_lock(&workers.lock);
+    workers.num_busy--;
+    workers.served++;
+  }
+  pthread_mutex_unlock(&workers.lock);
+  return NULL;
+}
+
+int workers_start(int num_threads, size_t stack_size,
+		  workers_serve_t serve, void *context)
+{
+  workers.serve = serve;
+  workers.context = context;
+  workers.threads = calloc((size_t)num_threads, sizeof(pthread_t));
+  if (workers.threads == NULL) {
+    ERR("Workers: Failed to alloc space for %d threads", num_threads);
+    return -1;
+  }
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  if (stack_size > 0 && pthread_attr_setstacksize(&attr, stack_size) != 0)
+    WARN("Workers: Stack size of %lu bytes refused, using the default",
+	 stack_size);
+
+  for (int i = 0; i < num_threads; i++) {
+    int status = pthread_create(&workers.threads[i], &attr, workers_run,
+				NULL);
+    if (status != 0) {
+      ERR("Workers: Failed to spawn thread, error %d", status);
+      break;
+    }
+    workers.num_threads++;
+  }
+  pthread_attr_destroy(&attr);
+  if (workers.num_threads == 0)
+    return -1;
+
+  NOTE("Workers: %d threads with %lu KiB stack", workers.num_threads,
+       stack_size / 1024);
+  return 0;
+}
+
+/* Let every worker finish its connection, those waiting for a worker
+   are closed */
+void workers_stop(void)
+{
+  pthread_mutex_lock(&workers.lock);
+  workers.is_stopping = 1;
+  while (workers.queue_count > 0) {
+    tcp_conn_close(workers.queue[workers.queue_head]);
+    workers.queue_head = (workers.queue_head + 1) % WORKERS_QUEUE_SIZE;
+    workers.queue_count--;
+  }
+  pthread_cond_broadcast(&workers.queued);
+  pthread_cond_broadcast(&workers.taken);
+  pthread_mutex_unlock(&workers.lock);
+
+  for (int i = 0; i < workers.num_threads; i++)
+    pthread_join(workers.threads[i], NULL);
+  workers_report();
+  free(workers.threads);
+  workers.threads = NULL;
+  workers.num_threads = 0;
+}
+
+/* Queue a connection for the next free worker, waits while the queue
+   is full */
+int workers_submit(struct tcp_conn_t *conn)
+{
+  pthread_mutex_lock(&workers.lock);
+  while (workers.queue_count == WORKERS_QUEUE_SIZE && !workers.is_stopping &&
+	 !g_options.terminate) {
+    /* Nobody else would wake us for a shutdown */
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec++;
+    pthread_cond_timedwait(&workers.taken, &workers.lock, &deadline);
+  }
+  if (workers.is_stopping || g_options.terminate) {
+    pthread_mutex_unlock(&workers.lock);
+    tcp_conn_close(conn);
+    return -1;
+  }
+  size_t tail = (workers.queue_head + workers.queue_count) %
+    WORKERS_QUEUE_SIZE;
+  workers.queue[tail] = conn;
+  workers.queue_count++;
+  if (workers.queue_count > workers.peak_queued)
+    workers.peak_queued = workers.queue_count;
+  pthread_cond_signal(&workers.queued);
+  pthread_mutex_unlock(&workers.lock);
+  return 0;
+}
+
+void workers_report(void)
+{
+  pthread_mutex_lock(&workers.lock);
+  NOTE("Workers: %d of %d busy (peak %d), %lu connections queued "
+       "(peak %lu), %lu served", workers.num_busy, workers.num_threads,
+       workers.peak_busy, workers.queue_count, workers.peak_queued,
+       workers.served);
+  pthread_mutex_unlock(&workers.lock);
+}
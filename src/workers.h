@@ -0,0 +1,34 @@
+/* Copyright (C) 2014 Daniel Dressler and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. */
+
+#pragma once
+#include <stddef.h>
+
+#include "tcp.h"
+
+#define WORKERS_DEFAULT_THREADS 16
+/* In KiB */
+#define WORKERS_DEFAULT_STACK 256
+/* Connections waiting for a worker, the reactor waits beyond that */
+#define WORKERS_QUEUE_SIZE 256
+
+/* Serves a connection with a request, gets its number for the log and
+   the context given to workers_start() */
+typedef void (*workers_serve_t)(struct tcp_conn_t *, int, void *);
+
+int workers_start(int, size_t, workers_serve_t, void *);
+void workers_stop(void);
+
+int workers_submit(struct tcp_conn_t *);
+void workers_report(void);